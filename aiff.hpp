@@ -1,6 +1,7 @@
 #include "file.hpp"
 #include "pcm24.hpp"
-#include <numeric>
+#include <algorithm>
+#include <cmath>
 typedef struct form_chunk_t
 {
 	char FORM[4];
@@ -17,6 +18,7 @@ typedef struct common_chunk_t
 	uint32_t numFrames;
 	uint16_t bps;
 	unsigned long sampleRate;
+	char compression[4];
 } CommonChunk;
 
 typedef struct sound_chunk_t
@@ -29,134 +31,282 @@ typedef struct sound_chunk_t
 
 struct AIFFFile : public File
 {
-	FormChunk form;
-	CommonChunk common;
-	SoundChunk snd;
+	FormChunk form{};
+	CommonChunk common{};
+	SoundChunk snd{};
 	AIFFFile() = delete;
-	AIFFFile(std::string name)
+	AIFFFile(std::string name, bool headerOnly = false)
 	{
+		headeronly = headerOnly;
 		LoadAIFFFile(name);
 	}
 
+	/*
+	 * Parses the headers of a pipe or other stream, the samples are read on demand with
+	 * FillSamples. Without streaming the whole stream is read up front, like a file.
+	 */
+	explicit AIFFFile(std::istream& stream, bool streaming = true)
+	{
+		streamed = streaming;
+		LoadAIFFStream(stream);
+	}
+
 	~AIFFFile() = default;
+
+protected:
+	/* AIFF 8 bit samples are signed and wider ones big endian, the converters expect offset little endian. */
+	void PrepareSamples(uint64_t begin, uint64_t end) override
+	{
+		if (bps == 8)
+		{
+			for (uint64_t i = begin; i < end; i++)
+				samples[i] ^= 0x80;
+		}
+		else if (!littleEndian)
+		{
+			uint32_t stride = bps / 8;
+			for (uint64_t i = begin; i + stride <= end; i += stride)
+				std::reverse(samples + i, samples + i + stride);
+		}
+	}
+
 private:
+	bool littleEndian = false;
+	uint16_t sustainMode{};
+	int16_t sustainBegin{}, sustainEnd{};
+	std::vector<std::pair<int16_t, uint32_t>> markers;
+
 	void LoadAIFFFile(std::string name)
 	{
-		auto filedata = LoadFile(name);
-		auto buffer = filedata.begin();
-		int32_t stride = 0;
-		while (buffer != filedata.end())
+		std::ifstream filehandle(name, std::ios::binary);
+
+		if (!filehandle.is_open())
+			throw std::runtime_error("File is unable to be opened");
+
+		LoadAIFFStream(filehandle);
+	}
+
+	/*
+	 * Walks the chunks of an AIFF or AIFF-C stream, reading COMM and the SSND payload and
+	 * skipping everything else. Sample data is byte swapped in place once both are known.
+	 */
+	void LoadAIFFStream(std::istream& stream)
+	{
+		TRACE_SCOPE("ParseAiff");
+		uint8_t tag[18];
+		preparestride = 0;
+
+		if (!ReadBytes(stream, tag, 12) || std::string(tag, tag + 4) != "FORM")
+			throw std::runtime_error("File is not an AIFF file");
+
+		std::copy(tag, tag + 4, &form.FORM[0]);
+		form.formSize = ConvertBigEndian<uint32_t>(tag + 4);
+		std::copy(tag + 8, tag + 12, &form.AIFF[0]);
+
+		std::string formType(tag + 8, tag + 12);
+		if (formType != "AIFF" && formType != "AIFC")
+			throw std::runtime_error("File is not an AIFF or AIFF-C file");
+
+		std::copy_n("NONE", 4, &common.compression[0]);
+
+		bool foundCommon = false, foundSound = false;
+		while (!(foundCommon && foundSound) && ReadBytes(stream, tag, 8))
 		{
-			std::string chunkID(buffer, buffer + 4);
-			if (chunkID == "FORM")
-			{
-				std::copy(buffer, buffer + 4, &form.FORM[0]);
-				form.formSize = ConvertBigEndian<uint32_t>(buffer+4);
-				std::copy(buffer+8, buffer + 12, &form.AIFF[0]);
-				stride = 12;
-			}
-			else if (chunkID == "COMM")
+			std::string chunkID(tag, tag + 4);
+			uint64_t chunkSize = ConvertBigEndian<uint32_t>(tag + 4);
+			uint64_t padding = chunkSize % 2;
+
+			if (chunkID == "COMM")
 			{
-				std::copy(buffer, buffer + 4, &common.COMM[0]);
-				common.size = ConvertBigEndian<uint32_t>(buffer+4);
-				common.channels = ConvertBigEndian<uint16_t>(buffer + 8);
-				common.numFrames = ConvertBigEndian<uint32_t>(buffer + 10);
-				common.bps = ConvertBigEndian<uint16_t>(buffer + 14);
-				common.sampleRate = convert80bitto32bit(buffer+16);
-				stride = common.size + 8;
+				if (chunkSize < 18)
+					throw std::runtime_error("AIFF COMM chunk is too short");
+
+				// only the AIFF-C compression type is read past the 18 AIFF bytes, its name is skipped
+				uint8_t comm[22];
+				uint64_t used = std::min<uint64_t>(chunkSize, sizeof(comm));
+				if (!ReadBytes(stream, comm, used) || !SkipBytes(stream, chunkSize - used))
+					throw std::runtime_error("AIFF COMM chunk is truncated");
+
+				std::copy(tag, tag + 4, &common.COMM[0]);
+				common.size = static_cast<uint32_t>(chunkSize);
+				common.channels = ConvertBigEndian<uint16_t>(&comm[0]);
+				common.numFrames = ConvertBigEndian<uint32_t>(&comm[2]);
+				common.bps = ConvertBigEndian<uint16_t>(&comm[6]);
+				common.sampleRate = convert80bitto32bit(&comm[8]);
+				if (formType == "AIFC" && chunkSize >= 22)
+					std::copy(&comm[18], &comm[22], &common.compression[0]);
+
+				SkipBytes(stream, padding);
+				foundCommon = true;
 			}
 			else if (chunkID == "SSND")
 			{
-				samplessize = snd.len = ConvertBigEndian<int32_t>(buffer + 4)-8;
-				samples = new (std::nothrow)uint8_t[samplessize];
-				snd.offset = ConvertBigEndian<int32_t>(buffer + 8);
-				snd.blockSize = ConvertBigEndian<int32_t>(buffer + 12);
-				switch (common.bps)
-				{
-				case 16:
-					SwapSamples<int16_t>(buffer + 12, buffer + 12 + samplessize);
-					break;
-				case 24:
-					SwapSamples<PCM24>(buffer + 12, buffer + 12 + samplessize);
-					break;
-				case 32:
-					SwapSamples<int32_t>(buffer + 12, buffer + 12 + samplessize);
-					break;
-				}
-				
-				std::copy(buffer + 12, buffer + 12 + samplessize, samples);
-				stride = 16 + samplessize;
+				if (chunkSize < 8 || !ReadBytes(stream, tag, 8))
+					throw std::runtime_error("AIFF SSND chunk is truncated");
+
+				snd.offset = ConvertBigEndian<uint32_t>(tag);
+				snd.blockSize = ConvertBigEndian<uint32_t>(tag + 4);
+				if (snd.offset > chunkSize - 8 || !SkipBytes(stream, snd.offset))
+					throw std::runtime_error("AIFF SSND offset is out of range");
+
+				uint64_t dataSize = chunkSize - 8 - snd.offset;
+				uint64_t remaining = RemainingBytes(stream);
+				if (remaining != UINT64_MAX && dataSize > remaining)
+					dataSize = remaining;
+
+				samplessize = ReadSamples(stream, dataSize);
+				snd.len = static_cast<uint32_t>(std::min<uint64_t>(samplessize, 0xFFFFFFFF));
+
+				// a stream can only be left at the samples when no chunk has to be read after them
+				if (!foundCommon)
+					FillSamples(UINT64_MAX);
+				if (!IsStreaming())
+					SkipBytes(stream, padding);
+				foundSound = true;
 			}
-			else if (chunkID == "ANNO" || chunkID == "NAME" || chunkID == "AUTH" || chunkID == "(c) ")
+			else if (chunkID == "INST" || chunkID == "MARK")
 			{
-				//pstring
-				uint32_t skip = ConvertBigEndian<uint32_t>(buffer + 4);
-				if (skip % 2) skip += 1;
-				stride = skip+8;
+				ReadLoopChunk(stream, chunkID, chunkSize);
 			}
-			else 
+			else if (!SkipBytes(stream, chunkSize + padding))
 			{
-				uint32_t skip = ConvertBigEndian<uint32_t>(buffer + 4);
-				stride = skip + 8;
+				throw std::runtime_error("AIFF chunk is truncated");
 			}
-
-			buffer += stride;
 		}
 
+		// INST and MARK may follow the samples, a pipe still being read cannot get there
+		if (!IsStreaming())
+			ReadTrailingChunks(stream);
+		ResolveLoop();
+
+		if (!foundCommon)
+			throw std::runtime_error("AIFF file does not have a COMM chunk");
+		if (!foundSound)
+			throw std::runtime_error("AIFF file does not have a SSND chunk");
+
 		samplerate = common.sampleRate;
 		channels = common.channels;
 		bps = common.bps;
-	}
 
-	template<typename IntType> IntType ConvertBigEndian(std::vector<uint8_t>::iterator buffer)
-	{
-		int stride;
-		if constexpr (std::is_same_v<IntType, PCM24>)
-		{
-			stride = 3;
-		} 
-		else
+		std::string compression(common.compression, common.compression + 4);
+		if (compression == "sowt")
+			littleEndian = true;
+		else if (compression == "fl32" || compression == "FL32" || compression == "fl64" || compression == "FL64")
 		{
-			stride = sizeof(IntType);
+			isfloat = true;
+			bps = (compression[2] == '3') ? 32 : 64;
 		}
-		return std::accumulate(buffer, buffer + stride, IntType{},
-			[](IntType acc, uint8_t byte) {
-				return (acc << 8) | static_cast<IntType>(byte);
-			});
+		else if (compression != "NONE" && compression != "twos")
+			throw std::runtime_error("Unsupported AIFF-C compression " + compression);
+
+		// frames past the COMM frame count are padding
+		uint64_t bytesperframe = static_cast<uint64_t>((bps + 7) / 8) * channels;
+		samplessize = std::min<uint64_t>(samplessize, bytesperframe * common.numFrames);
+
+		if (headeronly || !samples)
+			return;
+
+		if (bps != 8 && bps != 16 && bps != 24 && bps != 32 && bps != 64)
+			throw std::runtime_error("Unsupported AIFF sample size");
+
+		SetPrepareStride(bps / 8);
 	}
 
-	unsigned long long convert80bitto32bit(std::vector<uint8_t>::iterator buffer)
+	/* The sustain loop of INST names its begin and end by MARK ids, the markers hold the frames. */
+	void ReadLoopChunk(std::istream& stream, const std::string& chunkID, uint64_t chunkSize)
 	{
-		uint8_t exp = 30 - *(buffer + 1);
-		unsigned long fraction = ConvertBigEndian<unsigned long>(buffer + 2);
-		unsigned long last = 0;
-		while(exp--)
-		{ 
-			last = fraction;
-			fraction >>= 1;
+		uint64_t padding = chunkSize % 2;
+		if (chunkSize > (1u << 20))
+		{
+			if (!SkipBytes(stream, chunkSize + padding))
+				throw std::runtime_error("AIFF chunk is truncated");
+			return;
+		}
+
+		std::vector<uint8_t> body(chunkSize);
+		if (!ReadBytes(stream, body.data(), body.size()))
+			throw std::runtime_error("AIFF " + chunkID + " chunk is truncated");
+		SkipBytes(stream, padding);
+
+		if (chunkID == "INST" && body.size() >= 20)
+		{
+			sustainMode = ConvertBigEndian<uint16_t>(&body[8]);
+			sustainBegin = ConvertBigEndian<int16_t>(&body[10]);
+			sustainEnd = ConvertBigEndian<int16_t>(&body[12]);
 		}
-		if (last & 0x00000001) {
-			fraction++;
+		else if (chunkID == "MARK" && body.size() >= 2)
+		{
+			uint16_t count = ConvertBigEndian<uint16_t>(&body[0]);
+			size_t offset = 2;
+			for (uint16_t i = 0; i < count && offset + 7 <= body.size(); i++)
+			{
+				markers.emplace_back(ConvertBigEndian<int16_t>(&body[offset]), ConvertBigEndian<uint32_t>(&body[offset + 2]));
+				// the name is a pascal string padded to an even length including its count byte
+				offset += 6 + ((body[offset + 6] + 2) & ~1u);
+			}
 		}
-		return fraction;
 	}
 
-	template <typename T_Sample> void SwapSamples(std::vector<uint8_t>::iterator begin, std::vector<uint8_t>::iterator end)
+	/* Chunks after the samples only carry optional metadata, a damaged tail leaves the file as it was. */
+	void ReadTrailingChunks(std::istream& stream)
 	{
-		int stride;
-		if constexpr (std::is_same_v<T_Sample, PCM24>)
+		uint8_t tag[8];
+		try
 		{
-			stride = 3;
+			while (ReadBytes(stream, tag, 8))
+			{
+				std::string chunkID(tag, tag + 4);
+				uint64_t chunkSize = ConvertBigEndian<uint32_t>(tag + 4);
+				if (chunkID == "INST" || chunkID == "MARK")
+					ReadLoopChunk(stream, chunkID, chunkSize);
+				else if (!SkipBytes(stream, chunkSize + chunkSize % 2))
+					return;
+			}
 		}
-		else
+		catch (const std::runtime_error&)
 		{
-			stride = sizeof(T_Sample);
 		}
-		while (begin != end)
+	}
+
+	void ResolveLoop()
+	{
+		if (!sustainMode)
+			return;
+
+		auto position = [this](int16_t id) {
+			auto marker = std::find_if(markers.begin(), markers.end(), [id](const std::pair<int16_t, uint32_t>& m) { return m.first == id; });
+			return marker == markers.end() ? UINT64_MAX : static_cast<uint64_t>(marker->second);
+		};
+
+		uint64_t begin = position(sustainBegin), end = position(sustainEnd);
+		if (begin != UINT64_MAX && end != UINT64_MAX && begin < end)
 		{
-			*reinterpret_cast<T_Sample*>(&(*begin)) = ConvertBigEndian<T_Sample>(begin);
-			begin += stride;
+			looped = true;
+			loopstart = begin;
+			loopend = end;
 		}
 	}
 
-};
\ No newline at end of file
+	static bool ReadBytes(std::istream& stream, uint8_t* buffer, size_t count)
+	{
+		stream.read(reinterpret_cast<char*>(buffer), count);
+		return static_cast<size_t>(stream.gcount()) == count;
+	}
+
+	template<typename IntType> static IntType ConvertBigEndian(const uint8_t* buffer)
+	{
+		IntType value{};
+		for (size_t i = 0; i < sizeof(IntType); i++)
+			value = static_cast<IntType>((value << 8) | buffer[i]);
+		return value;
+	}
+
+	/* Rounds the 80 bit extended sample rate of the COMM chunk to the nearest integer. */
+	static unsigned long convert80bitto32bit(const uint8_t* buffer)
+	{
+		int exponent = (ConvertBigEndian<uint16_t>(buffer) & 0x7FFF) - 16383 - 63;
+		uint64_t mantissa = ConvertBigEndian<uint64_t>(buffer + 2);
+		return static_cast<unsigned long>(std::llround(std::ldexp(static_cast<double>(mantissa), exponent)));
+	}
+
+};
@@ -0,0 +1,592 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "threadpool.hpp"
+#include "trace.hpp"
+
+/* A read only, seekable view of bytes already in memory. */
+class MemoryBuffer : public std::streambuf
+{
+public:
+    MemoryBuffer(const uint8_t* data, uint64_t size)
+    {
+        char* begin = const_cast<char*>(reinterpret_cast<const char*>(data));
+        setg(begin, begin, begin + size);
+    }
+
+protected:
+    pos_type seekoff(off_type offset, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+    {
+        if (!(which & std::ios_base::in))
+            return pos_type(off_type(-1));
+
+        char* base = dir == std::ios_base::beg ? eback() : dir == std::ios_base::cur ? gptr() : egptr();
+        if (offset < eback() - base || offset > egptr() - base)
+            return pos_type(off_type(-1));
+
+        setg(eback(), base + offset, egptr());
+        return pos_type(gptr() - eback());
+    }
+
+    pos_type seekpos(pos_type position, std::ios_base::openmode which) override
+    {
+        return seekoff(off_type(position), std::ios_base::beg, which);
+    }
+};
+
+/* An istream over bytes already in memory, for the stream loaders, without copying them. */
+class MemoryStream : private MemoryBuffer, public std::istream
+{
+public:
+    MemoryStream(const uint8_t* data, uint64_t size) :
+        MemoryBuffer(data, size),
+        std::istream(static_cast<MemoryBuffer*>(this))
+    {
+    }
+};
+
+/*
+ * Whole file reads and writes that run in the background, so a batch of small inputs is
+ * not bound by one blocking open, read and close after another on every encode lane.
+ * Read and Write return at once with a future of the result; at most QUEUEDEPTH of them
+ * are in flight and further calls wait for one to finish. Errors come out of the futures.
+ *
+ * Create picks io_uring on Linux kernels that have it and allow it (5.6 and later for the
+ * open, statx and close operations), and otherwise a pool of IOTHREADS threads doing
+ * plain blocking I/O, which also overlaps the waits of many files.
+ */
+class AsyncIO
+{
+public:
+    enum Backend { AUTO, URING, THREADS };
+
+    static constexpr unsigned QUEUEDEPTH = 64;
+    static constexpr unsigned IOTHREADS = 16;
+
+    AsyncIO() = default;
+    AsyncIO(const AsyncIO&) = delete;
+    AsyncIO& operator=(const AsyncIO&) = delete;
+    virtual ~AsyncIO() = default;
+
+    virtual std::future<std::vector<uint8_t>> Read(const std::string& path) = 0;
+
+    virtual std::future<void> Write(const std::string& path, std::vector<uint8_t> data) = 0;
+
+    virtual const char* GetName() const = 0;
+
+    /* The backend for --io: auto, uring or threads. */
+    static Backend ParseBackend(const std::string& name)
+    {
+        if (name == "auto")
+            return AUTO;
+        if (name == "uring")
+            return URING;
+        if (name == "threads")
+            return THREADS;
+        throw std::runtime_error("Unknown I/O backend " + name + ", expected auto, uring or threads");
+    }
+
+    static void SetDefaultBackend(Backend backend) { defaultbackend = backend; }
+
+    /* AUTO falls back to threads when io_uring cannot be set up, URING throws instead. */
+    static std::unique_ptr<AsyncIO> Create(Backend backend = defaultbackend);
+
+protected:
+    /* Waits for a free slot in the queue. */
+    void Admit()
+    {
+        std::unique_lock<std::mutex> lock(slotmutex);
+        slotfree.wait(lock, [this]() { return inflight < QUEUEDEPTH; });
+        inflight++;
+    }
+
+    void Retire()
+    {
+        std::lock_guard<std::mutex> lock(slotmutex);
+        inflight--;
+        slotfree.notify_all();
+    }
+
+    /* Waits until everything queued has finished, for destructors. */
+    void Drain()
+    {
+        std::unique_lock<std::mutex> lock(slotmutex);
+        slotfree.wait(lock, [this]() { return inflight == 0; });
+    }
+
+private:
+    static inline Backend defaultbackend = AUTO;
+
+    std::mutex slotmutex;
+    std::condition_variable slotfree;
+    unsigned inflight = 0;
+};
+
+/* Blocking reads and writes on a pool of their own, apart from the encode threads. */
+class ThreadedIO : public AsyncIO
+{
+public:
+    ThreadedIO() :
+        pool(IOTHREADS)
+    {
+    }
+
+    ~ThreadedIO() override
+    {
+        Drain();
+    }
+
+    std::future<std::vector<uint8_t>> Read(const std::string& path) override
+    {
+        Admit();
+        return pool.Submit([this, path]() {
+            Retiring retiring{ this };
+            return ReadFile(path);
+        });
+    }
+
+    std::future<void> Write(const std::string& path, std::vector<uint8_t> data) override
+    {
+        Admit();
+        return pool.Submit([this, path, data = std::move(data)]() {
+            Retiring retiring{ this };
+            WriteFile(path, data);
+        });
+    }
+
+    const char* GetName() const override { return "threads"; }
+
+private:
+    ThreadPool pool;
+
+    struct Retiring
+    {
+        ThreadedIO* io;
+        ~Retiring() { io->Retire(); }
+    };
+
+    static std::vector<uint8_t> ReadFile(const std::string& path)
+    {
+        TRACE_SCOPE("ReadFile", path);
+        std::ifstream stream(path, std::ios::binary | std::ios::ate);
+        if (!stream.is_open())
+            throw std::runtime_error("File is unable to be opened");
+
+        std::vector<uint8_t> data(static_cast<size_t>(stream.tellg()));
+        stream.seekg(0, std::ios_base::beg);
+        stream.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size()));
+        data.resize(static_cast<size_t>(stream.gcount()));
+        TRACE_BYTES(data.size());
+        return data;
+    }
+
+    static void WriteFile(const std::string& path, const std::vector<uint8_t>& data)
+    {
+        TRACE_SCOPE("WriteFile", path);
+        TRACE_BYTES(data.size());
+        std::ofstream stream(path, std::ios::binary);
+        if (!stream.is_open())
+            throw std::runtime_error("Cannot open output file " + path);
+
+        stream.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+        stream.close();
+        if (!stream)
+            throw std::runtime_error("Cannot write output file " + path);
+    }
+};
+
+#ifdef __linux__
+/*
+ * io_uring through the raw syscalls. Every request walks its file through open, statx
+ * for the size of a read, read or write until done, and close, one operation in the ring
+ * at a time, so the QUEUEDEPTH requests never overrun the ring. Callers submit their
+ * first operation themselves; a reaper thread waits for completions, submits the next
+ * step of each request and fulfils its promise after the close. A step that cannot be
+ * set up or submitted fails only its own request, through its future.
+ */
+class UringIO : public AsyncIO
+{
+public:
+    UringIO()
+    {
+        io_uring_params params{};
+        ring = static_cast<int>(syscall(__NR_io_uring_setup, QUEUEDEPTH, &params));
+        if (ring < 0)
+            throw std::runtime_error(std::string("io_uring is not available: ") + std::strerror(errno));
+
+        try
+        {
+            Map(params);
+            Probe();
+        }
+        catch (...)
+        {
+            Unmap();
+            throw;
+        }
+
+        reaper = std::thread([this]() { Reap(); });
+    }
+
+    ~UringIO() override
+    {
+        Drain();
+        {
+            std::lock_guard<std::mutex> lock(submitmutex);
+            io_uring_sqe* sqe = NextSqe();
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = 0; //no request, tells the reaper to stop
+            Submit();
+        }
+        reaper.join();
+        Unmap();
+    }
+
+    std::future<std::vector<uint8_t>> Read(const std::string& path) override
+    {
+        auto request = std::make_unique<Request>();
+        request->write = false;
+        request->path = path;
+        std::future<std::vector<uint8_t>> result = request->read.get_future();
+        Start(std::move(request));
+        return result;
+    }
+
+    std::future<void> Write(const std::string& path, std::vector<uint8_t> data) override
+    {
+        auto request = std::make_unique<Request>();
+        request->write = true;
+        request->path = path;
+        request->data = std::move(data);
+        std::future<void> result = request->written.get_future();
+        Start(std::move(request));
+        return result;
+    }
+
+    const char* GetName() const override { return "uring"; }
+
+private:
+    enum Step { OPEN, STAT, TRANSFER, CLOSE };
+
+    struct Request
+    {
+        bool write = false;
+        Step step = OPEN;
+        std::string path;
+        int fd = -1;
+        std::vector<uint8_t> data;
+        uint64_t done = 0; //bytes transferred
+        struct statx stat{};
+        std::string error;
+        std::promise<std::vector<uint8_t>> read;
+        std::promise<void> written;
+    };
+
+    int ring = -1;
+    void* rings = MAP_FAILED;
+    size_t ringsize = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqessize = 0;
+
+    unsigned* sqhead = nullptr;
+    unsigned* sqtail = nullptr;
+    unsigned sqmask = 0;
+    unsigned* sqarray = nullptr;
+    unsigned* cqhead = nullptr;
+    unsigned* cqtail = nullptr;
+    unsigned cqmask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    std::mutex submitmutex;
+    std::thread reaper;
+
+    void Map(const io_uring_params& params)
+    {
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+            throw std::runtime_error("io_uring is too old");
+
+        ringsize = std::max<size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        rings = mmap(nullptr, ringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        if (rings == MAP_FAILED)
+            throw std::runtime_error("Cannot map the io_uring rings");
+
+        sqessize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+            throw std::runtime_error("Cannot map the io_uring submission entries");
+
+        uint8_t* base = static_cast<uint8_t*>(rings);
+        sqhead = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+        sqtail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+        sqmask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+        sqarray = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+        cqhead = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+        cqtail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+        cqmask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+    }
+
+    void Unmap()
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqessize);
+        if (rings != MAP_FAILED)
+            munmap(rings, ringsize);
+        close(ring);
+    }
+
+    /* Checks that the kernel knows every operation a request goes through. */
+    void Probe()
+    {
+        constexpr unsigned OPS = 64;
+        std::vector<uint8_t> buffer(sizeof(io_uring_probe) + OPS * sizeof(io_uring_probe_op));
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+        if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, probe, OPS) < 0)
+            throw std::runtime_error(std::string("io_uring cannot be probed: ") + std::strerror(errno));
+
+        for (uint8_t op : { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE })
+        {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                throw std::runtime_error("io_uring lacks file operations");
+        }
+    }
+
+    void Start(std::unique_ptr<Request> request)
+    {
+        Admit();
+        try
+        {
+            std::lock_guard<std::mutex> lock(submitmutex);
+            Queue(request.get());
+        }
+        catch (const std::exception& error)
+        {
+            return Abandon(request.release(), error.what());
+        }
+        request.release();
+    }
+
+    /* A cleared entry at the tail of the submission ring; with submitmutex held. */
+    io_uring_sqe* NextSqe()
+    {
+        unsigned tail = *sqtail;
+        unsigned index = tail & sqmask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqarray[index] = index;
+        __atomic_store_n(sqtail, tail + 1, __ATOMIC_RELEASE);
+        return sqe;
+    }
+
+    /* Hands the entries past the kernel's head to it; with submitmutex held. */
+    void Submit()
+    {
+        unsigned pending = *sqtail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+        while (pending)
+        {
+            long submitted = syscall(__NR_io_uring_enter, ring, pending, 0, 0, nullptr, 0);
+            if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                throw std::runtime_error(std::string("io_uring submission failed: ") + std::strerror(errno));
+            pending = *sqtail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    /* Puts the current step of request into the ring; with submitmutex held. */
+    void Queue(Request* request)
+    {
+        io_uring_sqe* sqe = NextSqe();
+        sqe->user_data = reinterpret_cast<uint64_t>(request);
+
+        switch (request->step)
+        {
+        case OPEN:
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(request->path.c_str());
+            sqe->open_flags = request->write ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+            sqe->len = 0666;
+            break;
+        case STAT:
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = request->fd;
+            sqe->addr = reinterpret_cast<uint64_t>("");
+            sqe->statx_flags = AT_EMPTY_PATH;
+            sqe->len = STATX_SIZE;
+            sqe->off = reinterpret_cast<uint64_t>(&request->stat);
+            break;
+        case TRANSFER:
+            sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = request->fd;
+            sqe->addr = reinterpret_cast<uint64_t>(request->data.data() + request->done);
+            sqe->len = static_cast<uint32_t>(std::min<uint64_t>(request->data.size() - request->done, 1u << 30));
+            sqe->off = request->done;
+            break;
+        case CLOSE:
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = request->fd;
+            break;
+        }
+
+        try
+        {
+            Submit();
+        }
+        catch (...)
+        {
+            // the kernel never took the entry, so withdraw it before its request is failed and freed
+            if (*sqtail != __atomic_load_n(sqhead, __ATOMIC_ACQUIRE))
+                __atomic_store_n(sqtail, *sqtail - 1, __ATOMIC_RELEASE);
+            throw;
+        }
+    }
+
+    void Reap()
+    {
+        for (;;)
+        {
+            unsigned head = *cqhead;
+            if (head == __atomic_load_n(cqtail, __ATOMIC_ACQUIRE))
+            {
+                // completions still land in the mapped ring, so a wait that keeps failing falls back to polling it
+                if (syscall(__NR_io_uring_enter, ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+
+            io_uring_cqe cqe = cqes[head & cqmask];
+            __atomic_store_n(cqhead, head + 1, __ATOMIC_RELEASE);
+            if (!cqe.user_data)
+                return;
+
+            Request* request = reinterpret_cast<Request*>(cqe.user_data);
+            try
+            {
+                Advance(request, cqe.res);
+            }
+            catch (const std::exception& error)
+            {
+                Abandon(request, error.what());
+            }
+        }
+    }
+
+    /* Moves request on by the result of its last step. */
+    void Advance(Request* request, int result)
+    {
+        switch (request->step)
+        {
+        case OPEN:
+            if (result < 0)
+                return Finish(request, request->write ? "Cannot open output file " + request->path : std::string("File is unable to be opened"));
+            request->fd = result;
+            request->step = !request->write ? STAT : request->data.empty() ? CLOSE : TRANSFER;
+            break;
+        case STAT:
+            if (result < 0)
+                return Fail(request, result);
+            request->data.resize(request->stat.stx_size);
+            request->step = TRANSFER;
+            break;
+        case TRANSFER:
+            if (result < 0)
+                return Fail(request, result);
+            request->done += static_cast<uint64_t>(result);
+            // a file that shrank since statx ends early, a write that makes no progress failed
+            if (!result && !request->write)
+                request->data.resize(request->done);
+            else if (!result)
+                return Fail(request, -EIO);
+            if (request->done >= request->data.size())
+                request->step = CLOSE;
+            break;
+        case CLOSE:
+            return Finish(request, request->error);
+        }
+
+        std::lock_guard<std::mutex> lock(submitmutex);
+        Queue(request);
+    }
+
+    /* Closes the file of a request that failed, keeping the first error. */
+    void Fail(Request* request, int result)
+    {
+        request->error = (request->write ? "Cannot write output file " : "Cannot read input file ") + request->path + ": " + std::strerror(-result);
+        request->step = CLOSE;
+        std::lock_guard<std::mutex> lock(submitmutex);
+        Queue(request);
+    }
+
+    /*
+     * Fails a request whose next step could not be queued, so none of it is left in the
+     * ring; its file is closed directly as the ring may be what failed.
+     */
+    void Abandon(Request* request, const std::string& reason)
+    {
+        if (request->fd >= 0)
+            close(request->fd);
+        Finish(request, (request->write ? "Cannot write output file " : "Cannot read input file ") + request->path + ": " + reason);
+    }
+
+    void Finish(Request* request, const std::string& error)
+    {
+        std::unique_ptr<Request> owned(request);
+        if (!error.empty())
+        {
+            auto failure = std::make_exception_ptr(std::runtime_error(error));
+            request->write ? request->written.set_exception(failure) : request->read.set_exception(failure);
+        }
+        else if (request->write)
+            request->written.set_value();
+        else
+            request->read.set_value(std::move(request->data));
+        Retire();
+    }
+};
+#endif
+
+inline std::unique_ptr<AsyncIO> AsyncIO::Create(Backend backend)
+{
+#ifdef __linux__
+    if (backend != THREADS)
+    {
+        try
+        {
+            return std::make_unique<UringIO>();
+        }
+        catch (const std::runtime_error&)
+        {
+            if (backend == URING)
+                throw;
+        }
+    }
+#else
+    if (backend == URING)
+        throw std::runtime_error("io_uring is only available on Linux");
+#endif
+    return std::make_unique<ThreadedIO>();
+}
@@ -0,0 +1,368 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include "encoder.hpp"
+#include "loop.hpp"
+#include "pack.hpp"
+#include "threadpool.hpp"
+
+/*
+ * A conversion at 1/factor of the rate: every output frame is the average of factor input
+ * frames, channel by channel, like ConvertPCM16::resample but computed range by range so
+ * the fused encoder can read it. A factor of 1 passes the conversion through unchanged.
+ */
+template <typename T_Conversion>
+class DecimatedConversion
+{
+public:
+    DecimatedConversion(T_Conversion& conv, uint16_t channels, uint32_t factor) :
+        conv(conv),
+        channels(std::max<uint16_t>(1, channels)),
+        factor(std::max(1u, factor))
+    {
+    }
+
+    uint64_t GetOutSize() const { return conv.GetOutSize() / channels / factor * channels; }
+
+    void ConvertRange(uint64_t first, uint64_t count, float* out)
+    {
+        if (factor == 1)
+        {
+            conv.ConvertRange(first, count, out);
+            return;
+        }
+        if (!count)
+            return;
+
+        uint64_t firstFrame = first / channels;
+        uint64_t lastFrame = (first + count - 1) / channels;
+
+        thread_local std::vector<float> input;
+        input.resize((lastFrame - firstFrame + 1) * factor * channels);
+        conv.ConvertRange(firstFrame * factor * channels, input.size(), input.data());
+
+        thread_local std::vector<float> frames;
+        frames.resize((lastFrame - firstFrame + 1) * channels);
+        float scale = 1.0f / static_cast<float>(factor);
+        for (uint64_t frame = 0; frame <= lastFrame - firstFrame; frame++)
+        {
+            const float* in = input.data() + frame * factor * channels;
+            for (uint64_t c = 0; c < channels; c++)
+            {
+                float sum = 0.0f;
+                for (uint64_t k = 0; k < factor; k++)
+                    sum += in[k * channels + c];
+                frames[frame * channels + c] = sum * scale;
+            }
+        }
+
+        std::copy_n(frames.begin() + (first - firstFrame * channels), count, out);
+    }
+
+private:
+    T_Conversion& conv;
+    uint64_t channels;
+    uint32_t factor;
+};
+
+/*
+ * Fits a bank of assets into a fixed SPU RAM budget. Every input may be decimated by
+ * powers of two down to its minimum rate; the encoded size of each candidate rate is
+ * known exactly up front, so the planner only has to choose which inputs give up
+ * bandwidth. Losing an octave costs an input its priority; the planner keeps taking
+ * the cheapest octave per byte saved until the bank fits, then encodes everything
+ * through the fused encoder, with the FIR, precision, silence and loop settings of a
+ * plain encode. An input keeps its sustain loop at rates whose /N the loop points
+ * divide; other rates are not considered for it.
+ *
+ * Manifest lines are "path priority minrate [output]", '#' starts a comment; relative
+ * paths are relative to the manifest. With a pack path the streams go into a single bank
+ * file instead, named after their outputs.
+ */
+class BankBudget
+{
+public:
+    struct BankEntry
+    {
+        std::string path;
+        std::string output;
+        uint32_t priority = 1;
+        uint32_t minrate = 0;
+        Encoder::FileType type = Encoder::UNKNOWNTYPE;
+        uint64_t frames = 0;
+        uint32_t samplerate = 0;
+        uint16_t channels = 0;
+        bool looped = false; //the input has a sustain loop and loops are on
+        uint64_t loopstart = 0; //input loop frames, the end is exclusive
+        uint64_t loopend = 0;
+        uint32_t factor = 1;
+        uint64_t encodedsize = 0;
+        uint32_t outrate = 0;
+    };
+
+    BankBudget() = delete;
+    BankBudget(const BankBudget&) = delete;
+
+    BankBudget(std::string manifest, uint64_t budget, EncodeOptions options, std::string pack = "") :
+        manifest(manifest),
+        budget(budget),
+        options(options),
+        pack(pack)
+    {
+    }
+
+    void Execute()
+    {
+        LoadManifest();
+        ProbeInputs();
+        PlanRates();
+        EncodeAll();
+        PrintReport();
+    }
+
+    /* True when the loop of entry, if any, falls on whole frames at 1/factor of the rate. */
+    static bool KeepsLoop(const BankEntry& entry, uint32_t factor)
+    {
+        return !entry.looped || (entry.loopstart % factor == 0 && entry.loopend % factor == 0);
+    }
+
+    /* Loop plan of entry at 1/factor of its rate, the loop points scaled down like a --variant /N. */
+    static LoopPlan PlanLoop(const BankEntry& entry, uint32_t factor)
+    {
+        if (!KeepsLoop(entry, factor))
+            throw std::runtime_error("Loop of " + entry.path + " does not fall on /" + std::to_string(factor) + " frames");
+
+        return LoopPlan::Create(entry.channels, entry.samplerate / factor, entry.frames / factor, entry.looped,
+            entry.loopstart / factor, entry.loopend / factor);
+    }
+
+    static uint64_t PredictEncodedSize(const BankEntry& entry, uint32_t factor)
+    {
+        LoopPlan plan = PlanLoop(entry, factor);
+        return VagFile::PredictSize(plan.Samples(), plan.looped);
+    }
+
+private:
+    std::string manifest;
+    uint64_t budget;
+    EncodeOptions options;
+    std::string pack;
+    std::vector<BankEntry> entries;
+
+    void LoadManifest()
+    {
+        std::ifstream stream(manifest);
+
+        if (!stream.is_open())
+            throw std::runtime_error("Cannot open bank manifest " + manifest);
+
+        std::filesystem::path directory = std::filesystem::path(manifest).parent_path();
+        auto resolve = [&directory](const std::string& path) {
+            std::filesystem::path resolved{ path };
+            return resolved.is_relative() ? (directory / resolved).string() : path;
+        };
+
+        std::string line;
+        uint32_t linenumber = 0;
+        while (std::getline(stream, line))
+        {
+            linenumber++;
+            line = line.substr(0, line.find('#'));
+
+            std::istringstream fields(line);
+            BankEntry entry;
+            if (!(fields >> entry.path))
+                continue;
+
+            if (!(fields >> entry.priority >> entry.minrate))
+                throw std::runtime_error("Malformed bank manifest line " + std::to_string(linenumber));
+
+            std::filesystem::path path{ entry.path };
+            if (!(fields >> entry.output))
+                entry.output = path.stem().string() + ".vag";
+            entry.path = resolve(entry.path);
+            entry.output = resolve(entry.output);
+
+            std::string extension = path.extension().string();
+            entry.type = Encoder::GetFileType(extension.empty() ? extension : extension.substr(1));
+            if (entry.type == Encoder::UNKNOWNTYPE)
+                throw std::runtime_error("Unsupported file type extension " + entry.path);
+
+            entries.push_back(std::move(entry));
+        }
+
+        if (entries.empty())
+            throw std::runtime_error("Bank manifest has no entries");
+    }
+
+    /* Reads the sizes the rates are planned from out of the headers, the samples are only loaded to encode. */
+    void ProbeInputs()
+    {
+        ThreadPool::Shared().ParallelFor(entries.size(), [this](uint64_t i) {
+            BankEntry& entry = entries[i];
+            COUNTER_FILE(entry.path);
+            std::unique_ptr<File> file = Encoder::LoadInput(entry.path, entry.type, true);
+            entry.frames = Encoder::GetFrameCount(*file);
+            entry.samplerate = file->samplerate;
+            entry.channels = file->channels;
+            entry.loopend = std::min(file->loopend, entry.frames);
+            entry.looped = options.loops && file->looped && file->loopstart < entry.loopend;
+            entry.loopstart = entry.looped ? file->loopstart : 0;
+            entry.loopend = entry.looped ? entry.loopend : 0;
+        });
+    }
+
+    /* Loads an input for its encode, which has to match what its rate was planned from. */
+    static std::unique_ptr<File> LoadEntry(const BankEntry& entry)
+    {
+        std::unique_ptr<File> file = Encoder::LoadInput(entry.path, entry.type);
+        if (Encoder::GetFrameCount(*file) != entry.frames || file->samplerate != entry.samplerate || file->channels != entry.channels)
+            throw std::runtime_error("Input changed while encoding the bank " + entry.path);
+        return file;
+    }
+
+    void PlanRates()
+    {
+        uint64_t total = 0;
+        for (auto& entry : entries)
+        {
+            entry.factor = 1;
+            total += PredictEncodedSize(entry, 1);
+        }
+
+        while (total > budget)
+        {
+            BankEntry* best = nullptr;
+            uint64_t bestsaved = 0;
+            double bestcost = 0.0;
+            std::string heldbyloop;
+
+            for (auto& entry : entries)
+            {
+                uint32_t next = entry.factor * 2;
+                uint32_t rate = entry.samplerate / next;
+                if (!rate || rate < entry.minrate || !(entry.frames / next))
+                    continue;
+
+                if (!KeepsLoop(entry, next))
+                {
+                    heldbyloop = entry.path;
+                    continue;
+                }
+
+                uint64_t saved = PredictEncodedSize(entry, entry.factor) - PredictEncodedSize(entry, next);
+                if (!saved)
+                    continue;
+
+                double cost = static_cast<double>(entry.priority) / saved;
+                if (!best || cost < bestcost || (cost == bestcost && saved > bestsaved))
+                {
+                    best = &entry;
+                    bestsaved = saved;
+                    bestcost = cost;
+                }
+            }
+
+            if (!best)
+                throw std::runtime_error("Bank cannot fit budget of " + std::to_string(budget) +
+                    " bytes, smallest possible size is " + std::to_string(total) + " bytes" +
+                    (heldbyloop.empty() ? "" : "; the loop of " + heldbyloop + " does not fall on the frames of a lower rate, --no-loop drops loops"));
+
+            best->factor *= 2;
+            total -= bestsaved;
+        }
+    }
+
+    void EncodeAll()
+    {
+        if (!pack.empty())
+        {
+            EncodePacked();
+            return;
+        }
+
+        ThreadPool::Shared().ParallelFor(entries.size(), [this](uint64_t i) {
+            BankEntry& entry = entries[i];
+            TRACE_SCOPE("EncodeFile", entry.path);
+            COUNTER_FILE(entry.path);
+
+            LoopPlan plan = PlanLoop(entry, entry.factor);
+            VagFile vagFile(plan.samplerate, entry.channels, entry.output);
+            vagFile.samples.resize(VagFile::PredictSize(plan.Samples(), plan.looped));
+            Encode(entry, plan, vagFile.samples.data());
+            vagFile.SetDataLength();
+            vagFile.WriteVagFile();
+
+            entry.encodedsize = vagFile.samples.size();
+            entry.outrate = plan.samplerate;
+        });
+    }
+
+    void EncodePacked()
+    {
+        VagBank bank;
+        for (auto& entry : entries)
+            bank.Add(std::filesystem::path(entry.output).stem().string(), PlanLoop(entry, entry.factor));
+        bank.Layout();
+
+        ThreadPool::Shared().ParallelFor(entries.size(), [this, &bank](uint64_t i) {
+            BankEntry& entry = entries[i];
+            TRACE_SCOPE("EncodeFile", entry.path);
+            COUNTER_FILE(entry.path);
+
+            LoopPlan plan = PlanLoop(entry, entry.factor);
+            Encode(entry, plan, bank.Payload(i));
+
+            entry.encodedsize = bank.GetItems()[i].size;
+            entry.outrate = plan.samplerate;
+        });
+
+        bank.Write(pack);
+    }
+
+    /* Loads entry and encodes it at its planned rate into outBuffer, which holds the size of plan. */
+    void Encode(const BankEntry& entry, const LoopPlan& plan, uint8_t* outBuffer) const
+    {
+        std::unique_ptr<File> file = LoadEntry(entry);
+        Encoder::ConversionType conversion = Encoder::CreateConversion(*file, options.noisereduce);
+
+        std::visit([&](auto& conv) {
+            if (!conv)
+                throw std::runtime_error("Conversion pointer not created");
+
+            DecimatedConversion<std::remove_reference_t<decltype(*conv)>> decimated(*conv, entry.channels, entry.factor);
+            if (decimated.GetOutSize() != (entry.frames / entry.factor) * entry.channels)
+                throw std::runtime_error("Input changed while encoding the bank " + entry.path);
+
+            Encoder::EncodeFused(decimated, outBuffer, options.precise, plan, static_cast<float>(options.silence));
+            }, conversion);
+    }
+
+    void PrintReport() const
+    {
+        uint64_t total = 0;
+        std::cout << std::left << std::setw(32) << "output" << std::right << std::setw(10) << "priority"
+            << std::setw(10) << "source" << std::setw(10) << "rate" << std::setw(12) << "bytes" << "\n";
+        for (auto& entry : entries)
+        {
+            std::cout << std::left << std::setw(32) << entry.output << std::right << std::setw(10) << entry.priority
+                << std::setw(10) << entry.samplerate << std::setw(10) << entry.outrate
+                << std::setw(12) << entry.encodedsize << "\n";
+            total += entry.encodedsize;
+        }
+        std::cout << "total " << total << " of " << budget << " bytes\n";
+    }
+};
@@ -0,0 +1,406 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "asyncio.hpp"
+#include "encoder.hpp"
+#include "inspect.hpp"
+#include "threadpool.hpp"
+#include "trace.hpp"
+
+/*
+ * Runs independent jobs on the shared pool, one per pool thread at a time, in order of
+ * falling cost so the long ones do not trail at the end. With a budget the memory
+ * estimates of the running jobs stay within it: a job that does not fit waits while
+ * smaller ones that do go ahead, but only as many as there are threads before the
+ * others wait for it too. A job larger than the whole budget runs alone. The first job
+ * to throw stops further jobs from starting and its exception comes out of Execute.
+ */
+class JobScheduler
+{
+public:
+    struct Job
+    {
+        uint64_t cost = 0; //relative run time
+        uint64_t memory = 0; //peak bytes held while it runs
+    };
+
+    JobScheduler() = delete;
+    JobScheduler(const JobScheduler&) = delete;
+
+    JobScheduler(std::vector<Job> jobs, uint64_t budget) :
+        jobs(std::move(jobs)),
+        budget(budget)
+    {
+    }
+
+    /* Calls run(i) once for every job i, from lanes on the shared pool. */
+    template <typename Run>
+    void Execute(Run&& run)
+    {
+        for (size_t i : ByCost(jobs))
+            pending.push_back(i);
+
+        lanes = std::min<uint64_t>(jobs.size(), std::max(1u, ThreadPool::Shared().GetThreadCount()));
+        ThreadPool::Shared().ParallelFor(lanes, [this, &run](uint64_t) {
+            size_t job;
+            while (Next(job))
+            {
+                try
+                {
+                    run(job);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error)
+                        error = std::current_exception();
+                }
+                Finish(job);
+            }
+        });
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    /* Job indices in the order they are taken when nothing waits for memory, by falling cost. */
+    static std::vector<size_t> ByCost(const std::vector<Job>& jobs)
+    {
+        std::vector<size_t> order(jobs.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&jobs](size_t a, size_t b) { return jobs[a].cost > jobs[b].cost; });
+        return order;
+    }
+
+    /* The highest sum of memory estimates that ran at once. */
+    uint64_t GetPeak() const { return peak; }
+
+private:
+    std::vector<Job> jobs;
+    uint64_t budget; //0 leaves memory unbounded
+    uint64_t lanes = 0;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<size_t> pending;
+    std::exception_ptr error;
+    uint64_t running = 0;
+    uint64_t used = 0;
+    uint64_t peak = 0;
+    uint64_t overtaken = 0; //jobs started ahead of the one in front of pending
+
+    /* Takes the next job that may start, waiting while none fits. False once there is nothing left to start. */
+    bool Next(size_t& job)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto admitted = pending.end();
+        changed.wait(lock, [this, &admitted]() {
+            if (error || pending.empty())
+                return true;
+            admitted = Admissible();
+            return admitted != pending.end();
+        });
+        if (error || pending.empty())
+            return false;
+
+        overtaken = admitted == pending.begin() ? 0 : overtaken + 1;
+        job = *admitted;
+        pending.erase(admitted);
+        running++;
+        used += jobs[job].memory;
+        peak = std::max(peak, used);
+        return true;
+    }
+
+    /* The first pending job that fits next to the running ones, pending.end() when none may start yet. */
+    std::deque<size_t>::iterator Admissible()
+    {
+        if (!budget || !running)
+            return pending.begin();
+
+        // the front job has let enough others go ahead, nothing overtakes it any more
+        auto last = overtaken < lanes ? pending.end() : pending.begin() + 1;
+        auto fits = std::find_if(pending.begin(), last, [this](size_t job) { return used + jobs[job].memory <= budget; });
+        return fits == last ? pending.end() : fits;
+    }
+
+    void Finish(size_t job)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running--;
+        used -= jobs[job].memory;
+        changed.notify_all();
+    }
+};
+
+/*
+ * Encodes many inputs on this machine, each to a VAG next to it as with a Coordinator.
+ * The inputs are probed from their headers for the sizes the JobScheduler orders and
+ * admits them by: the ADPCM an input encodes to plus its file size for the run time,
+ * Inspector's estimate for the memory. An input that fails is reported and the others
+ * still run.
+ *
+ * File I/O goes through AsyncIO so the lanes do not wait on it: inputs up to READAHEADSIZE
+ * are read whole ahead of their jobs, in the order the scheduler takes them, and parsed
+ * from memory; VAGs are written in the background while the lane moves on. At most
+ * READAHEADFILES inputs and READAHEADBYTES, or a quarter of the memory budget, are read
+ * ahead at once. Larger inputs, and interleaved output, keep the streamed file path.
+ */
+class BatchEncoder
+{
+public:
+    BatchEncoder() = delete;
+    BatchEncoder(const BatchEncoder&) = delete;
+
+    BatchEncoder(std::vector<std::string> inputs, EncodeOptions options, uint64_t budget) :
+        inputs(inputs),
+        options(options),
+        budget(budget)
+    {
+    }
+
+    void Execute()
+    {
+        CollectItems();
+
+        std::vector<size_t> probed;
+        std::vector<JobScheduler::Job> jobs;
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            if (!items[i].error.empty())
+                continue;
+            probed.push_back(i);
+            jobs.push_back({ items[i].info.adpcmsize + items[i].info.filesize, items[i].info.memory });
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        io = AsyncIO::Create();
+        ReadAhead reads(*this, probed, JobScheduler::ByCost(jobs));
+
+        JobScheduler scheduler(jobs, budget);
+        scheduler.Execute([this, &probed, &reads](size_t job) {
+            Item& item = items[probed[job]];
+            TRACE_SCOPE("BatchFile", item.info.path);
+            try
+            {
+                std::future<std::vector<uint8_t>> data = reads.Take(job);
+                if (data.valid())
+                    Encode(item, data);
+                else
+                    item.size = Encoder::EncodeFile(item.info.path, item.type, item.output, options);
+                item.done = true;
+            }
+            catch (const std::exception& e)
+            {
+                item.error = e.what();
+            }
+        });
+
+        for (auto& item : items)
+        {
+            if (!item.written.valid())
+                continue;
+            try
+            {
+                item.written.get();
+            }
+            catch (const std::exception& e)
+            {
+                item.error = e.what();
+                item.done = false;
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        Report(seconds, scheduler.GetPeak());
+    }
+
+private:
+    struct Item
+    {
+        Inspector::FileInfo info;
+        Encoder::FileType type = Encoder::UNKNOWNTYPE;
+        std::string output;
+        std::string error;
+        uint64_t size = 0;
+        bool done = false;
+        std::future<void> written; //the VAG on its way to disk
+    };
+
+    static constexpr uint64_t READAHEADSIZE = 16 << 20;
+    static constexpr uint64_t READAHEADFILES = 32;
+    static constexpr uint64_t READAHEADBYTES = 64 << 20;
+
+    /*
+     * Reads of the inputs ahead of their jobs, issued in order until the limits are hit
+     * and topped up as jobs take theirs. A job the scheduler starts before its read was
+     * issued gets none and loads its file itself.
+     */
+    class ReadAhead
+    {
+    public:
+        ReadAhead(BatchEncoder& batch, const std::vector<size_t>& probed, std::vector<size_t> order) :
+            batch(batch),
+            probed(probed),
+            order(std::move(order)),
+            reads(probed.size()),
+            taken(probed.size(), false),
+            limit(batch.budget ? std::min(READAHEADBYTES, batch.budget / 4) : READAHEADBYTES)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Refill();
+        }
+
+        /* The read of job, invalid when it was not read ahead. */
+        std::future<std::vector<uint8_t>> Take(size_t job)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            taken[job] = true;
+            std::future<std::vector<uint8_t>> read = std::move(reads[job]);
+            if (read.valid())
+            {
+                files--;
+                bytes -= Size(job);
+                Refill();
+            }
+            return read;
+        }
+
+    private:
+        BatchEncoder& batch;
+        const std::vector<size_t>& probed;
+        std::vector<size_t> order;
+        std::vector<std::future<std::vector<uint8_t>>> reads;
+        std::vector<bool> taken;
+        uint64_t limit;
+
+        std::mutex mutex;
+        size_t next = 0; //position in order of the next read to issue
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+
+        uint64_t Size(size_t job) const { return batch.items[probed[job]].info.filesize; }
+
+        void Refill()
+        {
+            for (; next < order.size() && files < READAHEADFILES; next++)
+            {
+                size_t job = order[next];
+                if (taken[job] || Size(job) > READAHEADSIZE || batch.options.interleave)
+                    continue;
+                if (files && bytes + Size(job) > limit)
+                    return;
+
+                reads[job] = batch.io->Read(batch.items[probed[job]].info.path);
+                files++;
+                bytes += Size(job);
+            }
+        }
+    };
+
+    std::vector<std::string> inputs;
+    EncodeOptions options;
+    uint64_t budget;
+    std::vector<Item> items;
+    std::unique_ptr<AsyncIO> io;
+
+    /* Encodes an input read ahead into memory, the VAG handed to io to write. */
+    void Encode(Item& item, std::future<std::vector<uint8_t>>& read)
+    {
+        COUNTER_FILE(item.info.path);
+        std::vector<uint8_t> data = read.get();
+        std::unique_ptr<File> file;
+        {
+            TRACE_SCOPE("ParseFile", item.info.path);
+            MemoryStream stream(data.data(), data.size());
+            file = Encoder::OpenStream(stream, item.type, false);
+        }
+        data = {};
+
+        Encoder::ConversionType conversion = Encoder::CreateConversion(*file, options.noisereduce);
+        std::unique_ptr<VagFile> vagFile = Encoder::EncodeVag(*file, conversion, item.output, options);
+        item.size = vagFile->samples.size();
+        item.written = io->Write(item.output, vagFile->GetImage());
+    }
+
+    void CollectItems()
+    {
+        for (auto& path : Inspector::CollectPaths(inputs))
+        {
+            Item item;
+            item.info.path = path;
+            item.type = Inspector::TypeOf(path);
+            // outputs of an earlier run sit next to their inputs
+            if (item.type == Encoder::VAGTYPE)
+                continue;
+            item.output = std::filesystem::path(path).replace_extension(".vag").string();
+            items.push_back(std::move(item));
+        }
+
+        if (items.empty())
+            throw std::runtime_error("No inputs to encode");
+
+        std::vector<std::string> paths, outputs;
+        for (auto& item : items)
+        {
+            paths.push_back(item.info.path);
+            outputs.push_back(item.output);
+        }
+        Inspector::CheckOutputs(paths, outputs);
+
+        ThreadPool::Shared().ParallelFor(items.size(), [this](uint64_t i) {
+            try
+            {
+                Inspector::Probe(items[i].info, options);
+            }
+            catch (const std::exception& e)
+            {
+                items[i].error = e.what();
+            }
+        });
+    }
+
+    void Report(double seconds, uint64_t peak)
+    {
+        uint64_t done = 0, inputbytes = 0, outputbytes = 0;
+        for (const auto& item : items)
+        {
+            if (!item.done)
+            {
+                std::cerr << item.info.path << ": " << (item.error.empty() ? "not encoded" : item.error) << "\n";
+                continue;
+            }
+            std::cout << item.info.path << " -> " << item.output << ", " << item.size << " bytes\n";
+            done++;
+            inputbytes += item.info.filesize;
+            outputbytes += item.size;
+        }
+
+        std::cout << done << " of " << items.size() << " files encoded in " << std::fixed << std::setprecision(2) << seconds << " s, "
+            << (seconds > 0 ? inputbytes / 1048576.0 / seconds : 0.0) << " MB/s of input, "
+            << outputbytes / 1048576.0 << " MB of ADPCM, at most " << peak / 1048576.0 << " MB estimated in use";
+        if (budget)
+            std::cout << " of " << budget / 1048576.0 << " MB allowed";
+        std::cout << ", " << io->GetName() << " I/O\n";
+
+        if (done != items.size())
+            throw std::runtime_error(std::to_string(items.size() - done) + " files failed to encode");
+    }
+};
@@ -0,0 +1,569 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "encoder.hpp"
+#include "vagdecoder.hpp"
+
+/*
+ * Whole program throughput benchmark. Generates a deterministic corpus of WAV and AIFF
+ * files for every sample format the encoder accepts, runs each file through the same
+ * path as a normal encode and reports files/s, MB/s of input and peak RSS per format.
+ * The encoded 16 bit corpus is then indexed and decoded back as the vag-decode row.
+ * Every format gets an untimed warm-up pass over its corpus, then the fastest of the
+ * timed runs of at least MIN_RUN_SECONDS is reported, which keeps two runs of one build
+ * within a few percent.
+ * Results can be written as JSON and compared against a stored baseline run made
+ * with the same passes, scale and kernels.
+ */
+class Benchmark
+{
+public:
+    struct FormatSpec
+    {
+        std::string name;
+        Encoder::FileType type;
+        uint16_t bps;
+        uint16_t formatcode;
+    };
+
+    struct CorpusCase
+    {
+        uint16_t channels;
+        uint32_t samplerate;
+        double seconds;
+    };
+
+    struct Result
+    {
+        std::string format;
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+        double seconds = 0.0;
+        uint64_t peakrsskb = 0;
+
+        double FilesPerSecond() const { return seconds > 0.0 ? files / seconds : 0.0; }
+        double MegabytesPerSecond() const { return seconds > 0.0 ? bytes / seconds / (1024.0 * 1024.0) : 0.0; }
+    };
+
+    static inline const std::vector<FormatSpec> formats
+    {
+        { "wav-u8", Encoder::WAVTYPE, 8, 1 },
+        { "wav-s16", Encoder::WAVTYPE, 16, 1 },
+        { "wav-s24", Encoder::WAVTYPE, 24, 1 },
+        { "wav-s32", Encoder::WAVTYPE, 32, 1 },
+        { "wav-f32", Encoder::WAVTYPE, 32, 3 },
+        { "wav-f64", Encoder::WAVTYPE, 64, 3 },
+        { "wav-alaw", Encoder::WAVTYPE, 8, 6 },
+        { "wav-ulaw", Encoder::WAVTYPE, 8, 7 },
+        { "wav-msadpcm", Encoder::WAVTYPE, 4, 2 },
+        { "aiff-s16", Encoder::AIFFTYPE, 16, 1 },
+        { "aiff-s24", Encoder::AIFFTYPE, 24, 1 },
+        { "aiff-s32", Encoder::AIFFTYPE, 32, 1 },
+    };
+
+    static constexpr uint32_t JSON_VERSION = 2;
+    static constexpr uint32_t DEFAULT_ITERATIONS = 5;
+    static constexpr double MIN_RUN_SECONDS = 0.25;
+    static constexpr uint16_t MSADPCM_BLOCK = 256;
+
+    // long enough that per file setup does not dominate a pass
+    static inline const std::vector<CorpusCase> corpus
+    {
+        { 1, 22050, 1.0 },
+        { 2, 22050, 1.0 },
+        { 1, 32000, 4.0 },
+        { 2, 44100, 4.0 },
+        { 1, 44100, 16.0 },
+        { 2, 48000, 16.0 },
+    };
+
+    Benchmark() = delete;
+    Benchmark(const Benchmark&) = delete;
+
+    Benchmark(std::string output, std::string baseline, uint32_t iterations, uint32_t scale, uint32_t tolerance, EncodeOptions options) :
+        output(output),
+        baseline(baseline),
+        iterations(std::max(1u, iterations)),
+        scale(std::max(1u, scale)),
+        tolerance(tolerance),
+        options(options)
+    {
+    }
+
+    void Execute()
+    {
+        std::filesystem::path directory = std::filesystem::temp_directory_path() / ("adpcmencoder-bench-" + std::to_string(ProcessId()));
+        std::filesystem::create_directories(directory);
+
+        try
+        {
+            for (auto& format : formats)
+                results.push_back(RunFormat(format, directory));
+            results.push_back(RunDecode(directory));
+        }
+        catch (...)
+        {
+            std::filesystem::remove_all(directory);
+            throw;
+        }
+        std::filesystem::remove_all(directory);
+
+        PrintResults();
+
+        if (!output.empty())
+            WriteJson(output);
+
+        if (!baseline.empty())
+            CompareBaseline(baseline);
+    }
+
+    /* Writes a synthetic input file for the given format and corpus case, returns its size. */
+    static uint64_t GenerateInput(const FormatSpec& format, const CorpusCase& input, uint32_t scale, uint32_t seed, const std::string& path)
+    {
+        uint64_t frames = static_cast<uint64_t>(input.samplerate * input.seconds * scale);
+        uint32_t bytespersample = format.bps / 8;
+        std::vector<uint8_t> data;
+
+        uint32_t state = seed * 2654435761u + 1;
+        auto noise = [&state]() {
+            state = state * 1664525u + 1013904223u;
+            return static_cast<double>(state >> 8) / (1u << 24) * 2.0 - 1.0;
+        };
+
+        if (format.formatcode == 2)
+        {
+            data = MSADPCMBlocks(input, frames, noise);
+        }
+        else
+        {
+            data.resize(frames * input.channels * bytespersample);
+
+            constexpr double pi = 3.14159265358979323846;
+            bool bigendian = format.type == Encoder::AIFFTYPE;
+            uint8_t* out = data.data();
+            for (uint64_t frame = 0; frame < frames; frame++)
+            {
+                for (uint16_t channel = 0; channel < input.channels; channel++)
+                {
+                    double phase = 2.0 * pi * (220.0 * (channel + 1) + seed % 7 * 55.0) * frame / input.samplerate;
+                    double value = 0.6 * std::sin(phase) + 0.2 * std::sin(phase * 7.1) + 0.1 * noise();
+                    WriteSample(format, value, bigendian, out);
+                    out += bytespersample;
+                }
+            }
+        }
+
+        std::ofstream stream(path, std::ios::binary);
+        if (!stream.is_open())
+            throw std::runtime_error("Cannot write benchmark input " + path);
+
+        if (format.type == Encoder::AIFFTYPE)
+            WriteAiffHeader(stream, format, input, frames, data.size());
+        else
+            WriteWavHeader(stream, format, input, data.size());
+
+        stream.write(reinterpret_cast<char*>(data.data()), data.size());
+        return static_cast<uint64_t>(stream.tellp());
+    }
+
+    static uint64_t PeakRssKb()
+    {
+#ifdef __linux__
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line))
+        {
+            if (line.rfind("VmHWM:", 0) == 0)
+                return std::stoull(line.substr(6));
+        }
+#endif
+#ifndef _WIN32
+        struct rusage usage{};
+        if (getrusage(RUSAGE_SELF, &usage) == 0)
+            return static_cast<uint64_t>(usage.ru_maxrss);
+#endif
+        return 0;
+    }
+
+    static long ProcessId()
+    {
+#ifndef _WIN32
+        return static_cast<long>(getpid());
+#else
+        return 0;
+#endif
+    }
+
+private:
+    std::string output;
+    std::string baseline;
+    uint32_t iterations;
+    uint32_t scale;
+    uint32_t tolerance;
+    EncodeOptions options;
+    std::vector<Result> results;
+
+    /* Lets every format report its own high water mark where the kernel supports it. */
+    static void ResetPeakRss()
+    {
+#ifdef __GLIBC__
+        malloc_trim(0);
+#endif
+#ifdef __linux__
+        std::ofstream clear("/proc/self/clear_refs");
+        if (clear.is_open())
+            clear << "5";
+#endif
+    }
+
+    /*
+     * Seconds one pass takes, from the fastest of iterations timed runs. An untimed pass
+     * warms caches and the pool first and sets how many passes a run repeats, so that
+     * every run lasts at least MIN_RUN_SECONDS and scheduler noise stays small against it.
+     */
+    template <typename Pass>
+    double BestPass(Pass&& pass) const
+    {
+        auto start = std::chrono::steady_clock::now();
+        pass();
+        double warmup = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        uint32_t repeats = warmup > 0.0 ? static_cast<uint32_t>(std::min(1000.0, std::ceil(MIN_RUN_SECONDS / warmup))) : 1;
+
+        double best = 0.0;
+        for (uint32_t iteration = 0; iteration < iterations; iteration++)
+        {
+            start = std::chrono::steady_clock::now();
+            for (uint32_t repeat = 0; repeat < repeats; repeat++)
+                pass();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / repeats;
+            if (!iteration || seconds < best)
+                best = seconds;
+        }
+        return best;
+    }
+
+    Result RunFormat(const FormatSpec& format, const std::filesystem::path& directory)
+    {
+        std::vector<std::string> inputs;
+        Result result;
+        result.format = format.name;
+
+        for (size_t i = 0; i < corpus.size(); i++)
+        {
+            std::string path = (directory / (format.name + "-" + std::to_string(i) + (format.type == Encoder::AIFFTYPE ? ".aiff" : ".wav"))).string();
+            result.bytes += GenerateInput(format, corpus[i], scale, static_cast<uint32_t>(i), path);
+            inputs.push_back(path);
+        }
+
+        ResetPeakRss();
+
+        result.files = inputs.size();
+        result.seconds = BestPass([&]() {
+            for (auto& input : inputs)
+                Encoder::EncodeFile(input, format.type, input + ".vag", options);
+        });
+
+        result.peakrsskb = PeakRssKb();
+
+        for (auto& input : inputs)
+        {
+            std::filesystem::remove(input);
+            std::filesystem::remove(input + ".vag");
+        }
+
+        return result;
+    }
+
+    /* Times index construction plus a full decode of every corpus case, MB/s counts VAG bytes. */
+    Result RunDecode(const std::filesystem::path& directory)
+    {
+        const FormatSpec& format = formats[1];
+        std::vector<std::string> inputs;
+        Result result;
+        result.format = "vag-decode";
+
+        for (size_t i = 0; i < corpus.size(); i++)
+        {
+            std::string path = (directory / ("decode-" + std::to_string(i) + ".wav")).string();
+            GenerateInput(format, corpus[i], scale, static_cast<uint32_t>(i), path);
+            Encoder::EncodeFile(path, format.type, path + ".vag", options);
+            result.bytes += std::filesystem::file_size(path + ".vag");
+            inputs.push_back(path);
+        }
+
+        ResetPeakRss();
+
+        result.files = inputs.size();
+        result.seconds = BestPass([&]() {
+            for (auto& input : inputs)
+            {
+                VagDecoder decoder(input + ".vag");
+                decoder.BuildIndex();
+                std::vector<int16_t> pcm(decoder.GetFrameCount() * decoder.GetChannels());
+                decoder.Decode(0, decoder.GetFrameCount(), pcm.data());
+            }
+        });
+
+        result.peakrsskb = PeakRssKb();
+
+        for (auto& input : inputs)
+        {
+            std::filesystem::remove(input);
+            std::filesystem::remove(input + ".vag");
+        }
+
+        return result;
+    }
+
+    /*
+     * MS ADPCM blocks of random codes broken up by runs of the largest codes, which push
+     * the decoder's step size to its cap and its samples to full scale.
+     */
+    template <typename Noise>
+    static std::vector<uint8_t> MSADPCMBlocks(const CorpusCase& input, uint64_t frames, Noise& noise)
+    {
+        uint32_t blockalign = MSADPCM_BLOCK * input.channels;
+        uint32_t blockframes = (blockalign - 7u * input.channels) * 2 / input.channels + 2;
+        uint64_t blocks = std::max<uint64_t>(1, frames / blockframes);
+        std::vector<uint8_t> data(blocks * blockalign);
+
+        for (uint64_t block = 0; block < blocks; block++)
+        {
+            uint8_t* out = &data[block * blockalign];
+            for (uint32_t i = 0; i < blockalign; i++)
+                out[i] = static_cast<uint8_t>((noise() + 1.0) * 128.0);
+
+            for (uint16_t channel = 0; channel < input.channels; channel++)
+                out[channel] = static_cast<uint8_t>(block % 7);
+
+            // runs of code 7 or 8 (-8) grow the step size 2.4 or 3 times on every nibble
+            uint8_t* codes = out + 7u * input.channels;
+            uint32_t run = (blockalign - 7u * input.channels) / 4;
+            std::fill_n(codes + run, run, static_cast<uint8_t>(block % 2 ? 0x88 : 0x77));
+        }
+        return data;
+    }
+
+    static void WriteSample(const FormatSpec& format, double value, bool bigendian, uint8_t* out)
+    {
+        uint64_t bits = 0;
+        uint32_t bytes = format.bps / 8;
+        value = std::min(std::max(value, -1.0), 1.0);
+
+        if (format.formatcode == 3 && format.bps == 32)
+        {
+            float sample = static_cast<float>(value);
+            uint32_t raw;
+            std::memcpy(&raw, &sample, sizeof(raw));
+            bits = raw;
+        }
+        else if (format.formatcode == 3)
+        {
+            std::memcpy(&bits, &value, sizeof(bits));
+        }
+        else if (format.formatcode == 6 || format.formatcode == 7)
+        {
+            // any byte is a valid G.711 code, scale the signal into the code space
+            bits = static_cast<uint8_t>(static_cast<int>(value * 127.0) & 0xFF);
+        }
+        else if (format.bps == 8)
+        {
+            bits = static_cast<uint8_t>(static_cast<int>(value * 127.0) + 0x80);
+        }
+        else
+        {
+            int64_t maximum = (int64_t(1) << (format.bps - 1)) - 1;
+            bits = static_cast<uint64_t>(static_cast<int64_t>(value * maximum));
+        }
+
+        for (uint32_t i = 0; i < bytes; i++)
+        {
+            uint32_t shift = bigendian ? 8 * (bytes - 1 - i) : 8 * i;
+            out[i] = static_cast<uint8_t>(bits >> shift);
+        }
+    }
+
+    template <typename IntType>
+    static void WriteLittleEndian(std::ostream& stream, IntType value)
+    {
+        for (size_t i = 0; i < sizeof(IntType); i++)
+            stream.put(static_cast<char>((static_cast<uint64_t>(value) >> (8 * i)) & 0xFF));
+    }
+
+    template <typename IntType>
+    static void WriteBigEndian(std::ostream& stream, IntType value)
+    {
+        for (size_t i = sizeof(IntType); i-- > 0;)
+            stream.put(static_cast<char>((static_cast<uint64_t>(value) >> (8 * i)) & 0xFF));
+    }
+
+    static void WriteWavHeader(std::ostream& stream, const FormatSpec& format, const CorpusCase& input, uint64_t datasize)
+    {
+        bool adpcm = format.formatcode == 2;
+        uint16_t blockalign = static_cast<uint16_t>(adpcm ? MSADPCM_BLOCK * input.channels : input.channels * format.bps / 8);
+        uint32_t fmtsize = adpcm ? 20 : 16;
+        uint16_t blockframes = adpcm ? static_cast<uint16_t>((blockalign - 7u * input.channels) * 2 / input.channels + 2) : 1;
+        stream.write("RIFF", 4);
+        WriteLittleEndian<uint32_t>(stream, static_cast<uint32_t>(20 + fmtsize + datasize));
+        stream.write("WAVEfmt ", 8);
+        WriteLittleEndian<uint32_t>(stream, fmtsize);
+        WriteLittleEndian<uint16_t>(stream, format.formatcode);
+        WriteLittleEndian<uint16_t>(stream, input.channels);
+        WriteLittleEndian<uint32_t>(stream, input.samplerate);
+        WriteLittleEndian<uint32_t>(stream, input.samplerate * blockalign / blockframes);
+        WriteLittleEndian<uint16_t>(stream, blockalign);
+        WriteLittleEndian<uint16_t>(stream, format.bps);
+
+        // samples per block only, the reader falls back to the seven standard coefficient pairs
+        if (adpcm)
+        {
+            WriteLittleEndian<uint16_t>(stream, 2);
+            WriteLittleEndian<uint16_t>(stream, blockframes);
+        }
+        stream.write("data", 4);
+        WriteLittleEndian<uint32_t>(stream, static_cast<uint32_t>(datasize));
+    }
+
+    static void WriteAiffHeader(std::ostream& stream, const FormatSpec& format, const CorpusCase& input, uint64_t frames, uint64_t datasize)
+    {
+        stream.write("FORM", 4);
+        WriteBigEndian<uint32_t>(stream, static_cast<uint32_t>(4 + 26 + 16 + datasize));
+        stream.write("AIFFCOMM", 8);
+        WriteBigEndian<uint32_t>(stream, 18);
+        WriteBigEndian<uint16_t>(stream, input.channels);
+        WriteBigEndian<uint32_t>(stream, static_cast<uint32_t>(frames));
+        WriteBigEndian<uint16_t>(stream, format.bps);
+
+        // 80 bit extended sample rate: exponent then normalized 64 bit mantissa
+        uint32_t rate = input.samplerate;
+        int exponent = 31;
+        while (!(rate & 0x80000000u))
+        {
+            rate <<= 1;
+            exponent--;
+        }
+        WriteBigEndian<uint16_t>(stream, static_cast<uint16_t>(16383 + exponent));
+        WriteBigEndian<uint32_t>(stream, rate);
+        WriteBigEndian<uint32_t>(stream, 0);
+
+        stream.write("SSND", 4);
+        WriteBigEndian<uint32_t>(stream, static_cast<uint32_t>(datasize + 8));
+        WriteBigEndian<uint32_t>(stream, 0);
+        WriteBigEndian<uint32_t>(stream, 0);
+    }
+
+    void PrintResults() const
+    {
+        std::cout << "kernels: " << Kernels::Describe() << "\n";
+        std::cout << std::left << std::setw(12) << "format" << std::right << std::setw(8) << "files"
+            << std::setw(12) << "files/s" << std::setw(12) << "MB/s" << std::setw(14) << "peak RSS KB" << "\n";
+        std::cout << std::fixed << std::setprecision(2);
+        for (auto& result : results)
+        {
+            std::cout << std::left << std::setw(12) << result.format << std::right << std::setw(8) << result.files
+                << std::setw(12) << result.FilesPerSecond() << std::setw(12) << result.MegabytesPerSecond()
+                << std::setw(14) << result.peakrsskb << "\n";
+        }
+        std::cout << std::defaultfloat;
+    }
+
+    void WriteJson(const std::string& path) const
+    {
+        std::ofstream stream(path);
+        if (!stream.is_open())
+            throw std::runtime_error("Cannot write benchmark results " + path);
+
+        stream << std::fixed << std::setprecision(4);
+        stream << "{\n  \"version\": " << JSON_VERSION << ",\n  \"iterations\": " << iterations << ",\n  \"scale\": " << scale << ",\n  \"kernel\": \"" << Kernels::Describe() << "\",\n  \"formats\": [\n";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            auto& result = results[i];
+            stream << "    { \"format\": \"" << result.format << "\", \"files\": " << result.files
+                << ", \"bytes\": " << result.bytes << ", \"seconds\": " << result.seconds
+                << ", \"files_per_sec\": " << result.FilesPerSecond() << ", \"mb_per_sec\": " << result.MegabytesPerSecond()
+                << ", \"peak_rss_kb\": " << result.peakrsskb << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        stream << "  ]\n}\n";
+    }
+
+    void CompareBaseline(const std::string& path) const
+    {
+        std::ifstream stream(path);
+        if (!stream.is_open())
+            throw std::runtime_error("Cannot open benchmark baseline " + path);
+
+        std::stringstream content;
+        content << stream.rdbuf();
+        std::string json = content.str();
+
+        // a baseline is only comparable when it was timed the same way
+        auto setting = [&json](const std::string& name) {
+            std::smatch match;
+            std::regex field("\"" + name + "\":\\s*\"?([^\",}]*)");
+            return std::regex_search(json, match, field) ? match[1].str() : std::string();
+        };
+        std::vector<std::pair<std::string, std::string>> expected
+        {
+            { "version", std::to_string(JSON_VERSION) },
+            { "iterations", std::to_string(iterations) },
+            { "scale", std::to_string(scale) },
+            { "kernel", Kernels::Describe() },
+        };
+        for (auto& [name, value] : expected)
+        {
+            std::string stored = setting(name);
+            if (stored != value)
+                throw std::runtime_error("Baseline " + path + " was run with " + name + " " + (stored.empty() ? "unknown" : stored)
+                    + ", this run uses " + value + "; rerun one of them to match");
+        }
+
+        std::map<std::string, double> reference;
+        std::regex entry("\\{[^{}]*\"format\":\\s*\"([^\"]+)\"[^{}]*\"mb_per_sec\":\\s*([0-9.eE+-]+)[^{}]*\\}");
+        for (std::sregex_iterator it(json.begin(), json.end(), entry), end; it != end; ++it)
+            reference[(*it)[1].str()] = std::stod((*it)[2].str());
+
+        bool regressed = false;
+        std::cout << "\n" << std::left << std::setw(12) << "format" << std::right << std::setw(12) << "base MB/s"
+            << std::setw(12) << "MB/s" << std::setw(10) << "change" << "\n";
+        std::cout << std::fixed << std::setprecision(2);
+        for (auto& result : results)
+        {
+            auto search = reference.find(result.format);
+            if (search == reference.end() || search->second <= 0.0)
+                continue;
+
+            double change = (result.MegabytesPerSecond() / search->second - 1.0) * 100.0;
+            bool slower = change < -static_cast<double>(tolerance);
+            regressed |= slower;
+            std::cout << std::left << std::setw(12) << result.format << std::right << std::setw(12) << search->second
+                << std::setw(12) << result.MegabytesPerSecond() << std::setw(9) << change << "%" << (slower ? "  REGRESSED" : "") << "\n";
+        }
+        std::cout << std::defaultfloat;
+
+        if (regressed)
+            throw std::runtime_error("Benchmark regressed more than " + std::to_string(tolerance) + "% against " + path);
+    }
+};
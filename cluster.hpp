@@ -0,0 +1,820 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "encoder.hpp"
+#include "inspect.hpp"
+#include "threadpool.hpp"
+#include "trace.hpp"
+
+/*
+ * A connected or listening stream socket. Addresses are HOST:PORT for TCP or unix:PATH for
+ * a Unix domain socket. A listener only binds loopback addresses, an empty host or * being
+ * 127.0.0.1, unless anyInterface allows other hosts to reach it, where an empty host or *
+ * binds every interface. Sockets are POSIX only; on other systems opening one throws.
+ */
+class Socket
+{
+public:
+    Socket() = default;
+    Socket(const Socket&) = delete;
+    Socket& operator=(const Socket&) = delete;
+
+    Socket(Socket&& other) noexcept : fd(std::exchange(other.fd, -1)) {}
+
+    Socket& operator=(Socket&& other) noexcept
+    {
+        if (this != &other)
+        {
+            Close();
+            fd = std::exchange(other.fd, -1);
+        }
+        return *this;
+    }
+
+    ~Socket() { Close(); }
+
+    bool IsOpen() const { return fd >= 0; }
+
+    static Socket Connect(const std::string& address)
+    {
+        return Open(address, false, false);
+    }
+
+    static Socket Listen(const std::string& address, bool anyInterface)
+    {
+        return Open(address, true, anyInterface);
+    }
+
+    /* The next incoming connection, closed when accepting failed. */
+    Socket Accept()
+    {
+        Socket connection;
+#ifndef _WIN32
+        connection.fd = ::accept(fd, nullptr, nullptr);
+        connection.SetNoDelay();
+#endif
+        return connection;
+    }
+
+    /* Sends all size bytes, false when the connection broke. */
+    bool Send(const void* data, uint64_t size)
+    {
+#ifndef _WIN32
+        const char* bytes = static_cast<const char*>(data);
+        while (size)
+        {
+            ssize_t sent = ::send(fd, bytes, static_cast<size_t>(std::min<uint64_t>(size, 1u << 30)), SENDFLAGS);
+            if (sent <= 0)
+                return false;
+            bytes += sent;
+            size -= static_cast<uint64_t>(sent);
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /* Receives exactly size bytes, false when the connection broke or was closed first. */
+    bool Receive(void* data, uint64_t size)
+    {
+#ifndef _WIN32
+        char* bytes = static_cast<char*>(data);
+        while (size)
+        {
+            ssize_t received = ::recv(fd, bytes, static_cast<size_t>(std::min<uint64_t>(size, 1u << 30)), 0);
+            if (received <= 0)
+                return false;
+            bytes += received;
+            size -= static_cast<uint64_t>(received);
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void Close()
+    {
+#ifndef _WIN32
+        if (fd >= 0)
+            ::close(fd);
+#endif
+        fd = -1;
+    }
+
+private:
+#if !defined(_WIN32) && defined(MSG_NOSIGNAL)
+    static constexpr int SENDFLAGS = MSG_NOSIGNAL; //a dropped peer is an error return, not SIGPIPE
+#else
+    static constexpr int SENDFLAGS = 0;
+#endif
+
+    int fd = -1;
+
+#ifndef _WIN32
+    static Socket Open(const std::string& address, bool listen, bool anyInterface)
+    {
+        Socket socket;
+        if (address.substr(0, 5) == "unix:")
+        {
+            std::string path = address.substr(5);
+            sockaddr_un local{};
+            if (path.empty() || path.size() >= sizeof(local.sun_path))
+                throw std::runtime_error("Unix socket path is empty or too long: " + path);
+            local.sun_family = AF_UNIX;
+            std::copy(path.begin(), path.end(), local.sun_path);
+
+            socket.fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (socket.fd < 0)
+                throw std::runtime_error("Cannot create a socket for " + address);
+
+            // a socket file left behind by an earlier worker would make bind fail
+            if (listen)
+                ::unlink(path.c_str());
+
+            const sockaddr* target = reinterpret_cast<const sockaddr*>(&local);
+            if (listen ? ::bind(socket.fd, target, sizeof(local)) != 0 || ::listen(socket.fd, BACKLOG) != 0 : ::connect(socket.fd, target, sizeof(local)) != 0)
+                throw std::runtime_error(std::string(listen ? "Cannot listen on " : "Cannot connect to ") + address);
+            return socket;
+        }
+
+        size_t split = address.rfind(':');
+        if (split == std::string::npos)
+            throw std::runtime_error("Address " + address + " is neither HOST:PORT nor unix:PATH");
+        std::string host = address.substr(0, split), port = address.substr(split + 1);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+            host = host.substr(1, host.size() - 2);
+
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listen ? AI_PASSIVE : 0;
+        addrinfo* found = nullptr;
+        bool anyHost = host.empty() || host == "*";
+        if (anyHost && listen && !anyInterface)
+        {
+            host = "127.0.0.1";
+            anyHost = false;
+        }
+        if (::getaddrinfo(anyHost ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0)
+            throw std::runtime_error("Cannot resolve " + address);
+
+        std::unique_ptr<addrinfo, decltype(&::freeaddrinfo)> results(found, &::freeaddrinfo);
+        bool refused = false;
+        for (addrinfo* candidate = found; candidate; candidate = candidate->ai_next)
+        {
+            if (listen && !anyInterface && !IsLoopback(candidate->ai_addr))
+            {
+                refused = true;
+                continue;
+            }
+
+            socket.Close();
+            socket.fd = ::socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+            if (socket.fd < 0)
+                continue;
+
+            if (listen)
+            {
+                int reuse = 1;
+                ::setsockopt(socket.fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+                if (::bind(socket.fd, candidate->ai_addr, candidate->ai_addrlen) == 0 && ::listen(socket.fd, BACKLOG) == 0)
+                    return socket;
+            }
+            else if (::connect(socket.fd, candidate->ai_addr, candidate->ai_addrlen) == 0)
+            {
+                socket.SetNoDelay();
+                return socket;
+            }
+        }
+
+        if (refused)
+            throw std::runtime_error("Not listening on " + address + ", it is not a loopback address; pass --listen-any to accept other hosts");
+        throw std::runtime_error(std::string(listen ? "Cannot listen on " : "Cannot connect to ") + address);
+    }
+
+    static bool IsLoopback(const sockaddr* address)
+    {
+        if (address->sa_family == AF_INET)
+            return (ntohl(reinterpret_cast<const sockaddr_in*>(address)->sin_addr.s_addr) >> 24) == 127;
+        if (address->sa_family == AF_INET6)
+        {
+            const in6_addr& ip = reinterpret_cast<const sockaddr_in6*>(address)->sin6_addr;
+            return IN6_IS_ADDR_LOOPBACK(&ip) || (IN6_IS_ADDR_V4MAPPED(&ip) && ip.s6_addr[12] == 127);
+        }
+        return false;
+    }
+
+    /* Results are written in two sends, which Nagle would hold back for an acknowledgement. */
+    void SetNoDelay()
+    {
+        int nodelay = 1;
+        if (fd >= 0)
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+#else
+    static Socket Open(const std::string& address, bool, bool)
+    {
+        throw std::runtime_error("Distributed encoding needs POSIX sockets, cannot open " + address);
+    }
+#endif
+
+    static constexpr int BACKLOG = 64;
+};
+
+/*
+ * Wire format between Coordinator and Worker, all integers little endian. A job is the
+ * header below, the file name of the output for the VAG header and the bytes of the
+ * input; the reply is a result header followed by the VAG file, or by the error text when
+ * status is not 0. A connection carries one job at a time.
+ */
+namespace cluster
+{
+    constexpr uint32_t JOB_MAGIC = 0x4A474156; //"VAGJ"
+    constexpr uint32_t RESULT_MAGIC = 0x52474156; //"VAGR"
+    constexpr uint32_t MAX_NAME = 4096;
+    constexpr uint64_t MAX_DATA = 1ull << 31; //largest input file a worker accepts
+    constexpr uint64_t MAX_ERROR = 1 << 16; //longest error text a coordinator accepts
+
+    // magic, id, file type, flags, silence, name length, data length
+    constexpr size_t JOB_HEADER = 4 + 8 + 1 + 1 + 4 + 4 + 8;
+    // magic, id, status, encode microseconds, data length
+    constexpr size_t RESULT_HEADER = 4 + 8 + 1 + 8 + 8;
+
+    enum JobFlags : uint8_t
+    {
+        NOISEREDUCE = 1,
+        PRECISE = 2,
+        LOOPS = 4,
+        TRIM = 8,
+    };
+
+    template <typename T>
+    void Put(std::vector<uint8_t>& out, T value)
+    {
+        for (size_t i = 0; i < sizeof(T); i++)
+            out.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value) >> (8 * i)));
+    }
+
+    template <typename T>
+    T Get(const uint8_t*& in)
+    {
+        uint64_t value = 0;
+        for (size_t i = 0; i < sizeof(T); i++)
+            value |= static_cast<uint64_t>(in[i]) << (8 * i);
+        in += sizeof(T);
+        return static_cast<T>(value);
+    }
+}
+
+/*
+ * Serves encode jobs for a Coordinator. Every connection is handled on a thread of its
+ * own, so a worker runs as many encodes at once as the coordinator opens connections to
+ * it, up to one per hardware thread. Jobs past that wait before their input is received,
+ * and connections past MAX_CONNECTIONS wait to be accepted. The protocol is unauthenticated, anyone who reaches the address can submit jobs, so it
+ * listens on loopback only unless anyInterface is set. Runs until the process is stopped.
+ */
+class Worker
+{
+public:
+    Worker() = delete;
+    Worker(const Worker&) = delete;
+
+    Worker(std::string address, bool anyInterface) :
+        address(address),
+        anyInterface(anyInterface),
+        maxJobs(std::max(1u, std::thread::hardware_concurrency()))
+    {
+    }
+
+    void Execute()
+    {
+        Socket listener = Socket::Listen(address, anyInterface);
+        std::cout << "Worker listening on " << address << std::endl;
+
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this]() { return connections < MAX_CONNECTIONS; });
+            }
+
+            Socket connection = listener.Accept();
+            if (!connection.IsOpen())
+                continue;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                connections++;
+            }
+            std::thread([this, connection = std::move(connection)]() mutable {
+                Serve(connection);
+                connection.Close();
+                std::lock_guard<std::mutex> lock(mutex);
+                connections--;
+                changed.notify_all();
+            }).detach();
+        }
+    }
+
+private:
+    std::string address;
+    bool anyInterface;
+    unsigned maxJobs;
+
+    static constexpr unsigned MAX_CONNECTIONS = 64;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    unsigned connections = 0;
+    unsigned jobs = 0;
+
+    /* One of the maxJobs places a job holds from receiving its input to sending its result. */
+    class JobSlot
+    {
+    public:
+        explicit JobSlot(Worker& worker) : worker(worker)
+        {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            worker.changed.wait(lock, [&worker]() { return worker.jobs < worker.maxJobs; });
+            worker.jobs++;
+        }
+
+        ~JobSlot()
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.jobs--;
+            worker.changed.notify_all();
+        }
+
+    private:
+        Worker& worker;
+    };
+
+    /* Answers jobs until the coordinator hangs up or sends something that is not a job. */
+    void Serve(Socket& connection)
+    {
+        uint8_t header[cluster::JOB_HEADER];
+        while (connection.Receive(header, sizeof(header)))
+        {
+            const uint8_t* field = header;
+            uint32_t magic = cluster::Get<uint32_t>(field);
+            uint64_t id = cluster::Get<uint64_t>(field);
+            auto type = static_cast<Encoder::FileType>(cluster::Get<uint8_t>(field));
+            uint8_t flags = cluster::Get<uint8_t>(field);
+            uint32_t silence = cluster::Get<uint32_t>(field);
+            uint32_t namelength = cluster::Get<uint32_t>(field);
+            uint64_t datalength = cluster::Get<uint64_t>(field);
+
+            if (magic != cluster::JOB_MAGIC || namelength > cluster::MAX_NAME || datalength > cluster::MAX_DATA)
+                return;
+
+            JobSlot slot(*this);
+            std::string name(namelength, '\0');
+            std::string data;
+            if (!connection.Receive(name.data(), name.size()) || !ReceiveData(connection, data, datalength))
+                return;
+
+            EncodeOptions options;
+            options.noisereduce = flags & cluster::NOISEREDUCE;
+            options.precise = flags & cluster::PRECISE;
+            options.loops = flags & cluster::LOOPS;
+            options.trim = flags & cluster::TRIM;
+            options.silence = silence;
+
+            uint8_t status = 0;
+            std::string reply;
+            auto start = std::chrono::steady_clock::now();
+            try
+            {
+                reply = Encode(data, type, name, options);
+            }
+            catch (const std::exception& e)
+            {
+                status = 1;
+                reply = e.what();
+            }
+            auto micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+            std::vector<uint8_t> result;
+            cluster::Put<uint32_t>(result, cluster::RESULT_MAGIC);
+            cluster::Put<uint64_t>(result, id);
+            cluster::Put<uint8_t>(result, status);
+            cluster::Put<uint64_t>(result, static_cast<uint64_t>(micros));
+            cluster::Put<uint64_t>(result, reply.size());
+            if (!connection.Send(result.data(), result.size()) || !connection.Send(reply.data(), reply.size()))
+                return;
+        }
+    }
+
+    /* Grows data as the bytes arrive, so a claimed length is only backed by what was sent. */
+    static bool ReceiveData(Socket& connection, std::string& data, uint64_t length)
+    {
+        constexpr uint64_t CHUNK = 1 << 20;
+        try
+        {
+            while (data.size() < length)
+            {
+                size_t offset = data.size();
+                data.resize(offset + static_cast<size_t>(std::min(CHUNK, length - offset)));
+                if (!connection.Receive(data.data() + offset, data.size() - offset))
+                    return false;
+            }
+        }
+        catch (const std::bad_alloc&)
+        {
+            return false;
+        }
+        return true;
+    }
+
+    /* The VAG file EncodeFile would write for the input in data, named name in its header. */
+    static std::string Encode(const std::string& data, Encoder::FileType type, const std::string& name, const EncodeOptions& options)
+    {
+        TRACE_SCOPE("WorkerJob", name);
+        std::istringstream in(data);
+        std::unique_ptr<File> file = Encoder::OpenStream(in, type, false);
+        Encoder::ConversionType conversion = Encoder::CreateConversion(*file, options.noisereduce);
+        std::unique_ptr<VagFile> vagFile = Encoder::EncodeVag(*file, conversion, name, options);
+
+        std::ostringstream out;
+        vagFile->WriteHeader(out);
+        out.write(reinterpret_cast<const char*>(vagFile->samples.data()), static_cast<std::streamsize>(vagFile->samples.size()));
+        return out.str();
+    }
+};
+
+/*
+ * Spreads the encode of many inputs over Worker processes. The inputs are probed from
+ * their headers and handed out largest first to whichever connection is free, so the
+ * long ones do not end up last on a single worker. Every address is one connection with
+ * one job in flight; list a worker several times to keep that many of its cores busy.
+ * Inputs travel to the worker and the VAG comes back, so workers need no shared storage;
+ * each VAG is written next to its input. A job whose connection breaks is retried on
+ * another one, a worker that cannot be reached again is given up on.
+ */
+class Coordinator
+{
+public:
+    Coordinator() = delete;
+    Coordinator(const Coordinator&) = delete;
+
+    Coordinator(std::vector<std::string> inputs, std::vector<std::string> workers, EncodeOptions options) :
+        inputs(inputs),
+        workers(workers),
+        options(options)
+    {
+    }
+
+    void Execute()
+    {
+        auto start = std::chrono::steady_clock::now();
+        CollectJobs();
+
+        slotsLeft = workers.size();
+        stats.resize(workers.size());
+        std::vector<std::thread> slots;
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            stats[i].address = workers[i];
+            slots.emplace_back([this, i]() { RunSlot(i); });
+        }
+        for (auto& slot : slots)
+            slot.join();
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        Report(seconds);
+    }
+
+private:
+    static constexpr uint32_t MAX_ATTEMPTS = 3;
+    static constexpr uint32_t RECONNECTS = 3;
+
+    struct Job
+    {
+        std::string path;
+        std::string output;
+        Encoder::FileType type = Encoder::UNKNOWNTYPE;
+        uint64_t cost = 0;
+        uint64_t vagsize = 0; //the VAG the worker sends back is at most this long
+        uint32_t attempts = 0;
+        bool done = false;
+        std::string error;
+    };
+
+    struct SlotStats
+    {
+        std::string address;
+        uint64_t jobs = 0;
+        uint64_t inputbytes = 0;
+        uint64_t outputbytes = 0;
+        uint64_t micros = 0; //encode time reported by the worker
+        bool lost = false;
+    };
+
+    std::vector<std::string> inputs;
+    std::vector<std::string> workers;
+    EncodeOptions options;
+    std::vector<Job> jobs;
+    std::vector<SlotStats> stats;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<size_t> pending;
+    uint64_t inflight = 0;
+    size_t slotsLeft = 0;
+
+    /*
+     * One job per input, probed in parallel. The cost estimate is the ADPCM the input
+     * encodes to, which follows its sample count whatever the format, plus the bytes that
+     * have to be sent for it.
+     */
+    void CollectJobs()
+    {
+        for (auto& path : Inspector::CollectPaths(inputs))
+        {
+            Job job;
+            job.path = path;
+            job.type = Inspector::TypeOf(path);
+            // outputs of an earlier run sit next to their inputs
+            if (job.type == Encoder::VAGTYPE)
+                continue;
+            job.output = std::filesystem::path(path).replace_extension(".vag").string();
+            jobs.push_back(job);
+        }
+
+        if (jobs.empty())
+            throw std::runtime_error("No inputs to encode");
+
+        std::vector<std::string> paths, outputs;
+        for (auto& job : jobs)
+        {
+            paths.push_back(job.path);
+            outputs.push_back(job.output);
+        }
+        Inspector::CheckOutputs(paths, outputs);
+
+        ThreadPool::Shared().ParallelFor(jobs.size(), [this](uint64_t i) {
+            Inspector::FileInfo info;
+            info.path = jobs[i].path;
+            try
+            {
+                Inspector::Probe(info, options);
+                jobs[i].cost = info.adpcmsize + info.filesize;
+                jobs[i].vagsize = info.vagsize;
+                if (info.filesize > cluster::MAX_DATA)
+                    jobs[i].error = "Input is larger than the " + std::to_string(cluster::MAX_DATA) + " bytes a worker accepts";
+            }
+            catch (const std::exception& e)
+            {
+                jobs[i].error = e.what();
+            }
+        });
+
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            if (jobs[i].error.empty())
+                pending.push_back(i);
+        }
+        std::stable_sort(pending.begin(), pending.end(), [this](size_t a, size_t b) { return jobs[a].cost > jobs[b].cost; });
+    }
+
+    /* Takes the next job, waiting while others are in flight and might come back for a retry. */
+    bool NextJob(size_t& job)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]() { return !pending.empty() || !inflight; });
+        if (pending.empty())
+            return false;
+
+        job = pending.front();
+        pending.pop_front();
+        inflight++;
+        return true;
+    }
+
+    /* Settles a job; a broken connection puts it back in front unless it ran out of attempts. */
+    void FinishJob(size_t job, bool retry)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        inflight--;
+        if (retry)
+        {
+            if (++jobs[job].attempts < MAX_ATTEMPTS)
+                pending.push_front(job);
+            else
+                jobs[job].error = "Lost the connection to a worker " + std::to_string(MAX_ATTEMPTS) + " times";
+        }
+        changed.notify_all();
+    }
+
+    /* The last slot to lose its worker fails what is left. */
+    void RetireSlot(size_t slot)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats[slot].lost = true;
+        if (--slotsLeft == 0)
+        {
+            for (size_t job : pending)
+                jobs[job].error = "No worker left to encode on";
+            pending.clear();
+        }
+        changed.notify_all();
+    }
+
+    void RunSlot(size_t slot)
+    {
+        Socket connection;
+        size_t job;
+        while (Reconnect(connection, slot))
+        {
+            if (!NextJob(job))
+                return;
+
+            // a worker that sends something unexpected fails the job, not the whole run
+            bool delivered = false;
+            try
+            {
+                delivered = Run(connection, slot, job);
+            }
+            catch (const std::exception& e)
+            {
+                jobs[job].error = e.what();
+                FinishJob(job, false);
+                connection.Close();
+                continue;
+            }
+
+            FinishJob(job, !delivered);
+            if (!delivered)
+                connection.Close();
+        }
+        RetireSlot(slot);
+    }
+
+    /* Makes sure the slot has a connection, trying a few times with a growing delay. */
+    bool Reconnect(Socket& connection, size_t slot)
+    {
+        std::string error;
+        for (uint32_t attempt = 0; !connection.IsOpen() && attempt < RECONNECTS; attempt++)
+        {
+            if (attempt)
+                std::this_thread::sleep_for(std::chrono::milliseconds(250 * attempt));
+            try
+            {
+                connection = Socket::Connect(workers[slot]);
+            }
+            catch (const std::exception& e)
+            {
+                error = e.what();
+            }
+        }
+
+        if (!connection.IsOpen())
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::cerr << error << ", giving up on this connection\n";
+        }
+        return connection.IsOpen();
+    }
+
+    /* Sends one job and waits for its result. False when the connection broke on the way. */
+    bool Run(Socket& connection, size_t slot, size_t index)
+    {
+        Job& job = jobs[index];
+        TRACE_SCOPE("RemoteJob", job.path);
+
+        std::string data;
+        try
+        {
+            std::ifstream stream(job.path, std::ios::binary | std::ios::ate);
+            if (!stream.is_open())
+                throw std::runtime_error("File is unable to be opened");
+            data.resize(static_cast<size_t>(stream.tellg()));
+            stream.seekg(0);
+            if (!stream.read(data.data(), static_cast<std::streamsize>(data.size())))
+                throw std::runtime_error("Cannot read " + job.path);
+        }
+        catch (const std::exception& e)
+        {
+            job.error = e.what();
+            return true;
+        }
+
+        std::vector<uint8_t> header;
+        cluster::Put<uint32_t>(header, cluster::JOB_MAGIC);
+        cluster::Put<uint64_t>(header, index);
+        cluster::Put<uint8_t>(header, static_cast<uint8_t>(job.type));
+        cluster::Put<uint8_t>(header, static_cast<uint8_t>((options.noisereduce ? cluster::NOISEREDUCE : 0) | (options.precise ? cluster::PRECISE : 0)
+            | (options.loops ? cluster::LOOPS : 0) | (options.trim ? cluster::TRIM : 0)));
+        cluster::Put<uint32_t>(header, options.silence);
+        // the worker only needs the name for the VAG header, the path stays on this host
+        std::string name = std::filesystem::path(job.output).filename().string();
+        cluster::Put<uint32_t>(header, static_cast<uint32_t>(name.size()));
+        cluster::Put<uint64_t>(header, data.size());
+        if (!connection.Send(header.data(), header.size()) || !connection.Send(name.data(), name.size())
+            || !connection.Send(data.data(), data.size()))
+            return false;
+
+        uint8_t result[cluster::RESULT_HEADER];
+        if (!connection.Receive(result, sizeof(result)))
+            return false;
+
+        const uint8_t* field = result;
+        uint32_t magic = cluster::Get<uint32_t>(field);
+        uint64_t id = cluster::Get<uint64_t>(field);
+        uint8_t status = cluster::Get<uint8_t>(field);
+        uint64_t micros = cluster::Get<uint64_t>(field);
+        uint64_t length = cluster::Get<uint64_t>(field);
+        if (magic != cluster::RESULT_MAGIC || id != index)
+            return false;
+
+        if (length > (status ? cluster::MAX_ERROR : job.vagsize))
+            throw std::runtime_error("Worker " + workers[slot] + " replied with " + std::to_string(length) + " bytes, more than the "
+                + std::to_string(status ? cluster::MAX_ERROR : job.vagsize) + " expected");
+
+        std::string reply(length, '\0');
+        if (!connection.Receive(reply.data(), reply.size()))
+            return false;
+
+        if (status != 0)
+        {
+            job.error = reply;
+            return true;
+        }
+
+        std::ofstream out(job.output, std::ios::binary);
+        out.write(reply.data(), static_cast<std::streamsize>(reply.size()));
+        if (!out)
+        {
+            job.error = "Cannot write VAG output file " + job.output;
+            return true;
+        }
+
+        job.done = true;
+        SlotStats& slotStats = stats[slot];
+        slotStats.jobs++;
+        slotStats.inputbytes += data.size();
+        slotStats.outputbytes += reply.size();
+        slotStats.micros += micros;
+        return true;
+    }
+
+    void Report(double seconds)
+    {
+        uint64_t done = 0, inputbytes = 0, outputbytes = 0;
+        for (const auto& slot : stats)
+        {
+            std::cout << "worker " << slot.address << ": " << slot.jobs << " files, "
+                << std::fixed << std::setprecision(2) << slot.inputbytes / 1048576.0 << " MB in, "
+                << slot.outputbytes / 1048576.0 << " MB out, " << slot.micros / 1e6 << " s encoding"
+                << (slot.lost ? ", connection lost" : "") << "\n";
+            done += slot.jobs;
+            inputbytes += slot.inputbytes;
+            outputbytes += slot.outputbytes;
+        }
+
+        std::cout << done << " of " << jobs.size() << " files encoded on " << workers.size() << " connections in "
+            << std::fixed << std::setprecision(2) << seconds << " s, "
+            << (seconds > 0 ? inputbytes / 1048576.0 / seconds : 0.0) << " MB/s of input, "
+            << outputbytes / 1048576.0 << " MB written\n";
+
+        for (const auto& job : jobs)
+        {
+            if (!job.done)
+                std::cerr << job.path << ": " << (job.error.empty() ? "not encoded" : job.error) << "\n";
+        }
+
+        if (done != jobs.size())
+            throw std::runtime_error(std::to_string(jobs.size() - done) + " files failed to encode");
+    }
+};
@@ -1,12 +1,27 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstdint>
+#include <iostream>
 #include <limits>
 #include <vector>
 
+#include "counters.hpp"
+#include "kernels.hpp"
 #include "pcm24.hpp"
+#include "threadpool.hpp"
+#include "trace.hpp"
+
+/* Taps of the noise FIR; tap j weighs the frame j before the output one. */
+constexpr std::array<float, 4> NOISE_FIR_COEFFICIENTS = { .15f, .15f, .15f, .15f };
+
+/* Runtime settings of the 16 bit conversion, shared by every sample type. */
+struct ConvertSettings
+{
+	static inline uint64_t parallelBlock = 64 * 1024; //samples per thread pool task of convert(), 128 KB of output
+};
 
 template <int N, typename T_SampleType>
 struct FIR
@@ -33,16 +48,95 @@ class ConvertPCM16Data
 public:
 	uint64_t GetOutSize() const { return outsize; }
 
+	int16_t *GetOutSamples() { return outSamples.data(); }
+
+	uint16_t GetChannels() const { return channels; }
+
+	/*
+	 * Converts the whole input to 16 bit. The output is split into chunks that are converted
+	 * on the thread pool; ConvertRange reads the FIR look-behind of each one from the input,
+	 * so the result is the same as converting in one sequential pass.
+	 */
 	int16_t *convert()
 	{
-		if (usefir)
+		TRACE_SCOPE("ConvertPCM16::convert");
+		TRACE_BYTES(outsize * sizeof(int16_t));
+		outSamples.resize(outsize);
+
+		uint64_t parallelblock = std::max<uint64_t>(1, ConvertSettings::parallelBlock / CONVERTBLOCK) * CONVERTBLOCK;
+		uint64_t chunks = (outsize + parallelblock - 1) / parallelblock;
+		ThreadPool::Shared().ParallelFor(chunks, [this, parallelblock](uint64_t chunk) {
+			uint64_t end = std::min(outsize, (chunk + 1) * parallelblock);
+			float staging[CONVERTBLOCK];
+			for (uint64_t first = chunk * parallelblock; first < end; first += CONVERTBLOCK)
+			{
+				uint64_t count = std::min(CONVERTBLOCK, end - first);
+				ConvertRange(first, count, staging);
+				COUNTER_SCOPE(CONVERT);
+				Kernels::Active().packInt16(staging, count, outSamples.data() + first);
+			}
+		});
+
+		return outSamples.data();
+	}
+
+	/*
+	 * Converts output samples [first, first + count) to floats on the 16 bit scale, with the
+	 * FIR applied per channel when enabled. The FIRSIZE-1 frames of look-behind are read
+	 * straight from the input, so any range can be converted independently of the others.
+	 * The first FIRSIZE-1 frames of the stream pass through unfiltered.
+	 */
+	void ConvertRange(uint64_t first, uint64_t count, float *out)
+	{
+		if (!usefir)
+		{
+			COUNTER_SCOPE(CONVERT);
+			unpack(first, count, out);
+			return;
+		}
+
+		uint64_t lookbehind = static_cast<uint64_t>(FIRSIZE - 1) * channels;
+		uint64_t start = first >= lookbehind ? first - lookbehind : 0;
+
+		thread_local std::vector<float> window;
+		window.resize(first - start + count);
 		{
-			return convertwithfir();
+			COUNTER_SCOPE(CONVERT);
+			unpack(start, window.size(), window.data());
 		}
-		else
+
+		// frames before the first full window pass through, the rest go through the FIR kernel
+		COUNTER_SCOPE(FIR);
+		uint64_t passthrough = std::min(count, first < lookbehind ? lookbehind - first : 0);
+		std::copy(window.begin() + (first - start), window.begin() + (first - start) + passthrough, out);
+		Kernels::Active().fir4(window.data() + (first - start) + passthrough, count - passthrough, channels, fir->coefficients, out + passthrough);
+	}
+
+	/*
+	 * Reduces the converted samples to 1/factor of the rate by averaging each run
+	 * of factor frames, channel by channel.
+	 */
+	void resample(uint32_t factor)
+	{
+		if (factor <= 1 || !channels)
+			return;
+
+		COUNTER_SCOPE(CONVERT);
+		std::vector<int16_t> resampled;
+		uint64_t frames = outSamples.size() / channels / factor;
+		resampled.reserve(frames * channels);
+		for (uint64_t frame = 0; frame < frames; frame++)
 		{
-			return convertwithoutfir();
+			for (uint16_t channel = 0; channel < channels; channel++)
+			{
+				int32_t sum = 0;
+				for (uint32_t i = 0; i < factor; i++)
+					sum += outSamples[(frame * factor + i) * channels + channel];
+				resampled.push_back(static_cast<int16_t>(sum / static_cast<int32_t>(factor)));
+			}
 		}
+		outsize = resampled.size();
+		outSamples.swap(resampled);
 	}
 
 	virtual ~ConvertPCM16Data()
@@ -54,8 +148,9 @@ public:
 
 protected:
 	static constexpr int FIRSIZE = 4;
+	static constexpr uint64_t CONVERTBLOCK = 1024;
 	
-	FIR<FIRSIZE, T_SampleType> *fir = nullptr;
+	FIR<FIRSIZE, float> *fir = nullptr;
 	
 	bool usefir = false;
 	uint64_t samplesize;
@@ -64,7 +159,6 @@ protected:
 	uint64_t outsize;
 	uint16_t channels;
 	std::vector<int16_t>outSamples;
-	std::vector<T_SampleType>convertSamples;
 
 	ConvertPCM16Data(bool _use, uint64_t inSize, uint8_t *samples, 
 	uint8_t bps, uint64_t _outsize, uint16_t channels, std::vector<float> coef) : 
@@ -78,7 +172,7 @@ protected:
 	{
 		if (usefir)
 		{
-			fir = new (std::nothrow) FIR<FIRSIZE, T_SampleType>(coef);
+			fir = new (std::nothrow) FIR<FIRSIZE, float>(coef);
 			if (!fir)
 			{
 				std::cerr << "Cannot allocate FIR sampling class\n";
@@ -87,64 +181,8 @@ protected:
 		}
 	}
 
-	int16_t *convertwithfir()
-	{
-		
-		for (int64_t i = (FIRSIZE-2) * bytespersample; i >= 0; i -= bytespersample)
-		{
-			outSamples.push_back(convertto16(i));
-		}
-
-		for (uint64_t i = (FIRSIZE-1) * bytespersample; i < samplesize - 1; i += bytespersample)
-		{
-			T_SampleType sample = 0;
-
-			for (int j = (FIRSIZE - 1) * bytespersample; j >= 0; j -= bytespersample)
-			{
-				sample += fir->CalculateNthSample(convertfirsample(i - j), j / bytespersample);
-			}
-			
-			outSamples.push_back(convertto16(sample));
-		}
-
-		return outSamples.data();
-	}
-
-	int16_t *convertwithoutfir()
-	{
-		uint64_t outIndex = outsize - 1;
-
-		for (int64_t i = samplesize - bytespersample; i >= 0; i -= bytespersample)
-		{
-			outSamples.push_back (convertto16(i));
-		}
-
-		return outSamples.data();
-	}
-
-	void resample()
-	{
-		std::vector<int16_t> resampled;
-		for (int i = 0; i < outsize; i += 2)
-		{
-			resampled.push_back((outSamples[i] + outSamples[i + 1]) / 2);
-		}
-		outsize = resampled.size();
-		outSamples.swap(resampled);
-	}
-
-	virtual int16_t convertto16(int64_t index)
-	{
-		T_SampleType ret = bytepacker(index);
-		return convertto16(ret);
-	}
-
-	virtual int16_t convertto16(T_SampleType val) = 0;
-
-	virtual T_SampleType convertfirsample(int64_t index)
-	{
-		return bytepacker(index);
-	}
+	/* Unpacks input samples [first, first + count) to floats on the 16 bit scale. */
+	virtual void unpack(uint64_t first, uint64_t count, float *out) = 0;
 
 	virtual T_SampleType bytepacker(int64_t index) = 0;
 };
@@ -159,17 +197,14 @@ public:
 		uint64_t inSize,
 		uint8_t* samples) = delete;
 	~ConvertPCM16() = delete;
-	int16_t *convert() override { return nullptr; }
 
 protected:
-	int16_t convertto16(int64_t index) { return 0; }
-	int16_t convertto16(T_SampleType val) { return 0; }
-	T_SampleType convertfirsample(int64_t index) { return 0; }
-	T_SampleType bytepacker(int64_t index) { return 0;  }
+	void unpack(uint64_t first, uint64_t count, float *out) override {}
+	T_SampleType bytepacker(int64_t index) override { return 0;  }
 };
 
 template <>
-class ConvertPCM16<uint8_t> : public ConvertPCM16Data<uint8_t>
+class ConvertPCM16<uint8_t> final : public ConvertPCM16Data<uint8_t>
 {
 public:
 
@@ -177,36 +212,33 @@ public:
 	ConvertPCM16(bool _usefir,
 				 std::vector<float> coef,
 				 uint64_t inSize,
-				 uint8_t *samples, uint16_t channels) : ConvertPCM16Data(_usefir, inSize, samples, 1, channels, inSize, coef) {}
+				 uint8_t *samples, uint16_t channels) : ConvertPCM16Data(_usefir, inSize, samples, 1, inSize, channels, coef) {}
 
 	~ConvertPCM16() = default;
 
 protected:
 
-	int16_t convertto16(int64_t index) override
-	{
-		return static_cast<int16_t>(insamples[index] - 0x80) << 8;
-	}
-
-	int16_t convertto16(uint8_t val) override
+	static float tofloat(uint8_t val)
 	{
-		return static_cast<int16_t>(val - 0x80) << 8;
+		return static_cast<float>((val - 0x80) * 256);
 	}
 
-	uint8_t convertfirsample(int64_t index) override
+	void unpack(uint64_t first, uint64_t count, float *out) override
 	{
-		return insamples[index];
+		const uint8_t *in = insamples + first;
+		for (uint64_t i = 0; i < count; i++)
+			out[i] = tofloat(in[i]);
 	}
 
 	uint8_t bytepacker(int64_t index) override
 	{
-		return 0;
+		return insamples[index];
 	}
 
 };
 
 template <>
-class ConvertPCM16<int16_t> : public ConvertPCM16Data<int16_t>
+class ConvertPCM16<int16_t> final : public ConvertPCM16Data<int16_t>
 {
 public:
 
@@ -220,19 +252,14 @@ public:
 
 protected:
 
-	int16_t convertto16(int64_t index) override
+	static float tofloat(int16_t val)
 	{
-		return bytepacker(index);
+		return static_cast<float>(val);
 	}
 
-	int16_t convertto16(int16_t val) override
+	void unpack(uint64_t first, uint64_t count, float *out) override
 	{
-		return val;
-	}
-
-	int16_t convertfirsample(int64_t index) override
-	{
-		return bytepacker(index);
+		Kernels::Active().unpackInt16(insamples + first * 2, count, out);
 	}
 
 	int16_t bytepacker(int64_t index) override
@@ -245,7 +272,7 @@ protected:
 
 
 template <>
-class ConvertPCM16<PCM24> : public ConvertPCM16Data<PCM24>
+class ConvertPCM16<PCM24> final : public ConvertPCM16Data<PCM24>
 {
 public:
 
@@ -259,15 +286,19 @@ public:
 
 protected:
 
-	int16_t convertto16(PCM24 val) override
+	static float tofloat(PCM24 val)
 	{
 		constexpr uint32_t num = static_cast<uint32_t>(std::numeric_limits<int16_t>::max() - std::numeric_limits<int16_t>::min());
 
 		constexpr uint32_t denom = static_cast<uint32_t>(PCM24::INT24_MAX - PCM24::INT24_MIN);
 
-		int16_t output = num * static_cast<float>(val) / denom;
+		return num * static_cast<float>(val) / denom;
+	}
 
-		return output;
+	void unpack(uint64_t first, uint64_t count, float *out) override
+	{
+		for (uint64_t i = 0; i < count; i++)
+			out[i] = tofloat(bytepacker((first + i) * 3));
 	}
 
 	PCM24 bytepacker(int64_t index) override
@@ -287,7 +318,7 @@ protected:
 
 
 template <>
-class ConvertPCM16<int32_t> : public ConvertPCM16Data<int32_t>
+class ConvertPCM16<int32_t> final : public ConvertPCM16Data<int32_t>
 {
 public:
 
@@ -301,22 +332,25 @@ public:
 
 protected:
 
-	
-	int16_t convertto16(int32_t val) override
+	static float tofloat(int32_t val)
 	{
 		constexpr uint32_t num = static_cast<uint32_t>(std::numeric_limits<int16_t>::max() - std::numeric_limits<int16_t>::min());
 
 		constexpr uint64_t denom = static_cast<uint64_t>(std::numeric_limits<int32_t>::max()) - std::numeric_limits<int32_t>::min();
 
-		int16_t output = num * static_cast<float>(val) / denom;
+		return num * static_cast<float>(val) / denom;
+	}
 
-		return output;
+	void unpack(uint64_t first, uint64_t count, float *out) override
+	{
+		for (uint64_t i = 0; i < count; i++)
+			out[i] = tofloat(bytepacker((first + i) * 4));
 	}
 
 	int32_t bytepacker(int64_t index) override
 	{
 		int32_t out = 0;
-		for (int i = 0; i < bytespersample; i++)
+		for (int i = 0; i < 4; i++)
 		{
 			out |= static_cast<int32_t>(insamples[index + i]) << (8 * i);
 		}
@@ -325,7 +359,7 @@ protected:
 };
 
 template <>
-class ConvertPCM16<float> : public ConvertPCM16Data<float>
+class ConvertPCM16<float> final : public ConvertPCM16Data<float>
 {
 public:
 
@@ -339,16 +373,16 @@ public:
 
 protected:
 
-
-	int16_t convertto16(float val) override
+	static float tofloat(float val)
 	{
 		constexpr uint32_t num = std::numeric_limits<int16_t>::max();
 
-		int16_t output = num * val;
-
-		//std::cout << output << std::endl;
+		return num * val;
+	}
 
-		return output;
+	void unpack(uint64_t first, uint64_t count, float *out) override
+	{
+		Kernels::Active().unpackFloat32(insamples + first * 4, count, out);
 	}
 
 	float bytepacker(int64_t index) override
@@ -359,7 +393,7 @@ protected:
 			int32_t intVal;
 		} out{};
 
-		for (int i = 0; i < bytespersample; i++)
+		for (int i = 0; i < 4; i++)
 		{
 			out.intVal |= static_cast<int32_t>(insamples[index + i]) << (8 * i);
 		}
@@ -369,7 +403,7 @@ protected:
 };
 
 template <>
-class ConvertPCM16<double> : public ConvertPCM16Data<double>
+class ConvertPCM16<double> final : public ConvertPCM16Data<double>
 {
 public:
 
@@ -383,13 +417,17 @@ public:
 
 protected:
 
-	int16_t convertto16(double val) override
+	static float tofloat(double val)
 	{
 		constexpr uint32_t num = std::numeric_limits<int16_t>::max();
 
-		int16_t output = num * val;
+		return static_cast<float>(num * val);
+	}
 
-		return output;
+	void unpack(uint64_t first, uint64_t count, float *out) override
+	{
+		for (uint64_t i = 0; i < count; i++)
+			out[i] = tofloat(bytepacker((first + i) * 8));
 	}
 
 	double bytepacker(int64_t index) override
@@ -400,7 +438,7 @@ protected:
 			int64_t intVal;
 		} out{};
 		
-		for (int i = 0; i < bytespersample; i++)
+		for (int i = 0; i < 8; i++)
 		{
 			out.intVal |= static_cast<int64_t>(insamples[index + i]) << (8 * i);
 		}
@@ -408,4 +446,3 @@ protected:
 		return out.val;
 	}
 };
-
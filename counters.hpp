@@ -0,0 +1,347 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Hardware performance counters per pipeline stage, read with perf_event_open on Linux.
+ * Once enabled (--counters) every thread that enters a stage opens its own counter group
+ * of task clock, cycles, instructions, L1D read misses, LLC misses and branch misses, all
+ * user space only.
+ *
+ *   COUNTER_SCOPE(stage)   adds what the counters moved until the end of the enclosing
+ *                          block to one of LOAD, CONVERT, FIR, ENCODE or WRITE
+ *   COUNTER_FILE(path)     files the stages of this thread under path until the end of
+ *                          the block; tasks handed to the thread pool inherit it
+ *
+ * Events the kernel refuses, as in most containers and VMs without a PMU, are left out of
+ * the group and reported as n/a; when none opens at all the report only says why.
+ */
+class Counters
+{
+public:
+    enum Stage { LOAD, CONVERT, FIR, ENCODE, WRITE, STAGES };
+    enum Event { TASKCLOCK, CYCLES, INSTRUCTIONS, L1DMISSES, LLCMISSES, BRANCHMISSES, EVENTS };
+
+    struct FileCounters
+    {
+        std::string path;
+        std::mutex mutex;
+        double values[STAGES][EVENTS]{};
+    };
+
+    /* A reading of the group of the calling thread, with the times Add scales by for multiplexing. */
+    struct Reading
+    {
+        uint64_t values[EVENTS]{};
+        uint64_t enabled = 0;
+        uint64_t running = 0;
+    };
+
+    static Counters& Get()
+    {
+        static Counters counters;
+        return counters;
+    }
+
+    /* Starts counting; the events that open on the calling thread are the ones reported. */
+    void Enable()
+    {
+        Group& group = ThreadGroup();
+        for (int event = 0; event < EVENTS; event++)
+            available[event] = group.slot[event] >= 0;
+        enabled = group.leader >= 0;
+    }
+
+    bool IsEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+    /* The record of path, created on first use. */
+    FileCounters* File(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = std::find_if(files.begin(), files.end(), [&path](const std::unique_ptr<FileCounters>& file) { return file->path == path; });
+        if (found != files.end())
+            return found->get();
+        files.push_back(std::make_unique<FileCounters>());
+        files.back()->path = path;
+        return files.back().get();
+    }
+
+    /* The file the stages of this thread are counted for, null outside of any. */
+    static FileCounters*& Current()
+    {
+        thread_local FileCounters* current = nullptr;
+        return current;
+    }
+
+    bool Read(Reading& reading)
+    {
+        Group& group = ThreadGroup();
+#ifdef __linux__
+        if (group.leader < 0)
+            return false;
+
+        uint64_t buffer[3 + EVENTS]{};
+        if (read(group.leader, buffer, sizeof(buffer)) < static_cast<ssize_t>(3 * sizeof(uint64_t)))
+            return false;
+
+        reading.enabled = buffer[1];
+        reading.running = buffer[2];
+        for (int event = 0; event < EVENTS; event++)
+        {
+            if (group.slot[event] >= 0 && static_cast<uint64_t>(group.slot[event]) < buffer[0])
+                reading.values[event] = buffer[3 + group.slot[event]];
+        }
+        return true;
+#else
+        (void)group;
+        (void)reading;
+        return false;
+#endif
+    }
+
+    /* Adds the counts between two readings to stage of the current file. */
+    void Add(Stage stage, const Reading& start, const Reading& end)
+    {
+        uint64_t running = end.running - start.running;
+        if (!running)
+            return;
+
+        double scale = static_cast<double>(end.enabled - start.enabled) / running;
+        FileCounters* file = Current() ? Current() : File("");
+        std::lock_guard<std::mutex> lock(file->mutex);
+        for (int event = 0; event < EVENTS; event++)
+            file->values[stage][event] += (end.values[event] - start.values[event]) * scale;
+    }
+
+    /* Prints the stages of every file, then their totals. */
+    void Report(std::ostream& stream)
+    {
+        if (!IsEnabled())
+        {
+            stream << "Performance counters unavailable: " << (failure.empty() ? "not supported on this platform" : failure) << "\n";
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        stream << "\nPerformance counters (user space, per stage)\n"
+            << std::left << std::setw(10) << "stage" << std::right << std::setw(12) << "cpu ms" << std::setw(12) << "Mcycles"
+            << std::setw(12) << "Minstr" << std::setw(8) << "IPC" << std::setw(14) << "L1D misses" << std::setw(14) << "LLC misses"
+            << std::setw(14) << "br misses" << "\n";
+
+        double totals[STAGES][EVENTS]{};
+        for (auto& file : files)
+        {
+            std::lock_guard<std::mutex> fileLock(file->mutex);
+            stream << (file->path.empty() ? "(no file)" : file->path) << "\n";
+            PrintStages(stream, file->values);
+            for (int stage = 0; stage < STAGES; stage++)
+            {
+                for (int event = 0; event < EVENTS; event++)
+                    totals[stage][event] += file->values[stage][event];
+            }
+        }
+
+        stream << "total\n";
+        PrintStages(stream, totals);
+        if (!available[CYCLES])
+            stream << "Hardware events unavailable: " << failure << "\n";
+    }
+
+private:
+    struct EventSpec
+    {
+        uint32_t type;
+        uint64_t config;
+    };
+
+    /* The perf events of this thread; slot is the position of each event in a group read, -1 when it did not open. */
+    struct Group
+    {
+        int leader = -1;
+        int slot[EVENTS];
+        std::vector<int> fds;
+
+        Group()
+        {
+            std::fill(std::begin(slot), std::end(slot), -1);
+        }
+
+        ~Group()
+        {
+#ifdef __linux__
+            for (int fd : fds)
+                close(fd);
+#endif
+        }
+    };
+
+    static constexpr const char* STAGENAMES[STAGES] = { "load", "convert", "fir", "encode", "write" };
+
+    std::atomic<bool> enabled{ false };
+    bool available[EVENTS]{};
+    std::string failure;
+    std::mutex mutex;
+    std::deque<std::unique_ptr<FileCounters>> files;
+
+    Group& ThreadGroup()
+    {
+        thread_local Group group;
+        thread_local bool opened = false;
+        if (!opened)
+        {
+            opened = true;
+            Open(group);
+        }
+        return group;
+    }
+
+    /* Opens the hardware events first, so one of them leads the group when the PMU allows. */
+    void Open(Group& group)
+    {
+#ifdef __linux__
+        static const EventSpec specs[EVENTS] = {
+            { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        };
+        static const int order[EVENTS] = { CYCLES, INSTRUCTIONS, L1DMISSES, LLCMISSES, BRANCHMISSES, TASKCLOCK };
+
+        for (int event : order)
+        {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = specs[event].type;
+            attr.config = specs[event].config;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            int fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, group.leader, PERF_FLAG_FD_CLOEXEC));
+            if (fd < 0)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (failure.empty())
+                    failure = std::string("perf_event_open: ") + std::strerror(errno);
+                continue;
+            }
+
+            if (group.leader < 0)
+                group.leader = fd;
+            group.slot[event] = static_cast<int>(group.fds.size());
+            group.fds.push_back(fd);
+        }
+#else
+        (void)group;
+#endif
+    }
+
+    void PrintStages(std::ostream& stream, const double (&values)[STAGES][EVENTS]) const
+    {
+        for (int stage = 0; stage < STAGES; stage++)
+        {
+            if (!values[stage][TASKCLOCK] && !values[stage][CYCLES] && !values[stage][INSTRUCTIONS])
+                continue;
+
+            stream << "  " << std::left << std::setw(8) << STAGENAMES[stage] << std::right << std::fixed;
+            Print(stream, 12, TASKCLOCK, values[stage][TASKCLOCK] / 1e6, 1);
+            Print(stream, 12, CYCLES, values[stage][CYCLES] / 1e6, 1);
+            Print(stream, 12, INSTRUCTIONS, values[stage][INSTRUCTIONS] / 1e6, 1);
+            if (available[CYCLES] && available[INSTRUCTIONS] && values[stage][CYCLES] > 0)
+                stream << std::setw(8) << std::setprecision(2) << values[stage][INSTRUCTIONS] / values[stage][CYCLES];
+            else
+                stream << std::setw(8) << "n/a";
+            Print(stream, 14, L1DMISSES, values[stage][L1DMISSES], 0);
+            Print(stream, 14, LLCMISSES, values[stage][LLCMISSES], 0);
+            Print(stream, 14, BRANCHMISSES, values[stage][BRANCHMISSES], 0);
+            stream << "\n";
+        }
+    }
+
+    void Print(std::ostream& stream, int width, Event event, double value, int precision) const
+    {
+        if (available[event])
+            stream << std::setw(width) << std::setprecision(precision) << value;
+        else
+            stream << std::setw(width) << "n/a";
+    }
+};
+
+class CounterScope
+{
+public:
+    explicit CounterScope(Counters::Stage stage) :
+        stage(stage),
+        enabled(Counters::Get().IsEnabled())
+    {
+        if (enabled)
+            enabled = Counters::Get().Read(start);
+    }
+
+    ~CounterScope()
+    {
+        if (!enabled)
+            return;
+        Counters::Reading end;
+        if (Counters::Get().Read(end))
+            Counters::Get().Add(stage, start, end);
+    }
+
+    CounterScope(const CounterScope&) = delete;
+    CounterScope& operator=(const CounterScope&) = delete;
+
+private:
+    Counters::Stage stage;
+    bool enabled;
+    Counters::Reading start;
+};
+
+class CounterFile
+{
+public:
+    explicit CounterFile(const std::string& path) :
+        CounterFile(Counters::Get().IsEnabled() ? Counters::Get().File(path) : Counters::Current())
+    {
+    }
+
+    explicit CounterFile(Counters::FileCounters* file) :
+        previous(Counters::Current())
+    {
+        Counters::Current() = file;
+    }
+
+    ~CounterFile()
+    {
+        Counters::Current() = previous;
+    }
+
+    CounterFile(const CounterFile&) = delete;
+    CounterFile& operator=(const CounterFile&) = delete;
+
+private:
+    Counters::FileCounters* previous;
+};
+
+#define COUNTER_CONCAT_INNER(a, b) a##b
+#define COUNTER_CONCAT(a, b) COUNTER_CONCAT_INNER(a, b)
+#define COUNTER_SCOPE(stage) CounterScope COUNTER_CONCAT(counterScope, __LINE__)(Counters::stage)
+#define COUNTER_FILE(path) CounterFile COUNTER_CONCAT(counterFile, __LINE__)(path)
@@ -0,0 +1,484 @@
+#pragma once
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "file.hpp"
+#include "wav.hpp"
+#include "aiff.hpp"
+#include "flac.hpp"
+#include "vag.hpp"
+#include "vagstream.hpp"
+#include "convertpcm16.hpp"
+#include "loop.hpp"
+#include "trim.hpp"
+
+struct EncodeOptions
+{
+    bool noisereduce = true; //use fir = true, don't use = false
+    bool precise = false; //encode from the converted floats instead of 16 bit samples
+    uint32_t interleave = 0; //bytes per channel unit of an interleaved stream, 0 = plain VAG
+    uint32_t sector = 2048; //alignment of interleaved rows
+    bool loops = true; //end the output with the sustain loop of the input, when it has one
+    uint32_t silence = 0; //blocks with no sample above this 16 bit level are written as silence
+    bool trim = false; //cut the leading and trailing silence of the input
+};
+
+class Encoder
+{
+public:
+
+    enum FileType
+    {
+        UNKNOWNTYPE = 0,
+        VAGTYPE = 1,
+        WAVTYPE = 2,
+        AIFFTYPE = 3,
+        FLACTYPE = 4,
+    };
+
+    using ConversionType = std::variant<std::unique_ptr<ConvertPCM16<uint8_t>>, std::unique_ptr<ConvertPCM16<int16_t>>,
+        std::unique_ptr<ConvertPCM16<PCM24>>, std::unique_ptr<ConvertPCM16<int32_t>>, std::unique_ptr<ConvertPCM16<float>>, std::unique_ptr<ConvertPCM16<double>>>;
+
+    static inline const std::unordered_map<std::string, FileType> filetypemap
+    {
+        { "vag", VAGTYPE },
+        { "wav", WAVTYPE },
+        { "w64", WAVTYPE },
+        { "rf64", WAVTYPE },
+        { "bw64", WAVTYPE },
+        { "aif", AIFFTYPE },
+        { "aiff", AIFFTYPE },
+        { "aifc", AIFFTYPE },
+        { "flac", FLACTYPE },
+    };
+
+    static FileType GetFileType(const std::string& extension)
+    {
+        auto typesearch = filetypemap.find(extension);
+
+        if (typesearch == filetypemap.end())
+            return UNKNOWNTYPE;
+
+        return typesearch->second;
+    }
+
+    /* Loads an input file; headerOnly parses formats and sizes but leaves the samples unread. */
+    static std::unique_ptr<File> LoadInput(const std::string& path, FileType type, bool headerOnly = false)
+    {
+        TRACE_SCOPE(headerOnly ? "ProbeFile" : "LoadFile", path);
+        COUNTER_SCOPE(LOAD);
+        std::unique_ptr<File> file;
+
+        switch (type)
+        {
+        case WAVTYPE:
+        {
+            file = std::make_unique<WavFile>(path, headerOnly);
+
+            if (!file)
+                throw std::runtime_error("Cannot create WAV file");
+
+            break;
+        }
+
+        case AIFFTYPE:
+        {
+            file = std::make_unique<AIFFFile>(path, headerOnly);
+
+            if (!file)
+                throw std::runtime_error("Cannot create AIFF file");
+
+            break;
+        }
+
+        case FLACTYPE:
+        {
+            file = std::make_unique<FlacFile>(path, headerOnly);
+
+            if (!file)
+                throw std::runtime_error("Cannot create FLAC file");
+
+            break;
+        }
+        default:
+            throw std::runtime_error("Invalid file type");
+        }
+
+        TRACE_BYTES(file->samplessize);
+        return file;
+    }
+
+    /*
+     * Parses the headers of a stream, leaving plain PCM samples in it to be read while encoding.
+     * Without streaming the stream is loaded whole, loop chunks after the samples included.
+     */
+    static std::unique_ptr<File> OpenStream(std::istream& stream, FileType type, bool streaming = true)
+    {
+        TRACE_SCOPE("OpenStream");
+        COUNTER_SCOPE(LOAD);
+        switch (type)
+        {
+        case WAVTYPE:
+            return std::make_unique<WavFile>(stream, streaming);
+        case AIFFTYPE:
+            return std::make_unique<AIFFFile>(stream, streaming);
+        case FLACTYPE:
+            return std::make_unique<FlacFile>(stream, streaming);
+        default:
+            throw std::runtime_error("Invalid file type");
+        }
+    }
+
+    /* Tells WAV, AIFF and FLAC apart by the first byte of the stream, which has no name to go by. */
+    static FileType SniffType(std::istream& stream)
+    {
+        switch (stream.peek())
+        {
+        case 'R': // RIFF, RF64
+        case 'B': // BW64
+        case 'r': // Wave64
+            return WAVTYPE;
+        case 'F': // FORM
+            return AIFFTYPE;
+        case 'f': // fLaC
+            return FLACTYPE;
+        default:
+            throw std::runtime_error("Input is not a WAV, AIFF or FLAC stream");
+        }
+    }
+
+    static ConversionType CreateConversion(const File& file, bool noisereduce)
+    {
+        const std::vector<float> coef(NOISE_FIR_COEFFICIENTS.begin(), NOISE_FIR_COEFFICIENTS.end());
+
+        ConversionType conversion;
+
+        switch (file.bps)
+        {
+        case 8:
+        {
+            conversion = std::make_unique<ConvertPCM16<uint8_t>>(noisereduce, coef, file.samplessize, file.samples, file.channels);
+            break;
+        }
+        case 16:
+        {
+            conversion = std::make_unique<ConvertPCM16<int16_t>>(noisereduce, coef, file.samplessize, file.samples, file.channels);
+            break;
+        }
+        case 24:
+        {
+            conversion = std::make_unique<ConvertPCM16<PCM24>>(noisereduce, coef, file.samplessize, file.samples, file.channels);
+            break;
+        }
+        case 32:
+        {
+            if (file.isfloat)
+                conversion = std::make_unique<ConvertPCM16<float>>(noisereduce, coef, file.samplessize, file.samples, file.channels);
+            else
+                conversion = std::make_unique<ConvertPCM16<int32_t>>(noisereduce, coef, file.samplessize, file.samples, file.channels);
+            break;
+        }
+        case 64:
+        {
+            if (file.isfloat)
+                conversion = std::make_unique<ConvertPCM16<double>>(noisereduce, coef, file.samplessize, file.samples, file.channels);
+            break;
+        }
+        default:
+            throw std::runtime_error("Unhandled bit rate or sample data type");
+        }
+
+        return conversion;
+    }
+
+    /*
+     * Runs the conversion to 16 bit PCM, optionally decimating by resamplefactor.
+     * The returned samples are owned by the conversion object.
+     */
+    static int16_t* Convert(ConversionType& conversion, uint64_t& outsize, uint32_t resamplefactor = 1)
+    {
+        int16_t* convertedsamplesptr{};
+
+        std::visit([&convertedsamplesptr, &outsize, resamplefactor](auto& conv) {
+            if (!conv)
+                throw std::runtime_error("Conversion pointer not created");
+
+            convertedsamplesptr = conv->convert();
+            if (resamplefactor > 1)
+            {
+                conv->resample(resamplefactor);
+                convertedsamplesptr = conv->GetOutSamples();
+            }
+            outsize = conv->GetOutSize();
+
+            }, conversion);
+
+        return convertedsamplesptr;
+    }
+
+    /*
+     * Converts and encodes in one pass over the input, a few blocks at a time, without
+     * materializing the whole 16 bit stream. Unless precise is set the samples are
+     * truncated to 16 bit first, which gives the same output as Convert + CreateVagSamples.
+     */
+    template <typename T_Conversion>
+    static void EncodeFused(T_Conversion& conv, VagFile& vagFile, bool precise, const LoopPlan& loop = {}, float silence = 0.0f)
+    {
+        vagFile.samples.resize(PredictSize(conv, loop));
+        EncodeFused(conv, vagFile.samples.data(), precise, loop, silence);
+        vagFile.SetDataLength();
+    }
+
+    /* EncodeFused into outBuffer, which has to hold PredictSize(conv, loop) bytes. */
+    template <typename T_Conversion>
+    static void EncodeFused(T_Conversion& conv, uint8_t* outBuffer, bool precise, const LoopPlan& loop = {}, float silence = 0.0f)
+    {
+        EncodeFusedBlocks(conv, precise, [](uint64_t) {}, [&outBuffer](const uint8_t* blocks, uint64_t size) {
+            outBuffer = std::copy_n(blocks, size, outBuffer);
+        }, loop, silence);
+    }
+
+    /* Size of the ADPCM data EncodeFused writes for conv, ending with the loop of the plan. */
+    template <typename T_Conversion>
+    static uint64_t PredictSize(const T_Conversion& conv, const LoopPlan& loop)
+    {
+        return loop.looped ? VagFile::PredictSize(loop.Samples(), true) : VagFile::PredictSize(conv.GetOutSize(), false);
+    }
+
+    /*
+     * EncodeFused for input that is still arriving: prefetch(end) is called before the
+     * samples up to end are converted, and sink(blocks, size) gets the encoded blocks
+     * window by window. With a loop the output is that of the plan, and end is still a
+     * position in the output. Blocks at or below the silence level skip the predictor search.
+     */
+    template <typename T_Conversion, typename Prefetch, typename Sink>
+    static void EncodeFusedBlocks(T_Conversion& conv, bool precise, Prefetch&& prefetch, Sink&& sink, const LoopPlan& loop = {}, float silence = 0.0f)
+    {
+        if (loop.looped)
+        {
+            LoopedConversion<T_Conversion> looped(conv, loop);
+            EncodeConversionBlocks(looped, precise, prefetch, sink, loop.StartBlock(), loop.EndBlock(), true, silence);
+            return;
+        }
+
+        EncodeConversionBlocks(conv, precise, prefetch, sink, 0, 0, false, silence);
+    }
+
+    template <typename T_Conversion, typename Prefetch, typename Sink>
+    static void EncodeConversionBlocks(T_Conversion& conv, bool precise, Prefetch& prefetch, Sink& sink, uint32_t loopStart, uint32_t loopEnd, bool loopFlag, float silence)
+    {
+        uint64_t len = conv.GetOutSize();
+
+        if (precise)
+        {
+            VagFile::EncodeSourceBlocks<float>(prefetch, [&conv](uint64_t first, uint64_t count, float* window) {
+                conv.ConvertRange(first, count, window);
+            }, len, loopStart, loopEnd, loopFlag, sink, silence);
+            return;
+        }
+
+        VagFile::EncodeSourceBlocks<int16_t>(prefetch, [&conv](uint64_t first, uint64_t count, int16_t* window) {
+            float staging[VAG_FUSED_WINDOW];
+            conv.ConvertRange(first, count, staging);
+            Kernels::Active().packInt16(staging, count, window);
+        }, len, loopStart, loopEnd, loopFlag, sink, silence);
+    }
+
+    /*
+     * Calls encode(source, loop) with conv, or with conv cut down to what lies between its
+     * leading and trailing silence when options.trim is set, and the loop plan moved along.
+     */
+    template <typename T_Conversion, typename Encode>
+    static void WithTrim(T_Conversion& conv, const File& file, const EncodeOptions& options, const LoopPlan& loop, Encode&& encode, std::ostream* log = nullptr)
+    {
+        if (!options.trim)
+        {
+            encode(conv, loop);
+            return;
+        }
+
+        SilenceTrim trim = SilenceTrim::Find(conv, file.channels, static_cast<float>(options.silence), loop);
+        if (log)
+        {
+            uint64_t frames = conv.GetOutSize() / std::max<uint16_t>(1, file.channels);
+            *log << "Trimmed " << trim.skip << " leading and " << frames - trim.skip - trim.frames << " trailing frames" << std::endl;
+        }
+
+        TrimmedConversion<T_Conversion> trimmed(conv, file.channels, trim);
+        encode(trimmed, LoopPlan::Create(file, options.loops, trim.skip));
+    }
+
+    /*
+     * The whole single file path: load, convert and encode in one fused pass, then write
+     * the VAG. Returns the size of the encoded ADPCM data.
+     */
+    static uint64_t EncodeFile(const std::string& input, FileType type, const std::string& output, const EncodeOptions& options, std::ostream* log = nullptr)
+    {
+        TRACE_SCOPE("EncodeFile", input);
+        COUNTER_FILE(input);
+        std::unique_ptr<File> file = LoadInput(input, type);
+
+        if (log)
+            *log << file->samplessize << " "
+                << file->channels << " "
+                << file->samplerate << " " << file->bps << "\n";
+
+        ConversionType conversion = CreateConversion(*file, options.noisereduce);
+
+        if (options.interleave)
+            return EncodeStream(*file, conversion, output, options);
+
+        std::unique_ptr<VagFile> vagFile = EncodeVag(*file, conversion, output, options, log);
+        vagFile->WriteVagFile();
+
+        return vagFile->samples.size();
+    }
+
+    /* The plain VAG of a loaded input, with output as the name in its header. */
+    static std::unique_ptr<VagFile> EncodeVag(const File& file, ConversionType& conversion, const std::string& output, const EncodeOptions& options, std::ostream* log = nullptr)
+    {
+        LoopPlan loop = LoopPlan::Create(file, options.loops);
+        std::unique_ptr<VagFile> vagFile(new (std::nothrow) VagFile(loop.samplerate, file.channels, output));
+
+        if (!vagFile)
+            throw std::runtime_error("Cannot create vagfile object");
+
+        std::visit([&file, &vagFile, &options, &loop, log](auto& conv) {
+            if (!conv)
+                throw std::runtime_error("Conversion pointer not created");
+
+            if (log)
+                *log << conv->GetOutSize() << std::endl;
+
+            WithTrim(*conv, file, options, loop, [&vagFile, &options](auto& source, const LoopPlan& plan) {
+                EncodeFused(source, *vagFile, options.precise, plan, static_cast<float>(options.silence));
+            }, log);
+            }, conversion);
+
+        return vagFile;
+    }
+
+    /*
+     * The pipe path: input and output may be "-" for stdin and stdout. The headers are
+     * parsed, the VAG header is written from the predicted size, and then the samples are
+     * read, converted and encoded a window at a time with the blocks written as they are
+     * finished, so neither side needs seeking or the whole file in advance. Inputs that
+     * have to be decompressed first, or whose data size is unknown, are read whole, and so
+     * is any input when trimming. Loop points are only seen when their chunks come before
+     * the samples.
+     */
+    static uint64_t EncodePipe(const std::string& input, FileType type, const std::string& output, const EncodeOptions& options, std::ostream* log = nullptr)
+    {
+        TRACE_SCOPE("EncodePipe", input);
+        COUNTER_FILE(input);
+        std::ifstream inputfile;
+        std::istream* in = &std::cin;
+        if (input != "-")
+        {
+            inputfile.open(input, std::ios::binary);
+            if (!inputfile.is_open())
+                throw std::runtime_error("File is unable to be opened");
+            in = &inputfile;
+        }
+
+        if (type == UNKNOWNTYPE)
+            type = SniffType(*in);
+
+        std::unique_ptr<File> file = OpenStream(*in, type);
+
+        if (log)
+            *log << file->samplessize << " "
+                << file->channels << " "
+                << file->samplerate << " " << file->bps << "\n";
+
+        ConversionType conversion = CreateConversion(*file, options.noisereduce);
+
+        if (options.interleave)
+        {
+            file->FillSamples(UINT64_MAX);
+            return EncodeStream(*file, conversion, output, options);
+        }
+
+        std::ofstream outputfile;
+        std::ostream* out = &std::cout;
+        if (output != "-")
+        {
+            outputfile.open(output, std::ios::binary);
+            if (!outputfile.is_open())
+                throw std::runtime_error("Cannot open VAG output file " + output);
+            out = &outputfile;
+        }
+
+        // the end of the sound is only known once the whole input is in
+        if (options.trim)
+            file->FillSamples(UINT64_MAX);
+
+        LoopPlan loop = LoopPlan::Create(*file, options.loops);
+        VagFile vagFile(loop.samplerate, file->channels, output == "-" ? "" : output);
+        uint64_t size{};
+        uint32_t bytespersample = file->bps / 8;
+
+        std::visit([&](auto& conv) {
+            if (!conv)
+                throw std::runtime_error("Conversion pointer not created");
+
+            if (log)
+                *log << conv->GetOutSize() << std::endl;
+
+            WithTrim(*conv, *file, options, loop, [&](auto& source, const LoopPlan& plan) {
+                size = PredictSize(source, plan);
+                vagFile.SetDataLength(size);
+                vagFile.WriteHeader(*out);
+
+                EncodeFusedBlocks(source, options.precise, [&file, &plan, bytespersample](uint64_t end) {
+                    file->FillSamples(plan.SourceEnd(end) * bytespersample);
+                }, [out](const uint8_t* blocks, uint64_t count) {
+                    COUNTER_SCOPE(WRITE);
+                    out->write(reinterpret_cast<const char*>(blocks), count);
+                }, plan, static_cast<float>(options.silence));
+            }, log);
+            }, conversion);
+
+        out->flush();
+        if (!*out)
+            throw std::runtime_error("Cannot write VAG output " + output);
+
+        return size;
+    }
+
+    /*
+     * Writes the sector aligned interleaved layout. Channels are split apart for encoding,
+     * so this goes through the 16 bit buffer rather than the fused path. Every unit already
+     * loops on itself, so the input's own loop points are not used.
+     */
+    static uint64_t EncodeStream(const File& file, ConversionType& conversion, const std::string& output, const EncodeOptions& options)
+    {
+        VagStream stream(file.samplerate, file.channels, output == "-" ? "" : output, options.interleave, options.sector);
+
+        uint64_t outsize{};
+        int16_t* convertedsamplesptr = Convert(conversion, outsize);
+
+        stream.CreateVagSamples(convertedsamplesptr, outsize);
+        if (output == "-")
+            stream.WriteVagFile(std::cout);
+        else
+            stream.WriteVagFile();
+
+        return stream.samples.size();
+    }
+
+    static uint64_t GetFrameCount(const File& file)
+    {
+        uint32_t bytesperframe = (file.bps / 8) * file.channels;
+        if (!bytesperframe)
+            return 0;
+        return file.samplessize / bytesperframe;
+    }
+};
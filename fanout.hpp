@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "encoder.hpp"
+#include "kernels.hpp"
+#include "loop.hpp"
+#include "threadpool.hpp"
+#include "vag.hpp"
+
+/*
+ * Several variants of one asset from a single load and conversion. The input is unpacked
+ * once, without the FIR, into a shared float buffer on the 16 bit scale; every variant
+ * then reads that buffer and applies its own FIR, downmix and decimation on the fly
+ * while it is encoded. Variants are encoded concurrently on the thread pool.
+ *
+ * A variant is given as NAME[,FLAG...] and written to <output>_NAME.vag:
+ *
+ *   /N     keep every Nth frame, each the average of the N frames it replaces
+ *   mono   average the channels into one
+ *   fir    apply the noise FIR (the -nf setting of the run is the default)
+ *   nf     do not apply the noise FIR
+ *   p      encode from the float samples instead of 16 bit ones
+ *
+ * A variant without /N and mono produces the same VAG as a plain encode with its settings.
+ * Every variant ends with the sustain loop of the input unless --no-loop is set; under /N the
+ * loop points have to be multiples of N, as the averaged frames cannot split the loop.
+ */
+class FanOut
+{
+public:
+    struct Variant
+    {
+        std::string name;
+        std::string output;
+        bool noisereduce = true;
+        bool precise = false;
+        bool mono = false;
+        uint32_t factor = 1;
+        float silence = 0.0f;
+    };
+
+    /* Parses NAME[,FLAG...], with the FIR, precision and silence settings of the run as defaults. */
+    static Variant ParseVariant(const std::string& spec, const EncodeOptions& defaults)
+    {
+        Variant variant;
+        variant.noisereduce = defaults.noisereduce;
+        variant.precise = defaults.precise;
+        variant.silence = static_cast<float>(defaults.silence);
+
+        std::istringstream fields(spec);
+        std::string field;
+        std::getline(fields, variant.name, ',');
+        if (variant.name.empty() || variant.name.find_first_of("/\\:") != std::string::npos)
+            throw std::runtime_error("Variant " + spec + " needs a name usable in a file name");
+
+        while (std::getline(fields, field, ','))
+        {
+            if (field == "mono")
+                variant.mono = true;
+            else if (field == "fir")
+                variant.noisereduce = true;
+            else if (field == "nf")
+                variant.noisereduce = false;
+            else if (field == "p")
+                variant.precise = true;
+            else if (field.size() > 1 && field[0] == '/' && field.find_first_not_of("0123456789", 1) == std::string::npos
+                && field.size() < 10 && std::stoul(field.substr(1)) > 0)
+                variant.factor = static_cast<uint32_t>(std::stoul(field.substr(1)));
+            else
+                throw std::runtime_error("Unknown variant flag " + field + " in " + spec);
+        }
+        return variant;
+    }
+
+    FanOut() = delete;
+    FanOut(const FanOut&) = delete;
+
+    FanOut(std::string input, Encoder::FileType type, std::string outputBase, std::vector<Variant> variants, bool loops) :
+        input(input),
+        type(type),
+        variants(variants),
+        loops(loops)
+    {
+        for (auto& variant : this->variants)
+            variant.output = outputBase + "_" + variant.name + ".vag";
+    }
+
+    void Execute()
+    {
+        TRACE_SCOPE("FanOut", input);
+        COUNTER_FILE(input);
+        std::unique_ptr<File> file = Load();
+        Unpack(*file);
+
+        std::vector<LoopPlan> plans;
+        for (const auto& variant : variants)
+            plans.push_back(Branch(source, file->channels, variant).Plan(*file, loops));
+
+        std::vector<uint64_t> sizes(variants.size());
+        ThreadPool::Shared().ParallelFor(variants.size(), [&](uint64_t i) {
+            const Variant& variant = variants[i];
+            TRACE_SCOPE("EncodeVariant", variant.output);
+
+            Branch branch(source, file->channels, variant);
+            VagFile vagFile(plans[i].samplerate, branch.GetChannels(), variant.output);
+            Encoder::EncodeFused(branch, vagFile, variant.precise, plans[i], variant.silence);
+            vagFile.WriteVagFile();
+            sizes[i] = vagFile.samples.size();
+        });
+
+        for (size_t i = 0; i < variants.size(); i++)
+            std::cout << variants[i].name << ": " << sizes[i] << " bytes at " << plans[i].samplerate << " Hz written to " << variants[i].output << "\n";
+    }
+
+private:
+    static constexpr uint64_t UNPACKBLOCK = 1 << 20;
+
+    /*
+     * One variant's view of the shared samples: ConvertRange produces its output samples
+     * like a ConvertPCM16 would, so the fused encoder takes it as a conversion.
+     */
+    class Branch
+    {
+    public:
+        Branch(const std::vector<float>& source, uint16_t channels, const Variant& variant) :
+            source(source),
+            channels(std::max<uint16_t>(1, channels)),
+            variant(variant)
+        {
+        }
+
+        uint16_t GetChannels() const { return variant.mono ? 1 : channels; }
+
+        uint64_t GetOutSize() const { return source.size() / channels / variant.factor * GetChannels(); }
+
+        /* Loop plan of the variant's output, from the loop points of file scaled down by /N. */
+        LoopPlan Plan(const File& file, bool loops) const
+        {
+            uint64_t frames = source.size() / channels;
+            uint64_t loopEnd = std::min(file.loopend, frames);
+            bool looped = loops && file.looped && file.loopstart < loopEnd;
+            if (looped && (file.loopstart % variant.factor || loopEnd % variant.factor))
+                throw std::runtime_error("Loop of the input does not fall on /" + std::to_string(variant.factor) + " frames in variant "
+                    + variant.name + ", drop /N or use --no-loop");
+
+            return LoopPlan::Create(GetChannels(), file.samplerate / variant.factor, GetOutSize() / GetChannels(), looped,
+                file.loopstart / variant.factor, loopEnd / variant.factor);
+        }
+
+        void ConvertRange(uint64_t first, uint64_t count, float* out)
+        {
+            if (!count)
+                return;
+
+            if (variant.factor == 1 && !variant.mono)
+            {
+                Filter(first, count, out);
+                return;
+            }
+
+            uint64_t outChannels = GetChannels();
+            uint64_t firstFrame = first / outChannels;
+            uint64_t lastFrame = (first + count - 1) / outChannels;
+            uint64_t inputFrames = (lastFrame - firstFrame + 1) * variant.factor;
+
+            thread_local std::vector<float> filtered;
+            filtered.resize(inputFrames * channels);
+            Filter(firstFrame * variant.factor * channels, filtered.size(), filtered.data());
+
+            thread_local std::vector<float> frames;
+            frames.resize((lastFrame - firstFrame + 1) * outChannels);
+            float scale = 1.0f / static_cast<float>(variant.factor * (variant.mono ? channels : 1));
+            for (uint64_t frame = 0; frame <= lastFrame - firstFrame; frame++)
+            {
+                const float* in = filtered.data() + frame * variant.factor * channels;
+                for (uint64_t c = 0; c < outChannels; c++)
+                {
+                    float sum = 0.0f;
+                    for (uint64_t k = 0; k < variant.factor; k++)
+                    {
+                        if (variant.mono)
+                        {
+                            for (uint64_t channel = 0; channel < channels; channel++)
+                                sum += in[k * channels + channel];
+                        }
+                        else
+                        {
+                            sum += in[k * channels + c];
+                        }
+                    }
+                    frames[frame * outChannels + c] = sum * scale;
+                }
+            }
+
+            std::copy_n(frames.begin() + (first - firstFrame * outChannels), count, out);
+        }
+
+    private:
+        const std::vector<float>& source;
+        uint64_t channels;
+        Variant variant;
+
+        /* Samples [first, first + count) of the source with the FIR applied when the variant uses it. */
+        void Filter(uint64_t first, uint64_t count, float* out) const
+        {
+            if (!variant.noisereduce)
+            {
+                std::copy_n(source.begin() + first, count, out);
+                return;
+            }
+
+            // the first frames of the stream pass through unfiltered, like in ConvertRange
+            COUNTER_SCOPE(FIR);
+            uint64_t lookbehind = (NOISE_FIR_COEFFICIENTS.size() - 1) * channels;
+            uint64_t passthrough = std::min(count, first < lookbehind ? lookbehind - first : 0);
+            std::copy_n(source.begin() + first, passthrough, out);
+            Kernels::Active().fir4(source.data() + first + passthrough, count - passthrough, channels, NOISE_FIR_COEFFICIENTS.data(), out + passthrough);
+        }
+    };
+
+    std::string input;
+    Encoder::FileType type;
+    std::vector<Variant> variants;
+    bool loops;
+    std::vector<float> source;
+
+    std::unique_ptr<File> Load()
+    {
+        if (input != "-")
+            return Encoder::LoadInput(input, type);
+
+        Encoder::FileType streamType = type == Encoder::UNKNOWNTYPE ? Encoder::SniffType(std::cin) : type;
+        std::unique_ptr<File> file = Encoder::OpenStream(std::cin, streamType);
+        file->FillSamples(UINT64_MAX);
+        return file;
+    }
+
+    /* Unpacks the whole input to floats once, in parallel blocks. */
+    void Unpack(const File& file)
+    {
+        TRACE_SCOPE("UnpackShared");
+        Encoder::ConversionType conversion = Encoder::CreateConversion(file, false);
+
+        std::visit([this](auto& conv) {
+            if (!conv)
+                throw std::runtime_error("Conversion pointer not created");
+
+            source.resize(conv->GetOutSize());
+            TRACE_BYTES(source.size() * sizeof(float));
+            uint64_t blocks = (source.size() + UNPACKBLOCK - 1) / UNPACKBLOCK;
+            ThreadPool::Shared().ParallelFor(blocks, [this, &conv](uint64_t block) {
+                uint64_t first = block * UNPACKBLOCK;
+                conv->ConvertRange(first, std::min<uint64_t>(UNPACKBLOCK, source.size() - first), source.data() + first);
+            });
+            }, conversion);
+    }
+};
@@ -1,15 +1,27 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <vector>
 #include <string>
 #include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+
+#include "threadpool.hpp"
+#include "trace.hpp"
 struct File
 {
 	uint8_t* samples{};
-	uint32_t samplerate{}, samplessize{}, bps{};
+	uint32_t samplerate{}, bps{};
+	uint64_t samplessize{};
 	uint16_t channels{};
 	bool isfloat = false;
+	bool headeronly = false; //parse headers and sizes only, samples stay unread
+	bool streamed = false; //leave the sample data in the stream until FillSamples reads it
+	bool looped = false; //sustain loop from the smpl/cue or INST/MARK chunks
+	uint64_t loopstart{}, loopend{}; //loop frames, the end is exclusive
 	File() = default;
 	virtual ~File() {
 		if (samples)
@@ -38,8 +50,147 @@ struct File
 		return filedata;
 	}
 
+	/*
+	 * Skips count bytes of a stream, seeking when the stream allows it and
+	 * reading through it otherwise.
+	 */
+	static bool SkipBytes(std::istream& stream, uint64_t count)
+	{
+		if (!count)
+			return true;
+
+		std::streampos position = stream.tellg();
+		if (position != std::streampos(-1) && stream.seekg(static_cast<std::streamoff>(count), std::ios_base::cur))
+			return true;
+
+		stream.clear();
+		while (count && stream)
+		{
+			std::streamsize step = static_cast<std::streamsize>(std::min<uint64_t>(count, 1u << 20));
+			stream.ignore(step);
+			count -= stream.gcount();
+			if (stream.gcount() != step)
+				return false;
+		}
+		return !count;
+	}
+
+	/* Bytes left in a seekable stream, UINT64_MAX when the stream cannot seek. */
+	static uint64_t RemainingBytes(std::istream& stream)
+	{
+		std::streampos position = stream.tellg();
+		if (position == std::streampos(-1))
+		{
+			stream.clear();
+			return UINT64_MAX;
+		}
+
+		stream.seekg(0, std::ios_base::end);
+		std::streampos end = stream.tellg();
+		stream.seekg(position);
+		return static_cast<uint64_t>(end - position);
+	}
+
+	/*
+	 * Reads count bytes of sample data into a fresh samples buffer. Returns the number
+	 * of bytes actually present, which may be short for truncated files. Header only
+	 * loads skip the data and just report its size; streamed loads allocate the buffer
+	 * and leave the data to FillSamples.
+	 */
+	uint64_t ReadSamples(std::istream& stream, uint64_t count)
+	{
+		TRACE_SCOPE("ReadSamples");
+		TRACE_BYTES(count);
+		if (headeronly)
+		{
+			uint64_t present = std::min(count, RemainingBytes(stream));
+			SkipBytes(stream, present);
+			return present;
+		}
+
+		AllocateSamples(count);
+
+		if (streamed && count)
+		{
+			samplestream = &stream;
+			return count;
+		}
+
+		uint64_t total = 0;
+		while (total < count && stream)
+		{
+			std::streamsize step = static_cast<std::streamsize>(std::min<uint64_t>(count - total, 1u << 30));
+			stream.read(reinterpret_cast<char*>(samples + total), step);
+			total += stream.gcount();
+		}
+		samplesloaded = samplescapacity = total;
+		return total;
+	}
+
+	/* Reads a data chunk of unknown size, as left by writers streaming into a pipe, up to the end of the stream. */
+	uint64_t ReadSamplesToEnd(std::istream& stream)
+	{
+		TRACE_SCOPE("ReadSamplesToEnd");
+		std::vector<uint8_t> data;
+		while (stream)
+		{
+			size_t size = data.size();
+			data.resize(size + (1u << 20));
+			stream.read(reinterpret_cast<char*>(data.data() + size), 1u << 20);
+			data.resize(size + stream.gcount());
+		}
+		TRACE_BYTES(data.size());
+
+		if (headeronly)
+			return data.size();
+
+		AllocateSamples(data.size());
+		std::copy(data.begin(), data.end(), samples);
+		samplesloaded = data.size();
+		return data.size();
+	}
+
+	/*
+	 * Makes sure the sample bytes before end are read and prepared. Streamed loads read
+	 * ahead in 64 KB steps; once the stream is drained, or for loads that read everything
+	 * up front, this only checks the range.
+	 */
+	void FillSamples(uint64_t end)
+	{
+		end = std::min(end, samplescapacity);
+		if (samplestream && samplesloaded < end)
+		{
+			TRACE_SCOPE("FillSamples");
+			COUNTER_SCOPE(LOAD);
+			uint64_t target = std::min(samplescapacity, std::max(end, samplesloaded + (1u << 16)));
+			samplestream->read(reinterpret_cast<char*>(samples + samplesloaded), static_cast<std::streamsize>(target - samplesloaded));
+			uint64_t count = static_cast<uint64_t>(samplestream->gcount());
+			TRACE_BYTES(count);
+			samplesloaded += count;
+			if (samplesloaded < target || samplesloaded == samplescapacity)
+				samplestream = nullptr;
+		}
+
+		if (samplesloaded < end)
+			throw std::runtime_error("Input ended before the end of its sample data");
+
+		PrepareLoaded();
+	}
+
+	/* True while part of the sample data is still waiting in the stream. */
+	bool IsStreaming() const { return samplestream != nullptr; }
+
 	void ULawDecompression()
 	{
+		TRACE_SCOPE("ULawDecompression");
+		TRACE_BYTES(samplessize);
+		if (headeronly)
+		{
+			samplessize *= 2;
+			bps = 16;
+			return;
+		}
+
 		int16_t* decompressed = new (std::nothrow) int16_t[samplessize];
 		if (!decompressed)
 		{
@@ -47,7 +198,7 @@ struct File
 			throw std::bad_alloc();
 		}
 
-		for (unsigned i = 0; i < samplessize; i++)
+		for (uint64_t i = 0; i < samplessize; i++)
 		{
 			constexpr uint16_t BIAS = 33;
 
@@ -81,6 +232,15 @@ struct File
 
 	void ALawDecompression()
 	{
+		TRACE_SCOPE("ALawDecompression");
+		TRACE_BYTES(samplessize);
+		if (headeronly)
+		{
+			samplessize *= 2;
+			bps = 16;
+			return;
+		}
+
 		int16_t* decompressed = new (std::nothrow) int16_t[samplessize];
 		if (!decompressed)
 		{
@@ -88,7 +248,7 @@ struct File
 			throw std::bad_alloc();
 		}
 
-		for (unsigned i = 0; i < samplessize; i++)
+		for (uint64_t i = 0; i < samplessize; i++)
 		{
 			uint8_t input = 0x55 ^ samples[i];
 			bool sign = false;
@@ -119,4 +279,227 @@ struct File
 		samplessize *= 2;
 		bps = 16;
 	}
-};
\ No newline at end of file
+
+	/*
+	 * Microsoft ADPCM: every block starts with a predictor index, delta and two history
+	 * samples per channel, followed by 4 bit codes interleaved across channels. Blocks
+	 * are independent, so they are decoded in parallel straight into 16 bit PCM.
+	 */
+	void MSADPCMDecompression(uint16_t blockAlign, uint16_t samplesPerBlock, const std::vector<std::pair<int16_t, int16_t>>& coefs)
+	{
+		static constexpr int32_t adaptationTable[16] = { 230, 230, 230, 230, 307, 409, 512, 614, 768, 614, 512, 409, 307, 230, 230, 230 };
+
+		uint32_t headerSize = 7u * channels;
+		if (!channels || coefs.empty() || blockAlign <= headerSize || samplesPerBlock < 2)
+			throw std::runtime_error("Invalid MS ADPCM format");
+
+		auto blockFrames = [this, headerSize, samplesPerBlock](uint64_t bytes) -> uint64_t {
+			if (bytes < headerSize)
+				return 0;
+			return std::min<uint64_t>(samplesPerBlock, (bytes - headerSize) * 2 / channels + 2);
+		};
+
+		DecompressADPCMBlocks(blockAlign, samplesPerBlock, blockFrames,
+			[this, &coefs](const uint8_t* block, uint64_t frames, int16_t* out) {
+				uint16_t ch = channels;
+				std::vector<int32_t> state(4u * ch);
+				int32_t* delta = &state[0];
+				int32_t* sample1 = &state[ch];
+				int32_t* sample2 = &state[2u * ch];
+				int32_t* predictor = &state[3u * ch];
+
+				for (uint16_t c = 0; c < ch; c++)
+				{
+					predictor[c] = std::min<int32_t>(block[c], static_cast<int32_t>(coefs.size()) - 1);
+					delta[c] = static_cast<int16_t>(block[ch + 2 * c] | (block[ch + 2 * c + 1] << 8));
+					sample1[c] = static_cast<int16_t>(block[3 * ch + 2 * c] | (block[3 * ch + 2 * c + 1] << 8));
+					sample2[c] = static_cast<int16_t>(block[5 * ch + 2 * c] | (block[5 * ch + 2 * c + 1] << 8));
+					out[c] = static_cast<int16_t>(sample2[c]);
+					out[ch + c] = static_cast<int16_t>(sample1[c]);
+				}
+
+				const uint8_t* nibbles = block + 7u * ch;
+				uint64_t codes = (frames - 2) * ch;
+				for (uint64_t i = 0; i < codes; i++)
+				{
+					uint16_t c = static_cast<uint16_t>(i % ch);
+					uint8_t code = (i & 1) ? (nibbles[i >> 1] & 0x0F) : (nibbles[i >> 1] >> 4);
+					int32_t signedCode = (code & 0x08) ? code - 16 : code;
+
+					// full scale products can sum to 2^31, and delta is capped as ffmpeg does so its products cannot overflow
+					int64_t predicted = (int64_t(sample1[c]) * coefs[predictor[c]].first + int64_t(sample2[c]) * coefs[predictor[c]].second) >> 8;
+					int32_t decoded = static_cast<int32_t>(std::min<int64_t>(std::max<int64_t>(predicted + signedCode * delta[c], -32768), 32767));
+
+					sample2[c] = sample1[c];
+					sample1[c] = decoded;
+					delta[c] = std::min<int32_t>(std::max<int32_t>((adaptationTable[code] * delta[c]) >> 8, 16), INT32_MAX / 768);
+
+					out[2u * ch + i] = static_cast<int16_t>(decoded);
+				}
+			});
+	}
+
+	/*
+	 * IMA (DVI) ADPCM: every block starts with a sample and step index per channel, followed
+	 * by 4 byte groups of 4 bit codes for each channel in turn, low nibble first.
+	 */
+	void IMAADPCMDecompression(uint16_t blockAlign, uint16_t samplesPerBlock)
+	{
+		static constexpr int32_t indexTable[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+		static constexpr int32_t stepTable[89] = {
+			7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+			50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+			253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+			1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+			3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+			12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767 };
+
+		uint32_t headerSize = 4u * channels;
+		if (!channels || blockAlign <= headerSize || samplesPerBlock < 1)
+			throw std::runtime_error("Invalid IMA ADPCM format");
+
+		auto blockFrames = [this, headerSize, samplesPerBlock](uint64_t bytes) -> uint64_t {
+			if (bytes < headerSize)
+				return 0;
+			uint64_t groups = (bytes - headerSize) / (4u * channels);
+			return std::min<uint64_t>(samplesPerBlock, groups * 8 + 1);
+		};
+
+		DecompressADPCMBlocks(blockAlign, samplesPerBlock, blockFrames,
+			[this](const uint8_t* block, uint64_t frames, int16_t* out) {
+				uint16_t ch = channels;
+				for (uint16_t c = 0; c < ch; c++)
+				{
+					const uint8_t* header = block + 4u * c;
+					int32_t predictor = static_cast<int16_t>(header[0] | (header[1] << 8));
+					int32_t index = std::min<int32_t>(header[2], 88);
+					out[c] = static_cast<int16_t>(predictor);
+
+					const uint8_t* data = block + 4u * ch + 4u * c;
+					for (uint64_t frame = 1; frame < frames; frame++)
+					{
+						uint64_t code = frame - 1;
+						uint8_t byte = data[(code / 8) * 4u * ch + (code % 8) / 2];
+						uint8_t nibble = (code & 1) ? (byte >> 4) : (byte & 0x0F);
+
+						int32_t step = stepTable[index];
+						int32_t diff = step >> 3;
+						if (nibble & 1) diff += step >> 2;
+						if (nibble & 2) diff += step >> 1;
+						if (nibble & 4) diff += step;
+						if (nibble & 8) diff = -diff;
+
+						predictor = std::min<int32_t>(std::max<int32_t>(predictor + diff, -32768), 32767);
+						index = std::min<int32_t>(std::max<int32_t>(index + indexTable[nibble], 0), 88);
+
+						out[frame * ch + c] = static_cast<int16_t>(predictor);
+					}
+				}
+			});
+	}
+
+protected:
+	/*
+	 * In place fix-up of freshly read sample bytes [begin, end), such as byte swapping
+	 * big endian data. Runs on whole multiples of preparestride; a stride of 0 holds the
+	 * data back until the format is known and SetPrepareStride is called.
+	 */
+	virtual void PrepareSamples(uint64_t begin, uint64_t end) {}
+
+	uint32_t preparestride = 1;
+
+	void SetPrepareStride(uint32_t stride)
+	{
+		preparestride = stride;
+		PrepareLoaded();
+	}
+
+private:
+	std::istream* samplestream = nullptr; //holds the rest of the sample data of a streamed load
+	uint64_t samplescapacity = 0;
+	uint64_t samplesloaded = 0;
+	uint64_t samplesprepared = 0;
+
+	void AllocateSamples(uint64_t count)
+	{
+		samples = new (std::nothrow) uint8_t[count];
+
+		if (!samples)
+		{
+			std::cerr << "Unable to create samples buffer\n";
+			throw std::bad_alloc();
+		}
+		samplescapacity = count;
+	}
+
+	void PrepareLoaded()
+	{
+		if (!preparestride)
+			return;
+
+		uint64_t end = samplesloaded == samplescapacity ? samplesloaded : samplesloaded - samplesloaded % preparestride;
+		if (end > samplesprepared)
+		{
+			PrepareSamples(samplesprepared, end);
+			samplesprepared = end;
+		}
+	}
+
+	/*
+	 * Splits the sample data into blockAlign sized ADPCM blocks and decodes them in parallel,
+	 * each one writing to its own slice of the 16 bit output.
+	 */
+	template <typename FramesFunc, typename DecodeFunc>
+	void DecompressADPCMBlocks(uint16_t blockAlign, uint16_t samplesPerBlock, FramesFunc blockFrames, DecodeFunc decodeBlock)
+	{
+		TRACE_SCOPE("ADPCMDecompression");
+		TRACE_BYTES(samplessize);
+		// every full block decodes samplesPerBlock frames, which have to lie within it
+		if (blockFrames(blockAlign) < samplesPerBlock)
+			throw std::runtime_error("ADPCM blocks of " + std::to_string(blockAlign) + " bytes cannot hold " + std::to_string(samplesPerBlock) + " frames");
+
+		uint64_t fullBlocks = samplessize / blockAlign;
+		uint64_t tailBytes = samplessize % blockAlign;
+		uint64_t tailFrames = blockFrames(tailBytes);
+		uint64_t blocks = fullBlocks + (tailFrames ? 1 : 0);
+		uint64_t frames = fullBlocks * samplesPerBlock + tailFrames;
+
+		if (headeronly)
+		{
+			samplessize = frames * channels * 2;
+			bps = 16;
+			return;
+		}
+
+		int16_t* decompressed = new (std::nothrow) int16_t[frames * channels];
+		if (!decompressed)
+		{
+			std::cerr << "cannot allocate decompressed ADPCM samples\n";
+			throw std::bad_alloc();
+		}
+
+		constexpr uint64_t blocksPerTask = 64;
+		try
+		{
+			ThreadPool::Shared().ParallelFor((blocks + blocksPerTask - 1) / blocksPerTask, [&](uint64_t task) {
+				uint64_t end = std::min(blocks, (task + 1) * blocksPerTask);
+				for (uint64_t block = task * blocksPerTask; block < end; block++)
+				{
+					uint64_t blockFrameCount = block < fullBlocks ? samplesPerBlock : tailFrames;
+					decodeBlock(samples + block * blockAlign, blockFrameCount,
+						decompressed + block * samplesPerBlock * channels);
+				}
+			});
+		}
+		catch (...)
+		{
+			delete[] decompressed;
+			throw;
+		}
+
+		delete[] samples;
+		samples = (uint8_t*)decompressed;
+		samplessize = frames * channels * 2;
+		bps = 16;
+	}
+};
@@ -0,0 +1,733 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "file.hpp"
+#include "threadpool.hpp"
+#include "trace.hpp"
+
+namespace flac
+{
+    constexpr std::array<uint8_t, 256> MakeCrc8Table()
+    {
+        std::array<uint8_t, 256> table{};
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) & 0xFF : (crc << 1) & 0xFF;
+            table[i] = static_cast<uint8_t>(crc);
+        }
+        return table;
+    }
+
+    constexpr std::array<uint16_t, 256> MakeCrc16Table()
+    {
+        std::array<uint16_t, 256> table{};
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i << 8;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc & 0x8000) ? ((crc << 1) ^ 0x8005) & 0xFFFF : (crc << 1) & 0xFFFF;
+            table[i] = static_cast<uint16_t>(crc);
+        }
+        return table;
+    }
+
+    /* CRC-8 of frame headers, polynomial x^8 + x^2 + x + 1. */
+    constexpr std::array<uint8_t, 256> CRC8TABLE = MakeCrc8Table();
+    /* CRC-16 of whole frames, polynomial x^16 + x^15 + x^2 + 1. */
+    constexpr std::array<uint16_t, 256> CRC16TABLE = MakeCrc16Table();
+
+    inline uint8_t Crc8(const uint8_t* data, size_t size)
+    {
+        uint8_t crc = 0;
+        for (size_t i = 0; i < size; i++)
+            crc = CRC8TABLE[crc ^ data[i]];
+        return crc;
+    }
+
+    inline uint16_t Crc16(const uint8_t* data, size_t size)
+    {
+        uint16_t crc = 0;
+        for (size_t i = 0; i < size; i++)
+            crc = static_cast<uint16_t>((crc << 8) ^ CRC16TABLE[(crc >> 8) ^ data[i]]);
+        return crc;
+    }
+
+    /* Reads a frame MSB first; running past the end of the frame throws. */
+    class BitReader
+    {
+    public:
+        BitReader(const uint8_t* data, const uint8_t* end) :
+            data(data),
+            bits(static_cast<uint64_t>(end - data) * 8)
+        {
+        }
+
+        /* The next count bits as an unsigned number, count up to 32. */
+        uint32_t Read(uint32_t count)
+        {
+            if (!count)
+                return 0;
+            if (position + count > bits)
+                throw std::runtime_error("FLAC frame is truncated");
+
+            const uint8_t* byte = data + (position >> 3);
+            uint32_t skip = static_cast<uint32_t>(position & 7);
+            uint32_t bytes = (skip + count + 7) >> 3;
+            uint64_t window = 0;
+            for (uint32_t i = 0; i < bytes; i++)
+                window = (window << 8) | byte[i];
+
+            position += count;
+            return static_cast<uint32_t>((window >> (bytes * 8 - skip - count)) & ((1ull << count) - 1));
+        }
+
+        /* The next count bits as a two's complement number. */
+        int32_t ReadSigned(uint32_t count)
+        {
+            if (!count)
+                return 0;
+            uint32_t value = Read(count);
+            if (count < 32 && (value >> (count - 1)))
+                value |= ~0u << count;
+            return static_cast<int32_t>(value);
+        }
+
+        /* The number of zero bits before the next one bit, which is consumed too. */
+        uint32_t ReadUnary()
+        {
+            uint32_t zeros = 0;
+            for (;;)
+            {
+                if (position >= bits)
+                    throw std::runtime_error("FLAC frame is truncated");
+
+                uint32_t used = static_cast<uint32_t>(position & 7);
+                uint8_t byte = static_cast<uint8_t>(data[position >> 3] << used);
+                if (!byte)
+                {
+                    zeros += 8 - used;
+                    position += 8 - used;
+                    continue;
+                }
+
+                uint32_t leading = 0;
+                while (!(byte & 0x80))
+                {
+                    byte = static_cast<uint8_t>(byte << 1);
+                    leading++;
+                }
+                position += leading + 1;
+                return zeros + leading;
+            }
+        }
+
+        void AlignToByte() { position = (position + 7) & ~7ull; }
+
+        /* The byte the reader is at, valid once aligned. */
+        const uint8_t* Position() const { return data + (position >> 3); }
+
+    private:
+        const uint8_t* data;
+        uint64_t bits;
+        uint64_t position = 0;
+    };
+
+    enum ChannelAssignment
+    {
+        INDEPENDENT = 0,
+        LEFTSIDE = 8,
+        SIDERIGHT = 9,
+        MIDSIDE = 10
+    };
+
+    struct FrameHeader
+    {
+        bool variable = false; //number counts samples instead of frames
+        uint64_t number = 0;
+        uint32_t blocksize = 0;
+        uint32_t assignment = 0; //channels - 1 for independent channels, else a ChannelAssignment
+        uint32_t bps = 0; //0 takes the one of STREAMINFO
+        uint32_t size = 0; //bytes up to and including the CRC-8
+
+        uint16_t Channels() const { return static_cast<uint16_t>(assignment < LEFTSIDE ? assignment + 1 : 2); }
+    };
+
+    /* Parses the frame header at data, false when the bytes there are not one. */
+    inline bool ParseFrameHeader(const uint8_t* data, const uint8_t* end, FrameHeader& header)
+    {
+        static constexpr uint32_t sampleSizes[8] = { 0, 8, 12, 0, 16, 20, 24, 32 };
+
+        if (end - data < 6 || data[0] != 0xFF || (data[1] & 0xFE) != 0xF8)
+            return false;
+
+        uint32_t blockCode = data[2] >> 4;
+        uint32_t rateCode = data[2] & 0x0F;
+        header.assignment = data[3] >> 4;
+        uint32_t sizeCode = (data[3] >> 1) & 0x07;
+        if (!blockCode || rateCode == 15 || header.assignment > MIDSIDE || sizeCode == 3 || (data[3] & 1))
+            return false;
+        header.variable = data[1] & 1;
+        header.bps = sampleSizes[sizeCode];
+
+        // frame or sample number in the UTF-8 scheme, up to 36 bits in 7 bytes
+        const uint8_t* field = data + 4;
+        uint32_t extra = 0;
+        uint8_t first = *field++;
+        if (!(first & 0x80))
+            header.number = first;
+        else
+        {
+            uint8_t mask = 0x40;
+            while (extra < 6 && (first & mask))
+            {
+                extra++;
+                mask >>= 1;
+            }
+            if (!extra || (first & mask) || end - field < static_cast<ptrdiff_t>(extra))
+                return false;
+            header.number = first & (mask - 1);
+            for (uint32_t i = 0; i < extra; i++, field++)
+            {
+                if ((*field & 0xC0) != 0x80)
+                    return false;
+                header.number = (header.number << 6) | (*field & 0x3F);
+            }
+        }
+        if (!header.variable && extra > 5)
+            return false;
+
+        uint32_t tail = (blockCode == 6 ? 1 : blockCode == 7 ? 2 : 0) + (rateCode == 12 ? 1 : rateCode >= 13 ? 2 : 0);
+        if (end - field < static_cast<ptrdiff_t>(tail) + 1)
+            return false;
+
+        if (blockCode == 1)
+            header.blocksize = 192;
+        else if (blockCode <= 5)
+            header.blocksize = 576u << (blockCode - 2);
+        else if (blockCode == 6)
+            header.blocksize = field[0] + 1u;
+        else if (blockCode == 7)
+            header.blocksize = ((field[0] << 8) | field[1]) + 1u;
+        else
+            header.blocksize = 256u << (blockCode - 8);
+
+        field += tail;
+        if (Crc8(data, field - data) != *field)
+            return false;
+        header.size = static_cast<uint32_t>(field + 1 - data);
+        return true;
+    }
+}
+
+/*
+ * Native FLAC reader. The metadata blocks give the format and the sample count, so a
+ * header only load stops after them; VORBIS_COMMENT LOOPSTART and LOOPLENGTH tags are
+ * taken as the loop. For the samples the whole stream is read, the frame boundaries are
+ * found with one pass over the sync codes, and the frames, which do not depend on each
+ * other, are decoded in parallel into little endian PCM of 8, 16, 24 or 32 bits, whichever
+ * holds the bit depth of the stream, for ConvertPCM16. Every frame is checked against its
+ * CRC-16; the MD5 of STREAMINFO is not.
+ */
+struct FlacFile : public File
+{
+    FlacFile() = delete;
+
+    FlacFile(std::string name, bool headerOnly = false)
+    {
+        headeronly = headerOnly;
+        std::ifstream filehandle(name, std::ios::binary);
+
+        if (!filehandle.is_open())
+            throw std::runtime_error("File is unable to be opened");
+
+        LoadFlacStream(filehandle);
+    }
+
+    /* Frames are only found from the whole stream, so a stream is read to its end up front. */
+    explicit FlacFile(std::istream& stream, bool streaming = true)
+    {
+        (void)streaming;
+        LoadFlacStream(stream);
+    }
+
+    ~FlacFile() = default;
+
+private:
+    static constexpr uint64_t FRAMESPERTASK = 16;
+
+    struct Frame
+    {
+        uint64_t offset = 0; //in the frame data
+        uint64_t first = 0; //first sample of every channel
+        flac::FrameHeader header;
+    };
+
+    uint32_t streambps = 0; //bit depth of the stream, bps is that of the samples handed on
+    uint64_t totalframes = 0; //0 when STREAMINFO does not know
+    uint32_t maxblocksize = 0;
+    uint64_t loopbegin = 0, looplength = 0;
+
+    void LoadFlacStream(std::istream& stream)
+    {
+        TRACE_SCOPE("ParseFlac");
+        uint8_t tag[10];
+        if (!ReadBytes(stream, tag, 4))
+            throw std::runtime_error("File is not a FLAC file");
+
+        // some taggers put an ID3v2 tag before the stream marker
+        if (std::equal(tag, tag + 3, "ID3"))
+        {
+            if (!ReadBytes(stream, tag + 4, 6))
+                throw std::runtime_error("File is not a FLAC file");
+            uint64_t size = (tag[6] & 0x7F) << 21 | (tag[7] & 0x7F) << 14 | (tag[8] & 0x7F) << 7 | (tag[9] & 0x7F);
+            if (!SkipBytes(stream, size + ((tag[5] & 0x10) ? 10 : 0)) || !ReadBytes(stream, tag, 4))
+                throw std::runtime_error("File is not a FLAC file");
+        }
+        if (!std::equal(tag, tag + 4, "fLaC"))
+            throw std::runtime_error("File is not a FLAC file");
+
+        ReadMetadata(stream);
+
+        uint32_t bytes = (streambps + 7) / 8;
+        bps = bytes * 8;
+        if (looplength)
+        {
+            looped = true;
+            loopstart = loopbegin;
+            loopend = loopbegin + looplength;
+        }
+
+        if (headeronly && totalframes)
+        {
+            samplessize = totalframes * channels * bytes;
+            return;
+        }
+
+        std::vector<uint8_t> data = ReadToEnd(stream);
+        std::vector<Frame> frames = FindFrames(data);
+        uint64_t decoded = frames.empty() ? 0 : frames.back().first + frames.back().header.blocksize;
+        // a STREAMINFO count short of the frames cuts the last one, a longer one means the file was truncated
+        if (totalframes)
+            decoded = std::min(decoded, totalframes);
+        samplessize = decoded * channels * bytes;
+
+        if (headeronly)
+            return;
+
+        DecodeFrames(data, frames, decoded);
+    }
+
+    /* STREAMINFO and loop tags; the stream is left at the first frame. */
+    void ReadMetadata(std::istream& stream)
+    {
+        bool foundInfo = false, last = false;
+        uint8_t block[34];
+        while (!last)
+        {
+            if (!ReadBytes(stream, block, 4))
+                throw std::runtime_error("FLAC metadata is truncated");
+
+            last = block[0] & 0x80;
+            uint32_t type = block[0] & 0x7F;
+            uint64_t size = static_cast<uint64_t>(block[1]) << 16 | block[2] << 8 | block[3];
+
+            if (type == 0)
+            {
+                if (size < 34 || !ReadBytes(stream, block, 34) || !SkipBytes(stream, size - 34))
+                    throw std::runtime_error("FLAC STREAMINFO is truncated");
+
+                maxblocksize = block[2] << 8 | block[3];
+                samplerate = static_cast<uint32_t>(block[10]) << 12 | block[11] << 4 | block[12] >> 4;
+                channels = static_cast<uint16_t>(((block[12] >> 1) & 0x07) + 1);
+                streambps = ((block[12] & 1) << 4 | block[13] >> 4) + 1;
+                totalframes = static_cast<uint64_t>(block[13] & 0x0F) << 32 | static_cast<uint64_t>(block[14]) << 24
+                    | block[15] << 16 | block[16] << 8 | block[17];
+                foundInfo = true;
+            }
+            else if (type == 4 && size <= (1u << 20))
+            {
+                std::vector<uint8_t> body(size);
+                if (!ReadBytes(stream, body.data(), body.size()))
+                    throw std::runtime_error("FLAC VORBIS_COMMENT is truncated");
+                ReadComments(body);
+            }
+            else if (!SkipBytes(stream, size))
+            {
+                throw std::runtime_error("FLAC metadata is truncated");
+            }
+        }
+
+        if (!foundInfo)
+            throw std::runtime_error("FLAC file does not have a STREAMINFO block");
+        if (!samplerate || streambps < 4 || !maxblocksize)
+            throw std::runtime_error("FLAC STREAMINFO is invalid");
+    }
+
+    /* Little endian length prefixed vendor string, then the KEY=value comments; a damaged block is ignored. */
+    void ReadComments(const std::vector<uint8_t>& body)
+    {
+        auto length = [&body](size_t offset) {
+            return static_cast<uint64_t>(body[offset]) | body[offset + 1] << 8 | body[offset + 2] << 16 | static_cast<uint64_t>(body[offset + 3]) << 24;
+        };
+
+        size_t offset = 0;
+        if (body.size() < 8 || (offset = 4 + length(0)) + 4 > body.size())
+            return;
+        uint64_t count = length(offset);
+        offset += 4;
+
+        for (uint64_t i = 0; i < count && offset + 4 <= body.size(); i++)
+        {
+            uint64_t size = length(offset);
+            offset += 4;
+            if (size > body.size() - offset)
+                return;
+
+            std::string comment(body.begin() + offset, body.begin() + offset + size);
+            offset += size;
+            size_t equals = comment.find('=');
+            std::string key = comment.substr(0, equals);
+            std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return static_cast<char>(std::toupper(c)); });
+            std::string value = equals == std::string::npos ? "" : comment.substr(equals + 1);
+            if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || value.size() > 18)
+                continue;
+
+            if (key == "LOOPSTART")
+                loopbegin = std::stoull(value);
+            else if (key == "LOOPLENGTH")
+                looplength = std::stoull(value);
+        }
+    }
+
+    std::vector<uint8_t> ReadToEnd(std::istream& stream)
+    {
+        TRACE_SCOPE("ReadFlacFrames");
+        std::vector<uint8_t> data;
+        uint64_t remaining = RemainingBytes(stream);
+        if (remaining != UINT64_MAX)
+        {
+            data.resize(static_cast<size_t>(remaining));
+            stream.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size()));
+            data.resize(static_cast<size_t>(stream.gcount()));
+        }
+        else
+        {
+            while (stream)
+            {
+                size_t size = data.size();
+                data.resize(size + (1u << 20));
+                stream.read(reinterpret_cast<char*>(data.data() + size), 1u << 20);
+                data.resize(size + stream.gcount());
+            }
+        }
+        TRACE_BYTES(data.size());
+        return data;
+    }
+
+    /*
+     * Walks the frames by their sync codes. A candidate only counts as the next frame when
+     * its header CRC-8 holds and it carries the next frame or sample number, so sync
+     * patterns inside compressed data are passed over.
+     */
+    std::vector<Frame> FindFrames(const std::vector<uint8_t>& data)
+    {
+        TRACE_SCOPE("FindFlacFrames");
+        std::vector<Frame> frames;
+        const uint8_t* begin = data.data();
+        const uint8_t* end = begin + data.size();
+
+        Frame frame;
+        if (data.empty())
+            return frames;
+        if (!flac::ParseFrameHeader(begin, end, frame.header))
+            throw std::runtime_error("FLAC stream does not start with a frame");
+
+        for (;;)
+        {
+            CheckFrame(frame.header);
+            frames.push_back(frame);
+
+            uint64_t expected = frame.header.number + (frame.header.variable ? frame.header.blocksize : 1);
+            Frame next;
+            next.first = frame.first + frame.header.blocksize;
+            const uint8_t* search = begin + frame.offset + frame.header.size;
+            bool found = false;
+            while (!found && (search = static_cast<const uint8_t*>(std::memchr(search, 0xFF, end - search))) != nullptr)
+            {
+                found = flac::ParseFrameHeader(search, end, next.header) && next.header.variable == frame.header.variable
+                    && next.header.number == expected;
+                if (!found)
+                    search++;
+            }
+            if (!found)
+                return frames;
+
+            next.offset = static_cast<uint64_t>(search - begin);
+            frame = next;
+        }
+    }
+
+    void CheckFrame(const flac::FrameHeader& header)
+    {
+        if (header.Channels() != channels)
+            throw std::runtime_error("FLAC frame has " + std::to_string(header.Channels()) + " channels, the stream " + std::to_string(channels));
+        if (header.bps && header.bps != streambps)
+            throw std::runtime_error("FLAC frame bit depth differs from the stream");
+        if (header.blocksize > maxblocksize)
+            throw std::runtime_error("FLAC frame is larger than the maximum block size");
+    }
+
+    /* Decodes the frames in parallel, each into its own slice of the interleaved output. */
+    void DecodeFrames(const std::vector<uint8_t>& data, const std::vector<Frame>& frames, uint64_t decoded)
+    {
+        TRACE_SCOPE("FlacDecompression");
+        TRACE_BYTES(data.size());
+        uint8_t* decompressed = new (std::nothrow) uint8_t[samplessize];
+        if (!decompressed)
+        {
+            std::cerr << "cannot allocate decompressed FLAC samples\n";
+            throw std::bad_alloc();
+        }
+
+        try
+        {
+            ThreadPool::Shared().ParallelFor((frames.size() + FRAMESPERTASK - 1) / FRAMESPERTASK, [&](uint64_t task) {
+                COUNTER_SCOPE(LOAD);
+                std::vector<int32_t> buffer(static_cast<size_t>(maxblocksize) * channels);
+                uint64_t last = std::min<uint64_t>(frames.size(), (task + 1) * FRAMESPERTASK);
+                for (uint64_t i = task * FRAMESPERTASK; i < last; i++)
+                {
+                    const Frame& frame = frames[i];
+                    uint64_t end = i + 1 < frames.size() ? frames[i + 1].offset : data.size();
+                    DecodeFrame(data.data() + frame.offset, data.data() + end, frame.header, buffer.data());
+                    if (frame.first < decoded)
+                        Store(buffer.data(), frame.header.blocksize, std::min<uint64_t>(frame.header.blocksize, decoded - frame.first), decompressed + frame.first * channels * (bps / 8));
+                }
+            });
+        }
+        catch (...)
+        {
+            delete[] decompressed;
+            throw;
+        }
+
+        if (samples)
+            delete[] samples;
+        samples = decompressed;
+    }
+
+    /* One frame into blocksize samples per channel, one channel after the other. */
+    void DecodeFrame(const uint8_t* begin, const uint8_t* end, const flac::FrameHeader& header, int32_t* out)
+    {
+        flac::BitReader reader(begin + header.size, end);
+        uint32_t blocksize = header.blocksize;
+
+        for (uint16_t c = 0; c < channels; c++)
+        {
+            // the difference channel needs one more bit
+            bool side = (header.assignment == flac::LEFTSIDE && c == 1) || (header.assignment == flac::SIDERIGHT && c == 0)
+                || (header.assignment == flac::MIDSIDE && c == 1);
+            DecodeSubframe(reader, blocksize, streambps + (side ? 1 : 0), out + static_cast<size_t>(c) * blocksize);
+        }
+
+        reader.AlignToByte();
+        const uint8_t* footer = reader.Position();
+        uint16_t crc = static_cast<uint16_t>(reader.Read(16));
+        if (flac::Crc16(begin, footer - begin) != crc)
+            throw std::runtime_error("FLAC frame " + std::to_string(header.number) + " fails its CRC");
+
+        int32_t* left = out;
+        int32_t* right = out + blocksize;
+        switch (header.assignment)
+        {
+        case flac::LEFTSIDE:
+            for (uint32_t i = 0; i < blocksize; i++)
+                right[i] = left[i] - right[i];
+            break;
+        case flac::SIDERIGHT:
+            for (uint32_t i = 0; i < blocksize; i++)
+                left[i] += right[i];
+            break;
+        case flac::MIDSIDE:
+            for (uint32_t i = 0; i < blocksize; i++)
+            {
+                int64_t side = right[i];
+                int64_t mid = static_cast<int64_t>(static_cast<uint64_t>(left[i]) << 1) | (side & 1);
+                left[i] = static_cast<int32_t>((mid + side) >> 1);
+                right[i] = static_cast<int32_t>((mid - side) >> 1);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    void DecodeSubframe(flac::BitReader& reader, uint32_t blocksize, uint32_t bits, int32_t* out)
+    {
+        if (reader.Read(1))
+            throw std::runtime_error("FLAC subframe padding is not zero");
+        uint32_t type = reader.Read(6);
+        uint32_t wasted = reader.Read(1) ? reader.ReadUnary() + 1 : 0;
+        if (wasted >= bits)
+            throw std::runtime_error("FLAC subframe wastes all of its bits");
+        bits -= wasted;
+        if (bits > 32)
+            throw std::runtime_error("FLAC side channels of 32 bit streams are not supported");
+
+        if (type == 0)
+            std::fill(out, out + blocksize, reader.ReadSigned(bits));
+        else if (type == 1)
+        {
+            for (uint32_t i = 0; i < blocksize; i++)
+                out[i] = reader.ReadSigned(bits);
+        }
+        else if (type >= 8 && type <= 12)
+        {
+            uint32_t order = type - 8;
+            ReadWarmUp(reader, blocksize, order, bits, out);
+            ReadResidual(reader, blocksize, order, out + order);
+            PredictFixed(order, blocksize, out);
+        }
+        else if (type >= 32)
+        {
+            uint32_t order = type - 31;
+            ReadWarmUp(reader, blocksize, order, bits, out);
+            uint32_t precision = reader.Read(4) + 1;
+            int32_t shift = reader.ReadSigned(5);
+            if (precision == 16 || shift < 0)
+                throw std::runtime_error("FLAC LPC subframe is invalid");
+
+            int32_t coefficients[32];
+            for (uint32_t j = 0; j < order; j++)
+                coefficients[j] = reader.ReadSigned(precision);
+            ReadResidual(reader, blocksize, order, out + order);
+            PredictLPC(coefficients, order, shift, blocksize, out);
+        }
+        else
+        {
+            throw std::runtime_error("FLAC subframe type is reserved");
+        }
+
+        if (wasted)
+        {
+            for (uint32_t i = 0; i < blocksize; i++)
+                out[i] = static_cast<int32_t>(static_cast<uint32_t>(out[i]) << wasted);
+        }
+    }
+
+    static void ReadWarmUp(flac::BitReader& reader, uint32_t blocksize, uint32_t order, uint32_t bits, int32_t* out)
+    {
+        if (order > blocksize)
+            throw std::runtime_error("FLAC predictor order exceeds the block size");
+        for (uint32_t i = 0; i < order; i++)
+            out[i] = reader.ReadSigned(bits);
+    }
+
+    /* Partitioned Rice coded residual, with escaped partitions of raw samples. */
+    static void ReadResidual(flac::BitReader& reader, uint32_t blocksize, uint32_t order, int32_t* out)
+    {
+        uint32_t method = reader.Read(2);
+        if (method > 1)
+            throw std::runtime_error("FLAC residual coding method is reserved");
+        uint32_t parameterBits = method ? 5 : 4;
+        uint32_t escape = (1u << parameterBits) - 1;
+
+        uint32_t partitionOrder = reader.Read(4);
+        uint32_t partitionSize = blocksize >> partitionOrder;
+        if ((partitionSize << partitionOrder) != blocksize || partitionSize < order)
+            throw std::runtime_error("FLAC residual partitions do not fit the block");
+
+        for (uint32_t partition = 0; partition < (1u << partitionOrder); partition++)
+        {
+            uint32_t count = partition ? partitionSize : partitionSize - order;
+            uint32_t parameter = reader.Read(parameterBits);
+            if (parameter == escape)
+            {
+                uint32_t raw = reader.Read(5);
+                for (uint32_t i = 0; i < count; i++)
+                    *out++ = reader.ReadSigned(raw);
+                continue;
+            }
+
+            for (uint32_t i = 0; i < count; i++)
+            {
+                uint32_t value = (reader.ReadUnary() << parameter) | reader.Read(parameter);
+                *out++ = static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+            }
+        }
+    }
+
+    static void PredictFixed(uint32_t order, uint32_t blocksize, int32_t* out)
+    {
+        for (uint32_t i = order; i < blocksize; i++)
+        {
+            int64_t prediction = 0;
+            switch (order)
+            {
+            case 1:
+                prediction = out[i - 1];
+                break;
+            case 2:
+                prediction = 2ll * out[i - 1] - out[i - 2];
+                break;
+            case 3:
+                prediction = 3ll * out[i - 1] - 3ll * out[i - 2] + out[i - 3];
+                break;
+            case 4:
+                prediction = 4ll * out[i - 1] - 6ll * out[i - 2] + 4ll * out[i - 3] - out[i - 4];
+                break;
+            default:
+                break;
+            }
+            out[i] = static_cast<int32_t>(out[i] + prediction);
+        }
+    }
+
+    static void PredictLPC(const int32_t* coefficients, uint32_t order, int32_t shift, uint32_t blocksize, int32_t* out)
+    {
+        for (uint32_t i = order; i < blocksize; i++)
+        {
+            int64_t sum = 0;
+            for (uint32_t j = 0; j < order; j++)
+                sum += static_cast<int64_t>(coefficients[j]) * out[i - j - 1];
+            out[i] = static_cast<int32_t>(out[i] + (sum >> shift));
+        }
+    }
+
+    /* Interleaves count samples of each channel as little endian PCM of bps bits, scaled up to full range. */
+    void Store(const int32_t* planes, uint32_t blocksize, uint64_t count, uint8_t* out) const
+    {
+        uint32_t bytes = bps / 8;
+        uint32_t scale = bps - streambps;
+        for (uint64_t i = 0; i < count; i++)
+        {
+            for (uint16_t c = 0; c < channels; c++)
+            {
+                uint32_t value = static_cast<uint32_t>(planes[static_cast<size_t>(c) * blocksize + i]) << scale;
+                // 8 bit PCM is unsigned, as in WAV
+                if (bytes == 1)
+                    value ^= 0x80;
+                for (uint32_t b = 0; b < bytes; b++)
+                    *out++ = static_cast<uint8_t>(value >> (8 * b));
+            }
+        }
+    }
+
+    static bool ReadBytes(std::istream& stream, uint8_t* buffer, size_t count)
+    {
+        stream.read(reinterpret_cast<char*>(buffer), count);
+        return static_cast<size_t>(stream.gcount()) == count;
+    }
+};
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "encoder.hpp"
+#include "threadpool.hpp"
+#include "vag.hpp"
+#include "vagstream.hpp"
+
+/*
+ * Dry run over many inputs: reads only the format and size chunks of WAV and AIFF
+ * files, the metadata blocks of FLAC files (and the header of VAG files), and reports duration and the exact encoded
+ * sizes without touching the sample data. Sizes of looping inputs are those of the
+ * output that ends with the loop. Directories are walked recursively and every file is
+ * probed on the thread pool.
+ */
+class Inspector
+{
+public:
+    struct FileInfo
+    {
+        std::string path;
+        std::string format;
+        uint32_t samplerate = 0;
+        uint16_t channels = 0;
+        uint32_t bps = 0;
+        uint64_t frames = 0;
+        uint64_t adpcmsize = 0; //ADPCM bytes, what the sample takes in SPU RAM
+        uint64_t vagsize = 0; //size of the whole output file
+        uint64_t filesize = 0; //size of the input file
+        uint64_t memory = 0; //estimated peak memory of encoding it
+        LoopPlan loop; //sustain loop the encode ends with, not used for interleaved output
+        std::string error;
+
+        double Seconds() const { return samplerate ? static_cast<double>(frames) / samplerate : 0.0; }
+    };
+
+    Inspector() = delete;
+    Inspector(const Inspector&) = delete;
+
+    Inspector(std::vector<std::string> inputs, bool json, EncodeOptions options) :
+        inputs(inputs),
+        json(json),
+        options(options)
+    {
+    }
+
+    void Execute()
+    {
+        CollectFiles();
+
+        ThreadPool::Shared().ParallelFor(infos.size(), [this](uint64_t i) {
+            try
+            {
+                Probe(infos[i]);
+            }
+            catch (const std::exception& e)
+            {
+                infos[i].error = e.what();
+            }
+        });
+
+        if (json)
+            PrintJson();
+        else
+            PrintTable();
+    }
+
+    /* Memory an encode holds apart from its input and output buffers: windows, staging and stacks. */
+    static constexpr uint64_t ENCODEOVERHEAD = 1 << 20;
+
+    /*
+     * Fills info from the headers of info.path, sizes are those an encode with options would
+     * produce. The memory estimate is the loaded samples, the compressed data next to them
+     * while they are decoded, the ADPCM output and for interleaved output the 16 bit samples
+     * it is encoded from.
+     */
+    static void Probe(FileInfo& info, const EncodeOptions& options)
+    {
+        Encoder::FileType type = TypeOf(info.path);
+        info.filesize = std::filesystem::file_size(info.path);
+
+        if (type == Encoder::VAGTYPE)
+        {
+            ProbeVag(info);
+            return;
+        }
+
+        std::unique_ptr<File> file = Encoder::LoadInput(info.path, type, true);
+        info.format = type == Encoder::WAVTYPE ? "wav" : type == Encoder::AIFFTYPE ? "aiff" : "flac";
+        info.samplerate = file->samplerate;
+        info.channels = file->channels;
+        info.bps = file->bps;
+        info.frames = Encoder::GetFrameCount(*file);
+        info.loop = LoopPlan::Create(*file, options.loops);
+
+        if (options.interleave)
+        {
+            VagStream stream(file->samplerate, file->channels, "", options.interleave, options.sector);
+            info.adpcmsize = stream.RowCount(info.frames) * stream.RowSize();
+            info.vagsize = stream.PredictSize(info.frames);
+        }
+        else
+        {
+            info.adpcmsize = info.loop.looped ? VagFile::PredictSize(info.loop.Samples(), true) : VagFile::PredictSize(info.frames * info.channels, false);
+            info.vagsize = info.adpcmsize + sizeof(VagFileHeader) + 16;
+        }
+
+        // header only loads report the size the samples take once decoded
+        info.memory = file->samplessize + (file->samplessize > info.filesize ? info.filesize : 0) + info.adpcmsize + ENCODEOVERHEAD;
+        if (options.interleave)
+            info.memory += info.frames * info.channels * sizeof(int16_t);
+    }
+
+    static Encoder::FileType TypeOf(const std::filesystem::path& path)
+    {
+        std::string extension = path.extension().string();
+        if (extension.empty())
+            return Encoder::UNKNOWNTYPE;
+
+        extension = extension.substr(1);
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        return Encoder::GetFileType(extension);
+    }
+
+    /* Throws when two inputs would be encoded to the same output, as x.wav and x.flac both to x.vag. */
+    static void CheckOutputs(const std::vector<std::string>& paths, const std::vector<std::string>& outputs)
+    {
+        std::map<std::string, size_t> seen;
+        for (size_t i = 0; i < outputs.size(); i++)
+        {
+            auto found = seen.emplace(std::filesystem::path(outputs[i]).lexically_normal().string(), i);
+            if (!found.second)
+                throw std::runtime_error(paths[found.first->second] + " and " + paths[i] + " would both be encoded to " + outputs[i]);
+        }
+    }
+
+    /* Expands directories to the supported files below them, sorted so reports and banks are reproducible. */
+    static std::vector<std::string> CollectPaths(const std::vector<std::string>& inputs)
+    {
+        std::vector<std::string> paths;
+        for (auto& input : inputs)
+        {
+            if (!std::filesystem::is_directory(input))
+            {
+                paths.push_back(input);
+                continue;
+            }
+
+            for (auto& entry : std::filesystem::recursive_directory_iterator(input, std::filesystem::directory_options::skip_permission_denied))
+            {
+                if (entry.is_regular_file() && TypeOf(entry.path()) != Encoder::UNKNOWNTYPE)
+                    paths.push_back(entry.path().string());
+            }
+        }
+
+        std::sort(paths.begin(), paths.end());
+        return paths;
+    }
+
+private:
+    std::vector<std::string> inputs;
+    bool json;
+    EncodeOptions options;
+    std::vector<FileInfo> infos;
+
+    void Probe(FileInfo& info) const
+    {
+        Probe(info, options);
+    }
+
+    void CollectFiles()
+    {
+        for (auto& path : CollectPaths(inputs))
+        {
+            FileInfo info;
+            info.path = path;
+            infos.push_back(info);
+        }
+    }
+
+    /* VAGp holds one stream, VAGi one per channel with dataLength counting a single channel. */
+    static void ProbeVag(FileInfo& info)
+    {
+        std::ifstream stream(info.path, std::ios::binary);
+        if (!stream.is_open())
+            throw std::runtime_error("File is unable to be opened");
+
+        VagFileHeader header{};
+        if (!stream.read(reinterpret_cast<char*>(&header), sizeof(VagFileHeader)))
+            throw std::runtime_error("VAG file is too short");
+
+        std::string magic(header.magic, header.magic + 4);
+        if (magic != "VAGp" && magic != "VAGi")
+            throw std::runtime_error("File is not a VAG file");
+
+        uint64_t dataLength = BYTESWAP(header.dataLength);
+        info.format = magic == "VAGi" ? "vagi" : "vag";
+        info.samplerate = BYTESWAP(header.sampleRate);
+        info.channels = std::max<uint16_t>(1, header.channels);
+        info.bps = 4;
+
+        if (magic == "VAGi")
+        {
+            info.frames = dataLength / VAG_BLOCK_SIZE * VAG_BLOCK_SAMPLES;
+            info.adpcmsize = dataLength * info.channels;
+        }
+        else
+        {
+            info.frames = dataLength / VAG_BLOCK_SIZE * VAG_BLOCK_SAMPLES / info.channels;
+            info.adpcmsize = dataLength;
+        }
+        info.vagsize = std::filesystem::file_size(info.path);
+    }
+
+    void PrintTable() const
+    {
+        uint64_t totaladpcm = 0, totalvag = 0, failed = 0;
+        double totalseconds = 0.0;
+
+        std::cout << std::left << std::setw(40) << "path" << std::setw(6) << "type" << std::right << std::setw(8) << "rate"
+            << std::setw(4) << "ch" << std::setw(6) << "bits" << std::setw(12) << "seconds"
+            << std::setw(12) << "spu bytes" << std::setw(12) << "vag bytes" << "\n";
+        std::cout << std::fixed << std::setprecision(3);
+        for (auto& info : infos)
+        {
+            if (!info.error.empty())
+            {
+                std::cout << std::left << std::setw(40) << info.path << " error: " << info.error << "\n";
+                failed++;
+                continue;
+            }
+
+            std::cout << std::left << std::setw(40) << info.path << std::setw(6) << info.format << std::right << std::setw(8) << info.samplerate
+                << std::setw(4) << info.channels << std::setw(6) << info.bps << std::setw(12) << info.Seconds()
+                << std::setw(12) << info.adpcmsize << std::setw(12) << info.vagsize << "\n";
+            totaladpcm += info.adpcmsize;
+            totalvag += info.vagsize;
+            totalseconds += info.Seconds();
+        }
+        std::cout << infos.size() - failed << " files, " << totalseconds << " seconds, "
+            << totaladpcm << " spu bytes, " << totalvag << " vag bytes";
+        if (failed)
+            std::cout << ", " << failed << " failed";
+        std::cout << "\n" << std::defaultfloat;
+    }
+
+    static std::string JsonString(const std::string& value)
+    {
+        std::ostringstream out;
+        out << '"';
+        for (unsigned char c : value)
+        {
+            if (c == '"' || c == '\\')
+                out << '\\' << c;
+            else if (c < 0x20)
+                out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec << std::setfill(' ');
+            else
+                out << c;
+        }
+        out << '"';
+        return out.str();
+    }
+
+    void PrintJson() const
+    {
+        std::cout << std::fixed << std::setprecision(6) << "[\n";
+        for (size_t i = 0; i < infos.size(); i++)
+        {
+            auto& info = infos[i];
+            std::cout << "  { \"path\": " << JsonString(info.path);
+            if (!info.error.empty())
+            {
+                std::cout << ", \"error\": " << JsonString(info.error);
+            }
+            else
+            {
+                std::cout << ", \"format\": \"" << info.format << "\", \"samplerate\": " << info.samplerate
+                    << ", \"channels\": " << info.channels << ", \"bits\": " << info.bps << ", \"frames\": " << info.frames
+                    << ", \"seconds\": " << info.Seconds() << ", \"spu_bytes\": " << info.adpcmsize << ", \"vag_bytes\": " << info.vagsize;
+                if (info.loop.looped && !options.interleave)
+                    std::cout << ", \"loop_start\": " << info.loop.loopStart << ", \"loop_end\": " << info.loop.loopEnd
+                        << ", \"loop_rate\": " << info.loop.samplerate;
+            }
+            std::cout << " }" << (i + 1 < infos.size() ? "," : "") << "\n";
+        }
+        std::cout << "]\n" << std::defaultfloat;
+    }
+};
@@ -0,0 +1,642 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define ADPCM_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ADPCM_TARGET(isa)
+#else
+#define ADPCM_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+/*
+ * Hot loops of conversion and encoding with one implementation per instruction set,
+ * picked at runtime from cpuid so one binary runs at full speed on every host. Every
+ * variant does the same float operations in the same order as the scalar reference,
+ * lane by lane, so all of them produce identical bytes; that needs the compiler to keep
+ * multiplies and adds apart (-ffp-contract=off), FMA would round differently.
+ *
+ *   unpackInt16    little endian 16 bit PCM to floats
+ *   unpackFloat32  32 bit float PCM to floats on the 16 bit scale
+ *   fir4           the 4 tap noise FIR over one channel of interleaved floats
+ *   packInt16      floats to 16 bit with saturation and truncation toward zero
+ *   analyze        residuals and peak of all predictors for one 28 sample block
+ *   quiet          whether no sample reaches above a threshold, a NaN counts as loud
+ */
+struct KernelTable
+{
+    const char* name;
+    void (*unpackInt16)(const uint8_t* in, uint64_t count, float* out);
+    void (*unpackFloat32)(const uint8_t* in, uint64_t count, float* out);
+    void (*fir4)(const float* in, uint64_t count, uint64_t stride, const float* coefficients, float* out);
+    void (*packInt16)(const float* in, uint64_t count, int16_t* out);
+    void (*analyze)(const float* block, float hist_1, float hist_2, const float (*coefficients)[2], int predictors, float* residual, float* maxima);
+    bool (*quiet)(const float* in, uint64_t count, float threshold);
+};
+
+/* Truncates a 16 bit scaled sample toward zero, saturating at the int16 range. */
+constexpr int16_t ToInt16(float val)
+{
+    val = std::min(std::max(val, static_cast<float>(std::numeric_limits<int16_t>::min())),
+        static_cast<float>(std::numeric_limits<int16_t>::max()));
+    return static_cast<int16_t>(val);
+}
+
+namespace kernels
+{
+    constexpr int ANALYZE_SAMPLES = 28;
+    constexpr float FLOAT_SCALE = static_cast<float>(std::numeric_limits<int16_t>::max());
+
+    inline void UnpackInt16Scalar(const uint8_t* in, uint64_t count, float* out)
+    {
+        for (uint64_t i = 0; i < count; i++)
+            out[i] = static_cast<float>(static_cast<int16_t>(in[i * 2] | (in[i * 2 + 1] << 8)));
+    }
+
+    inline void UnpackFloat32Scalar(const uint8_t* in, uint64_t count, float* out)
+    {
+        for (uint64_t i = 0; i < count; i++)
+        {
+            float value;
+            std::memcpy(&value, in + i * 4, sizeof(value));
+            out[i] = FLOAT_SCALE * value;
+        }
+    }
+
+    /* std::fabs for constant expressions; the scalar FIR, pack and analyze kernels are constexpr for vagembed.hpp. */
+    constexpr float Abs(float value)
+    {
+        return value < 0.0f ? -value : value;
+    }
+
+    constexpr void Fir4Scalar(const float* in, uint64_t count, uint64_t stride, const float* coefficients, float* out)
+    {
+        for (uint64_t i = 0; i < count; i++)
+        {
+            float sample = 0.0f;
+            for (int j = 3; j >= 0; j--)
+                sample += coefficients[j] * *(in + i - j * stride);
+            out[i] = sample;
+        }
+    }
+
+    constexpr void PackInt16Scalar(const float* in, uint64_t count, int16_t* out)
+    {
+        for (uint64_t i = 0; i < count; i++)
+            out[i] = ToInt16(in[i]);
+    }
+
+    /* Predictor 0 has no history terms, its residual is the block itself. */
+    constexpr void AnalyzeScalar(const float* block, float hist_1, float hist_2, const float (*coefficients)[2], int predictors, float* residual, float* maxima)
+    {
+        for (int p = 0; p < predictors; p++)
+        {
+            float s_1 = hist_1, s_2 = hist_2;
+            float max = 0.0;
+            for (int k = 0; k < ANALYZE_SAMPLES; k++)
+            {
+                float sample = block[k];
+                float ds = p == 0 ? sample : sample + s_1 * coefficients[p][0] + s_2 * coefficients[p][1];
+                residual[p * ANALYZE_SAMPLES + k] = ds;
+                max = std::max(max, Abs(ds));
+                s_2 = s_1;
+                s_1 = sample;
+            }
+            maxima[p] = max;
+        }
+    }
+
+    inline bool QuietScalar(const float* in, uint64_t count, float threshold)
+    {
+        for (uint64_t i = 0; i < count; i++)
+        {
+            if (!(std::fabs(in[i]) <= threshold))
+                return false;
+        }
+        return true;
+    }
+
+    inline const KernelTable scalar = { "scalar", UnpackInt16Scalar, UnpackFloat32Scalar, Fir4Scalar, PackInt16Scalar, AnalyzeScalar, QuietScalar };
+
+#ifdef ADPCM_X86
+    /* SSE4.1, 4 lanes. */
+
+    ADPCM_TARGET("sse4.1") inline void UnpackInt16SSE41(const uint8_t* in, uint64_t count, float* out)
+    {
+        uint64_t i = 0;
+        for (; i + 4 <= count; i += 4)
+            _mm_storeu_ps(out + i, _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i * 2)))));
+        UnpackInt16Scalar(in + i * 2, count - i, out + i);
+    }
+
+    ADPCM_TARGET("sse4.1") inline void UnpackFloat32SSE41(const uint8_t* in, uint64_t count, float* out)
+    {
+        const __m128 scale = _mm_set1_ps(FLOAT_SCALE);
+        uint64_t i = 0;
+        for (; i + 4 <= count; i += 4)
+            _mm_storeu_ps(out + i, _mm_mul_ps(scale, _mm_loadu_ps(reinterpret_cast<const float*>(in + i * 4))));
+        UnpackFloat32Scalar(in + i * 4, count - i, out + i);
+    }
+
+    ADPCM_TARGET("sse4.1") inline void Fir4SSE41(const float* in, uint64_t count, uint64_t stride, const float* coefficients, float* out)
+    {
+        const __m128 c0 = _mm_set1_ps(coefficients[0]), c1 = _mm_set1_ps(coefficients[1]);
+        const __m128 c2 = _mm_set1_ps(coefficients[2]), c3 = _mm_set1_ps(coefficients[3]);
+        uint64_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            const float* tap = in + i;
+            __m128 sample = _mm_add_ps(_mm_setzero_ps(), _mm_mul_ps(c3, _mm_loadu_ps(tap - 3 * stride)));
+            sample = _mm_add_ps(sample, _mm_mul_ps(c2, _mm_loadu_ps(tap - 2 * stride)));
+            sample = _mm_add_ps(sample, _mm_mul_ps(c1, _mm_loadu_ps(tap - stride)));
+            sample = _mm_add_ps(sample, _mm_mul_ps(c0, _mm_loadu_ps(tap)));
+            _mm_storeu_ps(out + i, sample);
+        }
+        Fir4Scalar(in + i, count - i, stride, coefficients, out + i);
+    }
+
+    /* max(bound, x) and min(bound, x) keep a NaN like std::max/min do, the truncation then matches the scalar cast. */
+    ADPCM_TARGET("sse4.1") inline __m128i TruncateInt16SSE41(__m128 value)
+    {
+        value = _mm_min_ps(_mm_set1_ps(32767.0f), _mm_max_ps(_mm_set1_ps(-32768.0f), value));
+        return _mm_and_si128(_mm_cvttps_epi32(value), _mm_set1_epi32(0xFFFF));
+    }
+
+    ADPCM_TARGET("sse4.1") inline void PackInt16SSE41(const float* in, uint64_t count, int16_t* out)
+    {
+        uint64_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128i low = TruncateInt16SSE41(_mm_loadu_ps(in + i));
+            __m128i high = TruncateInt16SSE41(_mm_loadu_ps(in + i + 4));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi32(low, high));
+        }
+        PackInt16Scalar(in + i, count - i, out + i);
+    }
+
+    ADPCM_TARGET("sse4.1") inline void AnalyzeSSE41(const float* block, float hist_1, float hist_2, const float (*coefficients)[2], int predictors, float* residual, float* maxima)
+    {
+        float history[ANALYZE_SAMPLES + 2];
+        history[0] = hist_2;
+        history[1] = hist_1;
+        std::copy(block, block + ANALYZE_SAMPLES, history + 2);
+        const __m128 sign = _mm_set1_ps(-0.0f);
+
+        for (int p = 0; p < predictors; p++)
+        {
+            const __m128 c0 = _mm_set1_ps(coefficients[p][0]), c1 = _mm_set1_ps(coefficients[p][1]);
+            __m128 max = _mm_setzero_ps();
+            for (int k = 0; k < ANALYZE_SAMPLES; k += 4)
+            {
+                __m128 ds = _mm_loadu_ps(history + k + 2);
+                if (p != 0)
+                {
+                    ds = _mm_add_ps(ds, _mm_mul_ps(_mm_loadu_ps(history + k + 1), c0));
+                    ds = _mm_add_ps(ds, _mm_mul_ps(_mm_loadu_ps(history + k), c1));
+                }
+                _mm_storeu_ps(residual + p * ANALYZE_SAMPLES + k, ds);
+                max = _mm_max_ps(_mm_andnot_ps(sign, ds), max);
+            }
+            max = _mm_max_ps(max, _mm_movehl_ps(max, max));
+            max = _mm_max_ss(max, _mm_shuffle_ps(max, max, 1));
+            maxima[p] = _mm_cvtss_f32(max);
+        }
+    }
+
+    /* The not-less-or-equal compare is true for NaN, so the lanes only ever collect loud samples. */
+    ADPCM_TARGET("sse4.1") inline bool QuietSSE41(const float* in, uint64_t count, float threshold)
+    {
+        const __m128 sign = _mm_set1_ps(-0.0f), limit = _mm_set1_ps(threshold);
+        __m128 loud = _mm_setzero_ps();
+        uint64_t i = 0;
+        for (; i + 4 <= count; i += 4)
+            loud = _mm_or_ps(loud, _mm_cmpnle_ps(_mm_andnot_ps(sign, _mm_loadu_ps(in + i)), limit));
+        return !_mm_movemask_ps(loud) && QuietScalar(in + i, count - i, threshold);
+    }
+
+    inline const KernelTable sse41 = { "sse4.1", UnpackInt16SSE41, UnpackFloat32SSE41, Fir4SSE41, PackInt16SSE41, AnalyzeSSE41, QuietSSE41 };
+
+    /* AVX2, 8 lanes. */
+
+    ADPCM_TARGET("avx2") inline void UnpackInt16AVX2(const uint8_t* in, uint64_t count, float* out)
+    {
+        uint64_t i = 0;
+        for (; i + 8 <= count; i += 8)
+            _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * 2)))));
+        UnpackInt16Scalar(in + i * 2, count - i, out + i);
+    }
+
+    ADPCM_TARGET("avx2") inline void UnpackFloat32AVX2(const uint8_t* in, uint64_t count, float* out)
+    {
+        const __m256 scale = _mm256_set1_ps(FLOAT_SCALE);
+        uint64_t i = 0;
+        for (; i + 8 <= count; i += 8)
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(scale, _mm256_loadu_ps(reinterpret_cast<const float*>(in + i * 4))));
+        UnpackFloat32Scalar(in + i * 4, count - i, out + i);
+    }
+
+    ADPCM_TARGET("avx2") inline void Fir4AVX2(const float* in, uint64_t count, uint64_t stride, const float* coefficients, float* out)
+    {
+        const __m256 c0 = _mm256_set1_ps(coefficients[0]), c1 = _mm256_set1_ps(coefficients[1]);
+        const __m256 c2 = _mm256_set1_ps(coefficients[2]), c3 = _mm256_set1_ps(coefficients[3]);
+        uint64_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            const float* tap = in + i;
+            __m256 sample = _mm256_add_ps(_mm256_setzero_ps(), _mm256_mul_ps(c3, _mm256_loadu_ps(tap - 3 * stride)));
+            sample = _mm256_add_ps(sample, _mm256_mul_ps(c2, _mm256_loadu_ps(tap - 2 * stride)));
+            sample = _mm256_add_ps(sample, _mm256_mul_ps(c1, _mm256_loadu_ps(tap - stride)));
+            sample = _mm256_add_ps(sample, _mm256_mul_ps(c0, _mm256_loadu_ps(tap)));
+            _mm256_storeu_ps(out + i, sample);
+        }
+        Fir4Scalar(in + i, count - i, stride, coefficients, out + i);
+    }
+
+    ADPCM_TARGET("avx2") inline __m256i TruncateInt16AVX2(__m256 value)
+    {
+        value = _mm256_min_ps(_mm256_set1_ps(32767.0f), _mm256_max_ps(_mm256_set1_ps(-32768.0f), value));
+        return _mm256_and_si256(_mm256_cvttps_epi32(value), _mm256_set1_epi32(0xFFFF));
+    }
+
+    ADPCM_TARGET("avx2") inline void PackInt16AVX2(const float* in, uint64_t count, int16_t* out)
+    {
+        uint64_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            // packus works within 128 bit lanes, the permute puts the halves back in order
+            __m256i packed = _mm256_packus_epi32(TruncateInt16AVX2(_mm256_loadu_ps(in + i)), TruncateInt16AVX2(_mm256_loadu_ps(in + i + 8)));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_permute4x64_epi64(packed, 0xD8));
+        }
+        PackInt16Scalar(in + i, count - i, out + i);
+    }
+
+    ADPCM_TARGET("avx2") inline void AnalyzeAVX2(const float* block, float hist_1, float hist_2, const float (*coefficients)[2], int predictors, float* residual, float* maxima)
+    {
+        float history[ANALYZE_SAMPLES + 2];
+        history[0] = hist_2;
+        history[1] = hist_1;
+        std::copy(block, block + ANALYZE_SAMPLES, history + 2);
+        const __m256 sign = _mm256_set1_ps(-0.0f);
+
+        for (int p = 0; p < predictors; p++)
+        {
+            const __m256 c0 = _mm256_set1_ps(coefficients[p][0]), c1 = _mm256_set1_ps(coefficients[p][1]);
+            __m256 max = _mm256_setzero_ps();
+            // 28 samples: three full vectors and a last one overlapping the third by four lanes
+            for (int k : { 0, 8, 16, ANALYZE_SAMPLES - 8 })
+            {
+                __m256 ds = _mm256_loadu_ps(history + k + 2);
+                if (p != 0)
+                {
+                    ds = _mm256_add_ps(ds, _mm256_mul_ps(_mm256_loadu_ps(history + k + 1), c0));
+                    ds = _mm256_add_ps(ds, _mm256_mul_ps(_mm256_loadu_ps(history + k), c1));
+                }
+                _mm256_storeu_ps(residual + p * ANALYZE_SAMPLES + k, ds);
+                max = _mm256_max_ps(_mm256_andnot_ps(sign, ds), max);
+            }
+            __m128 half = _mm_max_ps(_mm256_castps256_ps128(max), _mm256_extractf128_ps(max, 1));
+            half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+            half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+            maxima[p] = _mm_cvtss_f32(half);
+        }
+    }
+
+    ADPCM_TARGET("avx2") inline bool QuietAVX2(const float* in, uint64_t count, float threshold)
+    {
+        const __m256 sign = _mm256_set1_ps(-0.0f), limit = _mm256_set1_ps(threshold);
+        __m256 loud = _mm256_setzero_ps();
+        uint64_t i = 0;
+        for (; i + 8 <= count; i += 8)
+            loud = _mm256_or_ps(loud, _mm256_cmp_ps(_mm256_andnot_ps(sign, _mm256_loadu_ps(in + i)), limit, _CMP_NLE_UQ));
+        return !_mm256_movemask_ps(loud) && QuietScalar(in + i, count - i, threshold);
+    }
+
+    inline const KernelTable avx2 = { "avx2", UnpackInt16AVX2, UnpackFloat32AVX2, Fir4AVX2, PackInt16AVX2, AnalyzeAVX2, QuietAVX2 };
+
+    /* AVX-512F, 16 lanes. GCC 12 warns about the _mm512_undefined_* inside its own intrinsics. */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+    ADPCM_TARGET("avx512f") inline void UnpackInt16AVX512(const uint8_t* in, uint64_t count, float* out)
+    {
+        uint64_t i = 0;
+        for (; i + 16 <= count; i += 16)
+            _mm512_storeu_ps(out + i, _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i * 2)))));
+        UnpackInt16Scalar(in + i * 2, count - i, out + i);
+    }
+
+    ADPCM_TARGET("avx512f") inline void UnpackFloat32AVX512(const uint8_t* in, uint64_t count, float* out)
+    {
+        const __m512 scale = _mm512_set1_ps(FLOAT_SCALE);
+        uint64_t i = 0;
+        for (; i + 16 <= count; i += 16)
+            _mm512_storeu_ps(out + i, _mm512_mul_ps(scale, _mm512_loadu_ps(in + i * 4)));
+        UnpackFloat32Scalar(in + i * 4, count - i, out + i);
+    }
+
+    ADPCM_TARGET("avx512f") inline void Fir4AVX512(const float* in, uint64_t count, uint64_t stride, const float* coefficients, float* out)
+    {
+        const __m512 c0 = _mm512_set1_ps(coefficients[0]), c1 = _mm512_set1_ps(coefficients[1]);
+        const __m512 c2 = _mm512_set1_ps(coefficients[2]), c3 = _mm512_set1_ps(coefficients[3]);
+        uint64_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            const float* tap = in + i;
+            __m512 sample = _mm512_add_ps(_mm512_setzero_ps(), _mm512_mul_ps(c3, _mm512_loadu_ps(tap - 3 * stride)));
+            sample = _mm512_add_ps(sample, _mm512_mul_ps(c2, _mm512_loadu_ps(tap - 2 * stride)));
+            sample = _mm512_add_ps(sample, _mm512_mul_ps(c1, _mm512_loadu_ps(tap - stride)));
+            sample = _mm512_add_ps(sample, _mm512_mul_ps(c0, _mm512_loadu_ps(tap)));
+            _mm512_storeu_ps(out + i, sample);
+        }
+        Fir4Scalar(in + i, count - i, stride, coefficients, out + i);
+    }
+
+    ADPCM_TARGET("avx512f") inline void PackInt16AVX512(const float* in, uint64_t count, int16_t* out)
+    {
+        const __m512 low = _mm512_set1_ps(-32768.0f), high = _mm512_set1_ps(32767.0f);
+        uint64_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            __m512 value = _mm512_min_ps(high, _mm512_max_ps(low, _mm512_loadu_ps(in + i)));
+            // vpmovdw truncates to the low 16 bits like the scalar cast
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm512_cvtepi32_epi16(_mm512_cvttps_epi32(value)));
+        }
+        PackInt16Scalar(in + i, count - i, out + i);
+    }
+
+    ADPCM_TARGET("avx512f") inline void AnalyzeAVX512(const float* block, float hist_1, float hist_2, const float (*coefficients)[2], int predictors, float* residual, float* maxima)
+    {
+        float history[ANALYZE_SAMPLES + 2];
+        history[0] = hist_2;
+        history[1] = hist_1;
+        std::copy(block, block + ANALYZE_SAMPLES, history + 2);
+        const __m512i sign = _mm512_set1_epi32(0x7FFFFFFF);
+        constexpr __mmask16 tail = (1u << (ANALYZE_SAMPLES - 16)) - 1;
+
+        for (int p = 0; p < predictors; p++)
+        {
+            const __m512 c0 = _mm512_set1_ps(coefficients[p][0]), c1 = _mm512_set1_ps(coefficients[p][1]);
+            __m512 max = _mm512_setzero_ps();
+            for (int k = 0; k < ANALYZE_SAMPLES; k += 16)
+            {
+                __mmask16 lanes = k + 16 <= ANALYZE_SAMPLES ? 0xFFFF : tail;
+                __m512 ds = _mm512_maskz_loadu_ps(lanes, history + k + 2);
+                if (p != 0)
+                {
+                    ds = _mm512_add_ps(ds, _mm512_mul_ps(_mm512_maskz_loadu_ps(lanes, history + k + 1), c0));
+                    ds = _mm512_add_ps(ds, _mm512_mul_ps(_mm512_maskz_loadu_ps(lanes, history + k), c1));
+                }
+                _mm512_mask_storeu_ps(residual + p * ANALYZE_SAMPLES + k, lanes, ds);
+                __m512 magnitude = _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(ds), sign));
+                max = _mm512_max_ps(magnitude, max);
+            }
+            maxima[p] = _mm512_reduce_max_ps(max);
+        }
+    }
+
+    ADPCM_TARGET("avx512f") inline bool QuietAVX512(const float* in, uint64_t count, float threshold)
+    {
+        const __m512 limit = _mm512_set1_ps(threshold);
+        __mmask16 loud = 0;
+        uint64_t i = 0;
+        for (; i + 16 <= count; i += 16)
+            loud |= _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_loadu_ps(in + i)), limit, _CMP_NLE_UQ);
+        return !loud && QuietScalar(in + i, count - i, threshold);
+    }
+
+    inline const KernelTable avx512 = { "avx512", UnpackInt16AVX512, UnpackFloat32AVX512, Fir4AVX512, PackInt16AVX512, AnalyzeAVX512, QuietAVX512 };
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+}
+
+/*
+ * Selection of the kernel table. The preferred one the CPU supports is used unless
+ * --kernel= names another, and --cross-check wraps the selection so every call is
+ * repeated with the scalar reference and any difference in the output bytes throws.
+ * Selection happens once at startup, before any work is handed to the pool.
+ */
+class Kernels
+{
+public:
+    static const KernelTable& Active() { return *ActiveSlot(); }
+
+    /* All tables this build has and the CPU can run, scalar first and the best last. */
+    static std::vector<const KernelTable*> Supported()
+    {
+        std::vector<const KernelTable*> tables = { &kernels::scalar };
+#ifdef ADPCM_X86
+        CpuFeatures features = DetectCpu();
+        if (features.sse41)
+            tables.push_back(&kernels::sse41);
+        if (features.avx2)
+            tables.push_back(&kernels::avx2);
+        if (features.avx512)
+            tables.push_back(&kernels::avx512);
+#endif
+        return tables;
+    }
+
+    /*
+     * The table auto picks: the widest supported one short of AVX-512, which is opt-in since
+     * the 28 sample blocks only fill a 16 lane vector with a masked tail and the lower AVX-512
+     * clock made it slower than AVX2 in the benchmark.
+     */
+    static const KernelTable* Preferred()
+    {
+        std::vector<const KernelTable*> tables = Supported();
+        auto preferred = std::find_if(tables.rbegin(), tables.rend(), [](const KernelTable* table) { return std::string(table->name) != "avx512"; });
+        return *preferred;
+    }
+
+    /* Selects a table by name, auto for the preferred one. */
+    static void Select(const std::string& name)
+    {
+        std::vector<const KernelTable*> tables = Supported();
+        if (name == "auto")
+        {
+            SelectedSlot() = Preferred();
+        }
+        else
+        {
+            auto found = std::find_if(tables.begin(), tables.end(), [&name](const KernelTable* table) { return name == table->name; });
+            if (found == tables.end())
+                throw std::runtime_error("Kernel " + name + " is unknown or not supported by this CPU");
+            SelectedSlot() = *found;
+        }
+        ActiveSlot() = ActiveSlot() == &checked ? &checked : SelectedSlot();
+    }
+
+    static void EnableCrossCheck() { ActiveSlot() = &checked; }
+
+    /* Name of the selected table. */
+    static std::string SelectedName() { return SelectedSlot()->name; }
+
+    /* Name of the selected table, with the cross-check noted. */
+    static std::string Describe()
+    {
+        std::string name = SelectedSlot()->name;
+        return ActiveSlot() == &checked ? name + " (cross-checked against scalar)" : name;
+    }
+
+private:
+    struct CpuFeatures
+    {
+        bool sse41 = false;
+        bool avx2 = false;
+        bool avx512 = false;
+    };
+
+    static const KernelTable* &SelectedSlot()
+    {
+        static const KernelTable* selected = Preferred();
+        return selected;
+    }
+
+    static const KernelTable* &ActiveSlot()
+    {
+        static const KernelTable* active = SelectedSlot();
+        return active;
+    }
+
+#ifdef ADPCM_X86
+    /* cpuid leaves 1 and 7, with xgetbv confirming the OS saves the AVX and AVX-512 registers. */
+    static CpuFeatures DetectCpu()
+    {
+        CpuFeatures features;
+        unsigned leaf1[4] = {}, leaf7[4] = {};
+        Cpuid(0, leaf1);
+        unsigned maxLeaf = leaf1[0];
+        Cpuid(1, leaf1);
+        if (maxLeaf >= 7)
+            Cpuid(7, leaf7);
+
+        features.sse41 = leaf1[2] & (1u << 19);
+        bool osxsave = leaf1[2] & (1u << 27);
+        uint64_t xcr0 = osxsave ? ReadXcr0() : 0;
+        bool avxState = (xcr0 & 0x06) == 0x06;
+        bool avx512State = (xcr0 & 0xE6) == 0xE6;
+
+        features.avx2 = avxState && (leaf1[2] & (1u << 28)) && (leaf7[1] & (1u << 5));
+        features.avx512 = features.avx2 && avx512State && (leaf7[1] & (1u << 16));
+        return features;
+    }
+
+    static void Cpuid(unsigned leaf, unsigned* registers)
+    {
+#ifdef _MSC_VER
+        int values[4];
+        __cpuidex(values, static_cast<int>(leaf), 0);
+        for (int i = 0; i < 4; i++)
+            registers[i] = static_cast<unsigned>(values[i]);
+#else
+        __asm__ __volatile__("cpuid" : "=a"(registers[0]), "=b"(registers[1]), "=c"(registers[2]), "=d"(registers[3]) : "a"(leaf), "c"(0));
+#endif
+    }
+
+    static uint64_t ReadXcr0()
+    {
+#ifdef _MSC_VER
+        return _xgetbv(0);
+#else
+        uint32_t eax, edx;
+        __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+    }
+#endif
+
+    /*
+     * Byte comparison, except that any two NaNs match: which operand's NaN an add passes
+     * on depends on the operand order the compiler picked, and every NaN quantizes and
+     * packs to the same output anyway.
+     */
+    template <typename T>
+    static void Compare(const T* selected, const T* reference, uint64_t count, const char* kernel)
+    {
+        for (uint64_t i = 0; i < count; i++)
+        {
+            if (std::memcmp(selected + i, reference + i, sizeof(T)) == 0)
+                continue;
+            if constexpr (std::is_floating_point_v<T>)
+            {
+                if (std::isnan(selected[i]) && std::isnan(reference[i]))
+                    continue;
+            }
+            throw std::runtime_error(std::string("Cross-check failed: ") + SelectedSlot()->name + " " + kernel
+                + " differs from scalar at element " + std::to_string(i));
+        }
+    }
+
+    static void CheckedUnpackInt16(const uint8_t* in, uint64_t count, float* out)
+    {
+        thread_local std::vector<float> reference;
+        reference.resize(count);
+        SelectedSlot()->unpackInt16(in, count, out);
+        kernels::scalar.unpackInt16(in, count, reference.data());
+        Compare(out, reference.data(), count, "unpackInt16");
+    }
+
+    static void CheckedUnpackFloat32(const uint8_t* in, uint64_t count, float* out)
+    {
+        thread_local std::vector<float> reference;
+        reference.resize(count);
+        SelectedSlot()->unpackFloat32(in, count, out);
+        kernels::scalar.unpackFloat32(in, count, reference.data());
+        Compare(out, reference.data(), count, "unpackFloat32");
+    }
+
+    static void CheckedFir4(const float* in, uint64_t count, uint64_t stride, const float* coefficients, float* out)
+    {
+        thread_local std::vector<float> reference;
+        reference.resize(count);
+        SelectedSlot()->fir4(in, count, stride, coefficients, out);
+        kernels::scalar.fir4(in, count, stride, coefficients, reference.data());
+        Compare(out, reference.data(), count, "fir4");
+    }
+
+    static void CheckedPackInt16(const float* in, uint64_t count, int16_t* out)
+    {
+        thread_local std::vector<int16_t> reference;
+        reference.resize(count);
+        SelectedSlot()->packInt16(in, count, out);
+        kernels::scalar.packInt16(in, count, reference.data());
+        Compare(out, reference.data(), count, "packInt16");
+    }
+
+    static void CheckedAnalyze(const float* block, float hist_1, float hist_2, const float (*coefficients)[2], int predictors, float* residual, float* maxima)
+    {
+        thread_local std::vector<float> referenceResidual, referenceMaxima;
+        referenceResidual.resize(static_cast<size_t>(predictors) * kernels::ANALYZE_SAMPLES);
+        referenceMaxima.resize(predictors);
+        SelectedSlot()->analyze(block, hist_1, hist_2, coefficients, predictors, residual, maxima);
+        kernels::scalar.analyze(block, hist_1, hist_2, coefficients, predictors, referenceResidual.data(), referenceMaxima.data());
+        Compare(residual, referenceResidual.data(), referenceResidual.size(), "analyze");
+        Compare(maxima, referenceMaxima.data(), referenceMaxima.size(), "analyze");
+    }
+
+    static bool CheckedQuiet(const float* in, uint64_t count, float threshold)
+    {
+        bool quiet = SelectedSlot()->quiet(in, count, threshold);
+        bool reference = kernels::scalar.quiet(in, count, threshold);
+        Compare(&quiet, &reference, 1, "quiet");
+        return quiet;
+    }
+
+    static inline const KernelTable checked = { "checked", CheckedUnpackInt16, CheckedUnpackFloat32, CheckedFir4, CheckedPackInt16, CheckedAnalyze, CheckedQuiet };
+};
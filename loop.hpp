@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include "file.hpp"
+#include "vag.hpp"
+
+/*
+ * Sustain loop of an input fitted to the block grid of the SPU. A VAG loop runs from the
+ * first sample of its start block to the last sample of its end block, so both loop points
+ * have to fall on 28 sample boundaries and everything after the loop end is never played.
+ *
+ * The input is treated as playing its loop forever. The loop start moves forward to the
+ * next block boundary, which only rotates the loop body, and the loop length is resampled
+ * to the nearest whole number of blocks, with the sample rate scaled to match so the pitch
+ * stays put. Loops shorter than two blocks are repeated until they are at least that long
+ * first, so a single cycle waveform is not stretched out of shape. The output ends with
+ * the loop; its end block jumps back to the start block.
+ *
+ * All positions are frames; multi-channel streams are interleaved, so the block grid is
+ * VAG_BLOCK_SAMPLES / gcd(channels, VAG_BLOCK_SAMPLES) frames.
+ */
+struct LoopPlan
+{
+    bool looped = false;
+    uint16_t channels = 1;
+    uint32_t samplerate = 0; //rate of the output, differs from the input when the loop was resampled
+    uint64_t frames = 0; //output frames, the whole stream when not looped
+    uint64_t startFrame = 0; //first output frame of the loop
+    uint64_t loopStart = 0; //input loop, the end is exclusive
+    uint64_t loopEnd = 0;
+    uint64_t virtualLength = 0; //input frames of the loop after repeating it, maps onto length output frames
+    uint64_t length = 0;
+
+    /*
+     * Plans the loop of file, or an identity plan when it has none or useLoops is off.
+     * The first skip frames of the input are left out, they must come before the loop.
+     */
+    static LoopPlan Create(const File& file, bool useLoops, uint64_t skip = 0)
+    {
+        uint64_t bytesperframe = static_cast<uint64_t>(file.bps / 8) * file.channels;
+        uint64_t frames = bytesperframe ? file.samplessize / bytesperframe : 0;
+        return Create(file.channels, file.samplerate, frames, useLoops && file.looped, file.loopstart, file.loopend, skip);
+    }
+
+    /* Create for a stream of frames frames that loops over [loopStart, loopEnd) when looped is set. */
+    static LoopPlan Create(uint16_t channels, uint32_t samplerate, uint64_t frames, bool looped, uint64_t loopStart, uint64_t loopEnd, uint64_t skip = 0)
+    {
+        LoopPlan plan;
+        plan.channels = std::max<uint16_t>(1, channels);
+        plan.samplerate = samplerate;
+        plan.frames = frames;
+
+        uint64_t inputEnd = std::min(loopEnd, plan.frames);
+        looped = looped && loopStart < inputEnd;
+        if (skip > (looped ? loopStart : plan.frames))
+            throw std::runtime_error("Cannot skip past the loop start");
+
+        plan.frames -= skip;
+        if (!looped)
+            return plan;
+
+        uint64_t unit = VAG_BLOCK_SAMPLES / std::gcd<uint64_t>(plan.channels, VAG_BLOCK_SAMPLES);
+        uint64_t minimum = RoundUp((2 * VAG_BLOCK_SAMPLES + plan.channels - 1) / plan.channels, unit);
+        uint64_t period = inputEnd - loopStart;
+
+        plan.looped = true;
+        plan.loopStart = loopStart - skip;
+        plan.loopEnd = inputEnd - skip;
+        plan.virtualLength = period * std::max<uint64_t>(1, (minimum + period - 1) / period);
+        plan.length = std::max(minimum, (plan.virtualLength + unit / 2) / unit * unit);
+        plan.startFrame = RoundUp((plan.loopStart * plan.length + plan.virtualLength - 1) / plan.virtualLength, unit);
+        plan.frames = plan.startFrame + plan.length;
+
+        if (plan.virtualLength > UINT64_MAX / plan.frames)
+            throw std::runtime_error("Loop is too long to be fitted to VAG blocks");
+
+        uint64_t rate = (2 * static_cast<uint64_t>(samplerate) * plan.length + plan.virtualLength) / (2 * plan.virtualLength);
+        if (rate > UINT32_MAX)
+            throw std::runtime_error("Loop is too short to be fitted to VAG blocks");
+        plan.samplerate = static_cast<uint32_t>(rate);
+        return plan;
+    }
+
+    uint64_t Samples() const { return frames * channels; }
+
+    /* Block indices for VagFile::BlockFlags. */
+    uint32_t StartBlock() const { return static_cast<uint32_t>(startFrame * channels / VAG_BLOCK_SAMPLES); }
+
+    uint32_t EndBlock() const { return static_cast<uint32_t>(Samples() / VAG_BLOCK_SAMPLES - 1); }
+
+    bool Resampled() const { return virtualLength != length; }
+
+    /* Input frame a position of the endlessly looping input plays. */
+    uint64_t InputFrame(uint64_t position) const
+    {
+        if (!looped || position < loopEnd)
+            return position;
+        return loopStart + (position - loopStart) % (loopEnd - loopStart);
+    }
+
+    /* End of the input samples that have to be loaded to produce the output samples up to end. */
+    uint64_t SourceEnd(uint64_t end) const
+    {
+        if (!looped || !end)
+            return end;
+        uint64_t lastFrame = (end - 1) / channels;
+        uint64_t position = lastFrame * virtualLength / length + 1;
+        return std::min(position + 1, loopEnd) * channels;
+    }
+
+private:
+    static uint64_t RoundUp(uint64_t value, uint64_t unit) { return (value + unit - 1) / unit * unit; }
+};
+
+/*
+ * A conversion seen through a loop plan: ConvertRange produces the output of the plan,
+ * reading the input range by range from the wrapped conversion and interpolating linearly
+ * when the loop was resampled.
+ */
+template <typename T_Conversion>
+class LoopedConversion
+{
+public:
+    LoopedConversion(T_Conversion& conv, const LoopPlan& plan) :
+        conv(conv),
+        plan(plan)
+    {
+    }
+
+    uint64_t GetOutSize() const { return plan.Samples(); }
+
+    uint16_t GetChannels() const { return plan.channels; }
+
+    void ConvertRange(uint64_t first, uint64_t count, float* out)
+    {
+        if (!count)
+            return;
+
+        uint64_t channels = plan.channels;
+        uint64_t firstFrame = first / channels;
+        uint64_t lastFrame = (first + count - 1) / channels;
+
+        // positions in the endlessly looping input that the frames interpolate between
+        uint64_t from = firstFrame * plan.virtualLength / plan.length;
+        uint64_t to = lastFrame * plan.virtualLength / plan.length + (plan.Resampled() ? 1 : 0);
+
+        thread_local std::vector<float> positions;
+        positions.resize((to - from + 1) * channels);
+        Fetch(from, to, positions.data());
+
+        thread_local std::vector<float> frames;
+        frames.resize((lastFrame - firstFrame + 1) * channels);
+        for (uint64_t frame = firstFrame; frame <= lastFrame; frame++)
+        {
+            uint64_t scaled = frame * plan.virtualLength;
+            uint64_t position = scaled / plan.length;
+            float fraction = static_cast<float>(scaled % plan.length) / static_cast<float>(plan.length);
+            const float* a = positions.data() + (position - from) * channels;
+            float* o = frames.data() + (frame - firstFrame) * channels;
+
+            for (uint64_t c = 0; c < channels; c++)
+                o[c] = fraction == 0.0f ? a[c] : a[c] * (1.0f - fraction) + a[channels + c] * fraction;
+        }
+
+        std::copy_n(frames.begin() + (first - firstFrame * channels), count, out);
+    }
+
+private:
+    T_Conversion& conv;
+    LoopPlan plan;
+
+    /* Converts positions [from, to] of the looping input, one contiguous input run at a time. */
+    void Fetch(uint64_t from, uint64_t to, float* out)
+    {
+        uint64_t channels = plan.channels;
+        uint64_t position = from;
+        while (position <= to)
+        {
+            uint64_t input = plan.InputFrame(position);
+            uint64_t run = to - position + 1;
+            if (input < plan.loopEnd)
+                run = std::min(run, plan.loopEnd - input);
+
+            conv.ConvertRange(input * channels, run * channels, out + (position - from) * channels);
+            position += run;
+        }
+    }
+};
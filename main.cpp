@@ -1,4 +1,28 @@
 #include "program.hpp"
+#include "vagembed.hpp"
+
+namespace
+{
+	// two blocks of a 16 bit WAV and the ADPCM data the encoder writes for it, so a constexpr kernel that drifts from the runtime ones breaks the build
+	constexpr std::array<int16_t, 40> EMBED_SAMPLE = {
+		0, 9186, 8377, 8005, 13662, 12530, 2329, -2573, -1873, -7875, -15575, -12258, -5274, -5471, -3685, 6836, 13041, 9408, 8725, 12302,
+		7061, -3941, -6669, -5642, -11608, -15598, -8279, -1091, -1429, 2290, 12326, 14388, 8237, 7343, 8558, 252, -9661, -9432, -7886, -12844 };
+	constexpr std::array<uint8_t, VagEmbed::DataSize<40>> EMBED_VAG = {
+		0x01, 0x00, 0x40, 0x24, 0x33, 0x23, 0xf1, 0xde, 0xdd, 0xfe, 0x21, 0x33, 0x23, 0xf1, 0xde, 0xdd,
+		0x12, 0x01, 0x22, 0x23, 0x12, 0xe0, 0xde, 0xee, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+	constexpr bool EmbedMatches()
+	{
+		constexpr auto encoded = VagEmbed::Encode(EMBED_SAMPLE);
+		for (size_t i = 0; i < encoded.size(); i++)
+			if (encoded[i] != EMBED_VAG[i])
+				return false;
+		return true;
+	}
+	static_assert(EmbedMatches(), "VagEmbed::Encode no longer produces what the encoder writes");
+}
+
 int main(int argc, char **argv)
 {
 	try
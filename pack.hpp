@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "batch.hpp"
+#include "encoder.hpp"
+#include "inspect.hpp"
+#include "threadpool.hpp"
+#include "vag.hpp"
+
+struct vagbank_header_t;
+typedef struct vagbank_header_t VagBankHeader;
+struct vagbank_entry_t;
+typedef struct vagbank_entry_t VagBankEntry;
+
+/* All bank fields are little endian so the runtime can use the index in place. */
+struct vagbank_header_t
+{
+    uint8_t magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t indexOffset;
+    uint64_t dataOffset;
+    uint64_t fileSize;
+};
+
+enum VagBankFlag
+{
+    VAGBANK_LOOP = 1 /* loopStart holds the byte offset of the loop start block */
+};
+
+struct vagbank_entry_t
+{
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t sampleRate;
+    uint32_t loopStart;
+    uint8_t channels;
+    uint8_t flags;
+    uint16_t reserved;
+};
+
+static_assert(sizeof(VagBankHeader) == 32 && sizeof(VagBankEntry) == 32, "bank records have to stay 32 bytes");
+
+/*
+ * Many ADPCM streams in one file: header, index sorted by name hash for a binary search,
+ * then the raw ADPCM data of every stream on a 64 byte boundary. Sizes come from
+ * VagFile::PredictSize, so the whole layout is fixed before anything is encoded and
+ * streams can be encoded in parallel straight into their place in the image.
+ */
+class VagBank
+{
+public:
+    static constexpr uint64_t ALIGNMENT = 64;
+
+    struct Item
+    {
+        std::string name;
+        uint32_t samplerate = 0;
+        uint16_t channels = 0;
+        uint64_t len = 0; //samples of all channels handed to the encoder
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        bool looped = false;
+        uint32_t loopStartBlock = 0;
+    };
+
+    /* 64 bit FNV-1a of the stream name. */
+    static constexpr uint64_t NameHash(const char* name)
+    {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        while (*name)
+        {
+            hash ^= static_cast<uint8_t>(*name++);
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    size_t Add(std::string name, uint32_t samplerate, uint16_t channels, uint64_t len)
+    {
+        Item item;
+        item.name = name;
+        item.samplerate = samplerate;
+        item.channels = channels;
+        item.len = len;
+        item.size = VagFile::PredictSize(len, false);
+        return Add(item);
+    }
+
+    /* Adds a stream that ends with the loop of plan. */
+    size_t Add(std::string name, const LoopPlan& plan)
+    {
+        if (!plan.looped)
+            return Add(name, plan.samplerate, plan.channels, plan.Samples());
+
+        Item item;
+        item.name = name;
+        item.samplerate = plan.samplerate;
+        item.channels = plan.channels;
+        item.len = plan.Samples();
+        item.size = VagFile::PredictSize(item.len, true);
+        item.looped = true;
+        item.loopStartBlock = plan.StartBlock();
+        return Add(item);
+    }
+
+    /* Assigns every stream its offset and allocates the image of the whole bank. */
+    void Layout()
+    {
+        std::vector<size_t> order(items.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+            return NameHash(items[a].name.c_str()) < NameHash(items[b].name.c_str());
+        });
+
+        for (size_t i = 1; i < order.size(); i++)
+        {
+            auto& previous = items[order[i - 1]];
+            auto& current = items[order[i]];
+            if (NameHash(previous.name.c_str()) == NameHash(current.name.c_str()))
+                throw std::runtime_error("Bank names " + previous.name + " and " + current.name + " have the same hash");
+        }
+
+        uint64_t indexOffset = sizeof(VagBankHeader);
+        uint64_t offset = AlignUp(indexOffset + items.size() * sizeof(VagBankEntry));
+        uint64_t dataOffset = offset;
+        for (auto& item : items)
+        {
+            item.offset = offset;
+            offset = AlignUp(offset + item.size);
+        }
+
+        image.assign(offset, 0);
+
+        VagBankHeader header{};
+        std::copy_n("VAGb", 4, header.magic);
+        header.version = 1;
+        header.count = static_cast<uint32_t>(items.size());
+        header.indexOffset = static_cast<uint32_t>(indexOffset);
+        header.dataOffset = dataOffset;
+        header.fileSize = offset;
+        std::copy_n(reinterpret_cast<const uint8_t*>(&header), sizeof(header), image.data());
+
+        VagBankEntry* index = reinterpret_cast<VagBankEntry*>(image.data() + indexOffset);
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            auto& item = items[order[i]];
+            VagBankEntry entry{};
+            entry.hash = NameHash(item.name.c_str());
+            entry.offset = item.offset;
+            entry.size = static_cast<uint32_t>(item.size);
+            entry.sampleRate = item.samplerate;
+            entry.channels = static_cast<uint8_t>(item.channels);
+            if (item.looped)
+            {
+                entry.flags = VAGBANK_LOOP;
+                entry.loopStart = item.loopStartBlock * VAG_BLOCK_SIZE;
+            }
+            std::copy_n(reinterpret_cast<const uint8_t*>(&entry), sizeof(entry), reinterpret_cast<uint8_t*>(index + i));
+        }
+    }
+
+    const std::vector<Item>& GetItems() const { return items; }
+
+    uint64_t GetSize() const { return image.size(); }
+
+    /* Where stream i is encoded to, valid after Layout. */
+    uint8_t* Payload(size_t i) { return image.data() + items[i].offset; }
+
+    void Write(const std::string& path) const
+    {
+        TRACE_SCOPE("WriteBank", path);
+        TRACE_BYTES(image.size());
+        COUNTER_SCOPE(WRITE);
+        std::ofstream stream(path, std::ios::binary);
+
+        if (!stream.is_open())
+            throw std::runtime_error("Cannot open bank output file " + path);
+
+        stream.write(reinterpret_cast<const char*>(image.data()), image.size());
+    }
+
+private:
+    std::vector<Item> items;
+    std::vector<uint8_t> image;
+
+    size_t Add(const Item& item)
+    {
+        if (item.size > UINT32_MAX)
+            throw std::runtime_error("Bank stream " + item.name + " exceeds the 4 GB limit of a VAG stream");
+
+        items.push_back(item);
+        return items.size() - 1;
+    }
+
+    static uint64_t AlignUp(uint64_t value)
+    {
+        return (value + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+};
+
+/*
+ * Packs a list of inputs into one bank, each under the name of its file without the
+ * extension. Headers are probed first to lay out the bank, then every input is loaded,
+ * converted and encoded into its slot through a JobScheduler, longest first and within
+ * the memory budget if one is given. Looping inputs end with their loop and get
+ * VAGBANK_LOOP with the offset of the loop start block.
+ */
+class BankPacker
+{
+public:
+    BankPacker() = delete;
+    BankPacker(const BankPacker&) = delete;
+
+    BankPacker(std::vector<std::string> inputs, std::string output, EncodeOptions options, uint64_t budget = 0) :
+        inputs(inputs),
+        output(output),
+        options(options),
+        budget(budget)
+    {
+    }
+
+    void Execute()
+    {
+        std::vector<std::string> paths = Inspector::CollectPaths(inputs);
+        if (paths.empty())
+            throw std::runtime_error("No inputs to pack");
+
+        std::vector<Inspector::FileInfo> infos(paths.size());
+        ThreadPool::Shared().ParallelFor(paths.size(), [&](uint64_t i) {
+            infos[i].path = paths[i];
+            if (Inspector::TypeOf(paths[i]) == Encoder::VAGTYPE)
+                throw std::runtime_error("Cannot pack already encoded " + paths[i]);
+            EncodeOptions probe;
+            probe.loops = options.loops;
+            Inspector::Probe(infos[i], probe);
+        });
+
+        VagBank bank;
+        for (auto& info : infos)
+            bank.Add(std::filesystem::path(info.path).stem().string(), info.loop);
+        bank.Layout();
+
+        // the ADPCM goes straight into the bank image, which is already held
+        std::vector<JobScheduler::Job> jobs;
+        for (auto& info : infos)
+            jobs.push_back({ info.adpcmsize + info.filesize, info.memory - info.adpcmsize });
+
+        JobScheduler scheduler(jobs, budget);
+        scheduler.Execute([&](size_t i) {
+            TRACE_SCOPE("PackFile", paths[i]);
+            COUNTER_FILE(paths[i]);
+            std::unique_ptr<File> file = Encoder::LoadInput(paths[i], Inspector::TypeOf(paths[i]));
+            Encoder::ConversionType conversion = Encoder::CreateConversion(*file, options.noisereduce);
+
+            std::visit([&](auto& conv) {
+                if (!conv)
+                    throw std::runtime_error("Conversion pointer not created");
+                LoopPlan loop = LoopPlan::Create(*file, options.loops);
+                if (loop.Samples() != bank.GetItems()[i].len || conv->GetOutSize() != infos[i].frames * infos[i].channels)
+                    throw std::runtime_error("Input changed while packing " + paths[i]);
+
+                Encoder::EncodeFused(*conv, bank.Payload(i), options.precise, loop, static_cast<float>(options.silence));
+                }, conversion);
+        });
+
+        bank.Write(output);
+
+        std::cout << paths.size() << " streams, " << bank.GetSize() << " bytes written to " << output << "\n";
+    }
+
+private:
+    std::vector<std::string> inputs;
+    std::string output;
+    EncodeOptions options;
+    uint64_t budget; //memory the encodes may hold at once, 0 for no limit
+};
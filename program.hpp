@@ -1,36 +1,45 @@
 #pragma once
 
 #include <cctype>
+#include <cstdint>
+#include <cstdio>
 #include <filesystem>
 #include <iostream>
 #include <memory>
 #include <regex>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <tuple>
 #include <unordered_map>
 #include <variant>
 #include <vector>
-
-#include "file.hpp"
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "asyncio.hpp"
+#include "bank.hpp"
+#include "batch.hpp"
+#include "benchmark.hpp"
+#include "cluster.hpp"
+#include "counters.hpp"
+#include "encoder.hpp"
+#include "fanout.hpp"
+#include "inspect.hpp"
+#include "pack.hpp"
+#include "threadpool.hpp"
+#include "trace.hpp"
+#include "tune.hpp"
+#include "vagdecoder.hpp"
 #include "wav.hpp"
-#include "aiff.hpp"
-#include "vag.hpp"
-#include "convertpcm16.hpp"
 
 class Program
 {
 public:
-    
-    enum FileType
-    {
-        UNKNOWNTYPE = 0,
-        VAGTYPE = 1,
-        WAVTYPE = 2,
-        AIFFTYPE = 3,
-    };
 
-    using ConversionType = std::variant<std::unique_ptr<ConvertPCM16<uint8_t>>, std::unique_ptr<ConvertPCM16<int16_t>>,
-        std::unique_ptr<ConvertPCM16<PCM24>>, std::unique_ptr<ConvertPCM16<int32_t>>, std::unique_ptr<ConvertPCM16<float>>, std::unique_ptr<ConvertPCM16<double>>>;
+    using FileType = Encoder::FileType;
 
     Program() = delete;
     Program(const Program&) = delete;
@@ -38,9 +47,33 @@ public:
 
     explicit Program(int argc, char **argv) :
     noisereduce(true),
+    precise(false),
+    loops(true),
+    silence(0),
+    trim(false),
     programtype(false),
     usehelp(false),
-    type(UNKNOWNTYPE),
+    bankbudget(0),
+    benchmark(false),
+    benchiterations(Benchmark::DEFAULT_ITERATIONS),
+    benchscale(1),
+    benchtolerance(5),
+    autotune(false),
+    counters(false),
+    maxmemory(0),
+    batch(false),
+    useprofile(true),
+    jobsgiven(false),
+    kernelgiven(false),
+    interleave(0),
+    sector(2048),
+    inspect(false),
+    inspectjson(false),
+    decodestart(0),
+    decodelength(0),
+    useindex(false),
+    listenany(false),
+    type(Encoder::UNKNOWNTYPE),
     filepathregex(new (std::nothrow) std::regex("[\\:A-Za-z0-9 _\\-/\\\\.]*\\.[A-Za-z0-9]+$"))
     {
         if (!filepathregex)
@@ -54,6 +87,9 @@ public:
             PrintHelp();
             throw std::invalid_argument("Launching of program failed");
         }
+
+        if (useprofile && !autotune)
+            LoadProfile();
     }
 
     ~Program() {
@@ -63,14 +99,29 @@ public:
     bool GetNoiseReduce() const { return noisereduce; }
     
     bool GetProgramType() const { return programtype; }
+
+    EncodeOptions GetEncodeOptions() const
+    {
+        EncodeOptions options;
+        options.noisereduce = noisereduce;
+        options.precise = precise;
+        options.loops = loops;
+        options.silence = static_cast<uint32_t>(silence);
+        options.trim = trim;
+        options.interleave = static_cast<uint32_t>(interleave);
+        options.sector = static_cast<uint32_t>(sector);
+        return options;
+    }
     
     FileType GetFileType() const { return type; }
     
     std::string GetFileName() const { return filename; }
 
     std::string GetOutputFile() const { 
+        if (outputfile.empty() && filepath == "-")
+            return "-";
         if (outputfile.empty())
-            return filename + ".vag";
+            return filename + (programtype ? ".wav" : ".vag");
         return outputfile;
     }
 
@@ -82,33 +133,117 @@ public:
             PrintHelp();
             return;
         }
-        if (!programtype)
+#ifdef ADPCM_TRACE
+        if (!tracefile.empty())
+            Trace::Get().Enable();
+#endif
+        if (counters)
+            Counters::Get().Enable();
+
+        if (autotune)
+        {
+            AutoTune tune(jobsgiven, kernelgiven);
+            tune.Execute();
+        }
+        else if (!workeraddress.empty())
+        {
+            Worker worker(workeraddress, listenany);
+            worker.Execute();
+        }
+        else if (!coordinate.empty())
+        {
+            Coordinator coordinator(inputs, coordinate, GetEncodeOptions());
+            coordinator.Execute();
+        }
+        else if (benchmark)
+        {
+            Benchmark bench(benchoutput, benchbaseline, static_cast<uint32_t>(benchiterations),
+                static_cast<uint32_t>(benchscale), static_cast<uint32_t>(benchtolerance), GetEncodeOptions());
+            bench.Execute();
+        }
+        else if (inspect)
+        {
+            Inspector inspector(inputs, inspectjson, GetEncodeOptions());
+            inspector.Execute();
+        }
+        else if (!bankmanifest.empty())
+        {
+            BankBudget bank(bankmanifest, bankbudget, GetEncodeOptions(), packfile);
+            bank.Execute();
+        }
+        else if (!packfile.empty())
+        {
+            BankPacker packer(inputs, packfile, GetEncodeOptions(), maxmemory);
+            packer.Execute();
+        }
+        else if (!variants.empty())
+        {
+            ExecuteFanOut();
+        }
+        else if (batch)
+        {
+            BatchEncoder encoder(inputs, GetEncodeOptions(), maxmemory);
+            encoder.Execute();
+        }
+        else if (!programtype)
         {
             ExecuteEncode();
         }
         else
         {
-
+            ExecuteDecode();
         }
+        if (counters)
+            Counters::Get().Report(std::cerr);
+#ifdef ADPCM_TRACE
+        if (!tracefile.empty())
+            Trace::Get().Write(tracefile);
+#endif
     }
 
 private:
     bool noisereduce; //use fir = true, don't use = false
+    bool precise; //encode from full precision samples = true, from 16 bit = false
+    bool loops; //end with the sustain loop of the input = true, encode the whole input = false
+    uint64_t silence; //16 bit level at or below which a block is written as silence
+    bool trim; //cut leading and trailing silence = true, keep it = false
     bool programtype; //encode = false, decode = true
     bool usehelp; //passed help command
+    std::string bankmanifest;
+    uint64_t bankbudget;
+    bool benchmark;
+    std::string benchoutput;
+    std::string benchbaseline;
+    uint64_t benchiterations;
+    uint64_t benchscale;
+    uint64_t benchtolerance;
+    bool autotune;
+    bool counters; //report performance counters per stage
+    uint64_t maxmemory; //memory the encodes of many inputs may hold at once, 0 for no limit
+    bool batch; //encode every input to a VAG next to it
+    bool useprofile; //load the --autotune profile of this host
+    bool jobsgiven;
+    bool kernelgiven;
+    uint64_t interleave;
+    uint64_t sector;
+    bool inspect;
+    bool inspectjson;
+    std::vector<std::string> inputs;
+    std::vector<std::string> variants;
+    std::string workeraddress;
+    std::vector<std::string> coordinate;
+    std::string packfile;
+    std::string tracefile;
+    uint64_t decodestart;
+    uint64_t decodelength;
+    bool useindex;
+    bool listenany; //let --worker listen on other than loopback addresses
     std::string filepath;
     std::string filename;
     std::string outputfile;
     FileType type;
     std::vector<std::string> arguments; 
     std::regex *filepathregex;
-    const std::unordered_map<std::string, FileType> filetypemap
-    {
-        { "wav", WAVTYPE },
-        { "aif", AIFFTYPE },
-        { "aiff", AIFFTYPE },
-        { "aifc", AIFFTYPE },
-    };
 
     bool ParseArguments(int argc, char **argv)
     {
@@ -133,18 +268,185 @@ private:
                 programtype = true;
             else if (param == "-nf" || param == "--nofir")
                 noisereduce = false;
+            else if (param == "-p" || param == "--precise")
+                precise = true;
+            else if (param == "--no-loop")
+                loops = false;
+            else if (param.substr(0, 20) == "--silence-threshold=")
+            {
+                if (!ParseNumber(param.substr(20), silence) || silence > INT16_MAX)
+                {
+                    std::cerr << "Silence threshold must be a 16 bit level from 0 to 32767\n";
+                    return false;
+                }
+            }
+            else if (param == "--trim")
+                trim = true;
             else if (param == "-h" || param == "--help")
             {
                 usehelp = true;
                 return true;
             }
+            else if (param.substr(0, 7) == "--bank=")
+                bankmanifest = it.substr(7);
+            else if (param.substr(0, 9) == "--budget=")
+            {
+                if (!ParseNumber(param.substr(9), bankbudget))
+                    return false;
+            }
+            else if (param == "--benchmark" || param.substr(0, 12) == "--benchmark=")
+            {
+                benchmark = true;
+                if (param.size() > 12)
+                    benchoutput = it.substr(12);
+            }
+            else if (param.substr(0, 11) == "--baseline=")
+                benchbaseline = it.substr(11);
+            else if (param.substr(0, 19) == "--bench-iterations=")
+            {
+                if (!ParseNumber(param.substr(19), benchiterations))
+                    return false;
+            }
+            else if (param.substr(0, 14) == "--bench-scale=")
+            {
+                if (!ParseNumber(param.substr(14), benchscale))
+                    return false;
+            }
+            else if (param.substr(0, 18) == "--bench-tolerance=")
+            {
+                if (!ParseNumber(param.substr(18), benchtolerance))
+                    return false;
+            }
+            else if (param == "--inspect" || param == "--dry-run")
+                inspect = true;
+            else if (param.substr(0, 8) == "--trace=")
+            {
+#ifdef ADPCM_TRACE
+                tracefile = it.substr(8);
+#else
+                std::cerr << "Tracing is not built in, rebuild with make trace=1" << "\n";
+                return false;
+#endif
+            }
+            else if (param.substr(0, 8) == "--start=")
+            {
+                if (!ParseNumber(param.substr(8), decodestart))
+                    return false;
+            }
+            else if (param.substr(0, 9) == "--length=")
+            {
+                if (!ParseNumber(param.substr(9), decodelength))
+                    return false;
+            }
+            else if (param == "--index")
+                useindex = true;
+            else if (param.substr(0, 10) == "--variant=")
+                variants.push_back(it.substr(10));
+            else if (param.substr(0, 9) == "--worker=")
+                workeraddress = it.substr(9);
+            else if (param == "--listen-any")
+                listenany = true;
+            else if (param.substr(0, 13) == "--coordinate=")
+            {
+                std::istringstream addresses(it.substr(13));
+                std::string address;
+                while (std::getline(addresses, address, ','))
+                {
+                    if (!address.empty())
+                        coordinate.push_back(address);
+                }
+            }
+            else if (param.substr(0, 7) == "--pack=")
+                packfile = it.substr(7);
+            else if (param == "--json")
+                inspectjson = true;
+            else if (param.substr(0, 13) == "--interleave=")
+            {
+                if (!ParseNumber(param.substr(13), interleave) || interleave % 16 || (interleave && interleave < 32) || interleave > UINT32_MAX)
+                {
+                    std::cerr << "Interleave must be a multiple of 16 bytes, at least 32\n";
+                    return false;
+                }
+            }
+            else if (param.substr(0, 9) == "--sector=")
+            {
+                if (!ParseNumber(param.substr(9), sector) || !sector || sector > UINT32_MAX)
+                {
+                    std::cerr << "Sector size must be a positive number of bytes\n";
+                    return false;
+                }
+            }
+            else if (param.substr(0, 3) == "-j=" || param.substr(0, 7) == "--jobs=")
+            {
+                uint64_t jobs{};
+                if (!ParseNumber(param.substr(param.find('=') + 1), jobs) || !jobs)
+                    return false;
+                ThreadPool::SetDefaultThreads(static_cast<unsigned>(jobs));
+                jobsgiven = true;
+            }
+            else if (param.substr(0, 9) == "--kernel=")
+            {
+                try
+                {
+                    Kernels::Select(param.substr(9));
+                    kernelgiven = true;
+                }
+                catch (const std::runtime_error& e)
+                {
+                    std::cerr << e.what() << "\n";
+                    return false;
+                }
+            }
+            else if (param == "--autotune")
+            {
+                autotune = true;
+            }
+            else if (param == "--counters")
+            {
+                counters = true;
+            }
+            else if (param.substr(0, 13) == "--max-memory=")
+            {
+                if (!ParseNumber(param.substr(13), maxmemory))
+                    return false;
+            }
+            else if (param.substr(0, 5) == "--io=")
+            {
+                try
+                {
+                    AsyncIO::SetDefaultBackend(AsyncIO::ParseBackend(param.substr(5)));
+                }
+                catch (const std::runtime_error& e)
+                {
+                    std::cerr << e.what() << "\n";
+                    return false;
+                }
+            }
+            else if (param == "--no-profile")
+            {
+                useprofile = false;
+            }
+            else if (param == "--cross-check")
+            {
+                Kernels::EnableCrossCheck();
+            }
             else if (param.substr(0, 2) == "-o" || param.substr(0, 8) == "--output")
             {
                 if (!ParseOutputFile(it))
                     return false;
             }
+            else if (it == "-")
+            {
+                filepath = it;
+                filename = it;
+            }
+            else if (std::filesystem::is_directory(it))
+                inputs.push_back(it);
             else if (ParseInputFile(it))
+            {
                 filepath = it;
+                inputs.push_back(it);
+            }
             else
             {
                 std::cerr << "Illegal argument passed " <<  it << "\n";
@@ -152,15 +454,99 @@ private:
             }
         }
 
-        if (filename.empty() || filepath.empty() || type == UNKNOWNTYPE)
+        if (trim && (benchmark || inspect || programtype || interleave || !bankmanifest.empty() || !packfile.empty() || !variants.empty()))
+        {
+            std::cerr << "--trim only applies to encoding a single plain VAG" << "\n";
+            return false;
+        }
+
+        if (autotune || !workeraddress.empty())
+            return true;
+
+        if (!coordinate.empty())
+        {
+            if (inputs.empty() || interleave)
+            {
+                std::cerr << "Coordinating needs input files or directories and plain VAG output" << "\n";
+                return false;
+            }
+            return true;
+        }
+
+        if (benchmark)
+            return true;
+
+        if (inspect)
+        {
+            if (inputs.empty())
+            {
+                std::cerr << "No input files or directories to inspect" << "\n";
+                return false;
+            }
+            return true;
+        }
+
+        if (!bankmanifest.empty())
+        {
+            if (!bankbudget)
+            {
+                std::cerr << "Bank mode requires --budget" << "\n";
+                return false;
+            }
+            return true;
+        }
+
+        if (!packfile.empty())
+        {
+            if (inputs.empty())
+            {
+                std::cerr << "No input files or directories to pack" << "\n";
+                return false;
+            }
+            return true;
+        }
+
+        if (!programtype && variants.empty() && filepath != "-"
+            && (inputs.size() > 1 || (inputs.size() == 1 && std::filesystem::is_directory(inputs[0]))))
+        {
+            if (!outputfile.empty())
+            {
+                std::cerr << "Many inputs are each encoded next to themselves, -o names a single output" << "\n";
+                return false;
+            }
+            batch = true;
+            return true;
+        }
+
+        if (filename.empty() || filepath.empty() || (type == Encoder::UNKNOWNTYPE && filepath != "-"))
         {
             std::cerr << "No input file found" << "\n";
             return false;
         }
 
-        if (programtype && (outputfile.empty() || type == UNKNOWNTYPE))
+        if (programtype && filepath == "-")
         {
-            std::cerr << "No output file given for decoding\n";
+            std::cerr << "Decoding seeks in the VAG file, it cannot be read from standard input" << "\n";
+            return false;
+        }
+
+        if (programtype && type != Encoder::VAGTYPE)
+        {
+            std::cerr << "Only VAG files can be decoded" << "\n";
+            return false;
+        }
+
+        if (!variants.empty() && (programtype || GetOutputFile() == "-"))
+        {
+            std::cerr << "Variants are encoded to files, name them with -o when reading standard input" << "\n";
+            return false;
+        }
+
+        std::string extension = programtype ? ".wav" : ".vag";
+        std::string output = GetOutputFile();
+        if (output != "-" && (output.size() < 4 || tolowercase(output.substr(output.size() - 4)) != extension))
+        {
+            std::cerr << "Incorrect output extension, should be " << extension << " for " << output << "\n";
             return false;
         }
 
@@ -194,16 +580,47 @@ private:
 
         filename =  tokens[size-2];
         
-        auto typesearch = filetypemap.find(tokens[size-1]);
+        type = Encoder::GetFileType(tokens[size-1]);
 
-        if (typesearch == filetypemap.end())
+        if (type == Encoder::UNKNOWNTYPE)
         {
             std::cerr << "Unsupported file type extension" << "\n";
             return false;
         }
 
-        type = typesearch->second;
+        return true;
+    }
+
+    bool ParseNumber(std::string arg, uint64_t& value)
+    {
+        std::string digits = arg;
+        uint64_t scale = 1;
+        if (!digits.empty() && (digits.back() == 'k' || digits.back() == 'm' || digits.back() == 'g'))
+        {
+            scale = digits.back() == 'k' ? 1ull << 10 : digits.back() == 'm' ? 1ull << 20 : 1ull << 30;
+            digits.pop_back();
+        }
 
+        // values past 64 bits, before or after the suffix, are as unusable as stray characters
+        uint64_t number = 0;
+        bool valid = !digits.empty() && digits.find_first_not_of("0123456789") == std::string::npos;
+        try
+        {
+            if (valid)
+                number = std::stoull(digits);
+        }
+        catch (const std::out_of_range&)
+        {
+            valid = false;
+        }
+
+        if (!valid || number > UINT64_MAX / scale)
+        {
+            std::cerr << "Incorrect numeric argument " << arg << "\n";
+            return false;
+        }
+
+        value = number * scale;
         return true;
     }
 
@@ -219,148 +636,181 @@ private:
 
         outputfile = arg.substr(split+1);
         
-        if (!std::regex_match(outputfile, *filepathregex))
+        if (outputfile != "-" && !std::regex_match(outputfile, *filepathregex))
         {
             std::cerr << "Incorrect output file format " << outputfile << "\n";
             return false;
-        } 
-        else if (outputfile.substr(outputfile.size()-4) != ".vag")
-        {
-            std::cerr << "Incorrect extension, should be .vag, not " << arg.substr(arg.size()-4) << "\n";
-            return false;
         }
 
-        if (programtype)
-        {
-            split = outputfile.rfind("=");
-
-            if (split == std::string::npos)
-            {
-                std::cerr << "Incorrect output argument format " << arg << " missing = delimiter\n";
-                return false;
-            }
-
-            auto typesearch = filetypemap.find(outputfile.substr(split + 1));
-
-            if (typesearch == filetypemap.end())
-            {
-                std::cerr << "Unsupported file type extension" << "\n";
-                return false;
-            }
-
-            type = typesearch->second;
-        }
-
-
         return true;
     }
 
     void ExecuteEncode()
     {
-        std::vector<float> coef = { .15f, .15f, .15f, .15f };
-
-        std::unique_ptr<File> file;
-
-        switch (type)
-        {
-        case WAVTYPE:
+        std::string output = GetOutputFile();
+        if (GetFilePath() == "-" || output == "-")
         {
-            file = std::make_unique<WavFile>(GetFilePath());
-
-            if (!file)
-                throw std::runtime_error("Cannot create WAV file");
-
-            break;
+            // the report goes to stderr when stdout carries the VAG
+            SetBinaryStdio();
+            Encoder::EncodePipe(GetFilePath(), type, output, GetEncodeOptions(), output == "-" ? &std::cerr : &std::cout);
+            return;
         }
 
-        case AIFFTYPE:
-        {
-            file = std::make_unique<AIFFFile>(GetFilePath());
+        Encoder::EncodeFile(GetFilePath(), type, output, GetEncodeOptions(), &std::cout);
+    }
 
-            if (!file)
-                throw std::runtime_error("Cannot create AIFF file");
+    /* Applies the --autotune profile of this host, a broken one is reported and skipped. */
+    void LoadProfile()
+    {
+        std::filesystem::path path = TuneProfile::Path();
+        std::error_code error;
+        if (path.empty() || !std::filesystem::exists(path, error))
+            return;
 
-            break;
+        try
+        {
+            TuneProfile::Load(path).Apply(jobsgiven, kernelgiven);
         }
-        default:
-            throw std::runtime_error("Invalid file type");
+        catch (const std::runtime_error& e)
+        {
+            std::cerr << "Ignoring profile: " << e.what() << "\n";
         }
+    }
 
-        std::cout << file->samplessize << " "
-            << file->channels << " "
-            << file->samplerate << " " << file->bps << "\n";
+    /* Encodes every --variant from one load of the input, to <output>_NAME.vag. */
+    void ExecuteFanOut()
+    {
+        std::vector<FanOut::Variant> parsed;
+        for (const auto& spec : variants)
+            parsed.push_back(FanOut::ParseVariant(spec, GetEncodeOptions()));
 
-        int16_t* convertedsamplesptr{};
-        uint64_t outsize{};
+        if (GetFilePath() == "-")
+            SetBinaryStdio();
 
-        ConversionType conversion;
+        std::string output = GetOutputFile();
+        FanOut fanout(GetFilePath(), type, output.substr(0, output.size() - 4), parsed, loops);
+        fanout.Execute();
+    }
 
-        switch (file->bps)
-        {
-        case 8:
-        {
-            conversion = std::make_unique<ConvertPCM16<uint8_t>>(noisereduce, coef, file->samplessize, file->samples, file->channels);
-            break;
-        }
-        case 16:
-        {
-            conversion = std::make_unique<ConvertPCM16<int16_t>>(noisereduce, coef, file->samplessize, file->samples, file->channels);
-            break;
-        }
-        case 24:
-        {
-            conversion = std::make_unique<ConvertPCM16<PCM24>>(noisereduce, coef, file->samplessize, file->samples, file->channels);
-            break;
-        }
-        case 32:
-        {
-            if (file->isfloat)
-                conversion = std::make_unique<ConvertPCM16<float>>(noisereduce, coef, file->samplessize, file->samples, file->channels);
-            else
-                conversion = std::make_unique<ConvertPCM16<int32_t>>(noisereduce, coef, file->samplessize, file->samples, file->channels);
-            break;
-        }
-        case 64:
+    /* Windows opens stdin and stdout in text mode, which would mangle the binary streams. */
+    static void SetBinaryStdio()
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+
+    /* Decodes the requested frames, through the sidecar index when --index is given. */
+    void ExecuteDecode()
+    {
+        VagDecoder decoder(GetFilePath());
+
+        if (useindex)
         {
-            if (file->isfloat)
-                conversion = std::make_unique<ConvertPCM16<double>>(noisereduce, coef, file->samplessize, file->samples, file->channels);
-            break;
-        }
-        default:
-            throw std::runtime_error("Unhandled bit rate or sample data type");
+            std::string indexpath = VagDecoder::IndexPath(GetFilePath());
+            if (!decoder.LoadIndex(indexpath))
+            {
+                decoder.BuildIndex();
+                decoder.SaveIndex(indexpath);
+            }
         }
 
-        std::visit([&convertedsamplesptr, &outsize](auto& conv) {
-            if (!conv)
-                throw std::runtime_error("Conversion pointer not created");
-            
-            convertedsamplesptr = conv->convert();
-            outsize = conv->GetOutSize();
-
-            }, conversion);
-        std::cout << outsize << std::endl;
+        uint64_t frames = decoder.GetFrameCount();
+        if (decodestart > frames)
+            throw std::out_of_range("Start frame " + std::to_string(decodestart) + " is past the end of " + GetFilePath());
 
-        std::unique_ptr<VagFile> vagFile(new (std::nothrow) VagFile(file->samplerate, file->channels, GetOutputFile()));
+        uint64_t count = frames - decodestart;
+        if (decodelength)
+            count = std::min(count, decodelength);
 
-        if (!vagFile)
-            throw std::runtime_error("Cannot create vagfile object");
+        std::vector<int16_t> pcm(count * decoder.GetChannels());
+        decoder.Decode(decodestart, count, pcm.data());
 
-        vagFile->CreateVagSamples(convertedsamplesptr, outsize, 0, 0, false, file->channels);
+        if (GetOutputFile() == "-")
+        {
+            SetBinaryStdio();
+            WavFile::WriteWavFile(std::cout, decoder.GetSampleRate(), decoder.GetChannels(), pcm.data(), count);
+            std::cout.flush();
+            std::cerr << count << " frames decoded to standard output\n";
+            return;
+        }
 
-        vagFile->WriteVagFile();
+        WavFile::WriteWavFile(GetOutputFile(), decoder.GetSampleRate(), decoder.GetChannels(), pcm.data(), count);
+        std::cout << count << " frames decoded to " << GetOutputFile() << "\n";
     }
 
     void PrintHelp()
     {
         std::cout << "\nADPCMEncoder - an application for Sony PS2 VAG file encoding/decoding\n\n"
-            << "Usage: ADPCMEncoder [OPTIONS] [FILENAME]\n\n"
+            << "Usage: ADPCMEncoder [OPTIONS] [FILENAME]\n"
+            << "       ADPCMEncoder [OPTIONS] [FILES/DIRECTORIES...]\n"
+            << "       ADPCMEncoder --inspect [OPTIONS] [FILES/DIRECTORIES...]\n\n"
             << "Options:\n\n"
             << "-h, --help                    Use cmdline help\n\n"
-            << "-d, --decode                  Decode a valid VAG file (encode is default)\n\n"
+            << "-d, --decode                  Decode a valid VAG file (encode is default); VAG files do not record\n"
+            << "                              the input length, so up to 27 samples of block padding end the WAV\n\n"
             << "-nf, --no-fir                 Don't use FIR sampling for noise (FIR usage is default)\n\n"
-            << "-o=[FILE], --output=[FILE]    Output file name (Input file name is default)\n\n"
+            << "-p, --precise                 Encode from full precision samples instead of 16 bit PCM\n\n"
+            << "--no-loop                     Encode the whole input even when its smpl/cue or INST/MARK chunks\n"
+            << "                              hold a loop (the output ends with the loop by default)\n\n"
+            << "--silence-threshold=[LEVEL]   Write blocks with no sample above LEVEL (of 32767) as silence without\n"
+            << "                              searching for a predictor (0, only digital silence, is default)\n\n"
+            << "--trim                        Cut the leading and trailing silence of the input, up to the loop\n"
+            << "                              start of a looping one\n\n"
+            << "-o=[FILE], --output=[FILE]    Output file name (Input file name is default), - writes to stdout\n\n"
+            << "--start=[FRAME]               First frame to decode with -d (0 is default)\n\n"
+            << "--length=[FRAMES]             Number of frames to decode with -d (rest of the file is default)\n\n"
+            << "--index                       Seek through the checkpoint index in FILE.vag.idx with -d,\n"
+            << "                              building and saving it when missing or stale\n\n"
+            << "-j=[N], --jobs=[N]            Number of worker threads (hardware threads is default)\n\n"
+            << "--kernel=[NAME]               SIMD kernels to use: auto, scalar, sse4.1, avx2 or avx512 (auto picks\n"
+            << "                              the widest one this CPU supports up to avx2)\n\n"
+            << "--cross-check                 Run the scalar kernels alongside the selected ones and fail on any\n"
+            << "                              difference in their output\n\n"
+            << "--autotune                    Time calibration encodes over kernels, thread counts and encode\n"
+            << "                              block counts and save the fastest to the profile of this host, which\n"
+            << "                              later runs load; -j and --kernel given with it are kept\n\n"
+            << "--no-profile                  Ignore the --autotune profile of this host\n\n"
+            << "--variant=[NAME,FLAGS]        Encode a variant to OUTPUT_NAME.vag, repeat for several from one load of\n"
+            << "                              the input; flags: /N keeps every Nth frame, mono downmixes, fir or nf\n"
+            << "                              turn the FIR on or off, p encodes from full precision samples\n\n"
+            << "--interleave=[BYTES]          Write a sector aligned interleaved stream with units of BYTES per channel,\n"
+            << "                              a multiple of 16 of at least 32 so each unit has a start and end block\n\n"
+            << "--sector=[BYTES]              Sector size interleaved rows are aligned to (2048 is default)\n\n"
+            << "--inspect, --dry-run          Report rate, length and encoded sizes from the headers of the inputs,\n"
+            << "                              directories are searched recursively\n\n"
+            << "--json                        Print the --inspect report as JSON\n\n"
+            << "--bank=[FILE]                 Encode a bank manifest, one \"path priority minrate [output]\" per line\n\n"
+            << "--budget=[BYTES]              SPU RAM budget for --bank, accepts k/m/g suffixes\n\n"
+            << "--pack=[FILE]                 Pack the inputs, or the --bank manifest, into one bank file with\n"
+            << "                              an index sorted by name hash and 64 byte aligned streams\n\n"
+            << "--max-memory=[BYTES]          Memory the encodes of several inputs or of --pack may hold at once,\n"
+            << "                              estimated from their headers; accepts k/m/g suffixes (no limit is\n"
+            << "                              default)\n\n"
+            << "--io=[BACKEND]                File I/O of several inputs: auto, uring or threads (auto uses io_uring\n"
+            << "                              where the kernel allows it and a thread pool otherwise)\n\n"
+            << "--worker=[ADDRESS]            Serve encode jobs on HOST:PORT or unix:PATH until stopped, one at a time\n"
+            << "                              per hardware thread; the protocol is unauthenticated, so a HOST that is\n"
+            << "                              empty or * means loopback and other addresses need --listen-any\n\n"
+            << "--listen-any                  Let --worker listen on addresses other hosts can reach, an empty HOST\n"
+            << "                              or * then binds every interface\n\n"
+            << "--coordinate=[ADDRESS,...]    Encode the input files and directories on --worker processes, each VAG\n"
+            << "                              next to its input; one job runs per address at a time, so list a\n"
+            << "                              worker several times to use several of its cores\n\n"
+            << "--counters                    Report cycles, instructions, IPC, cache and branch misses of the load,\n"
+            << "                              convert, FIR, encode and write stages per file on stderr (Linux)\n\n"
+            << "--trace=[FILE]                Write a Chrome trace of the run (builds made with make trace=1)\n\n"
+            << "--benchmark[=FILE]            Run the synthetic corpus benchmark, optionally writing JSON results\n\n"
+            << "--baseline=[FILE]             Compare --benchmark results against a stored JSON run\n\n"
+            << "--bench-iterations=[N]        Timed passes over the benchmark corpus after a warm-up one, the fastest\n"
+            << "                              is reported (5 is default)\n\n"
+            << "--bench-scale=[N]             Multiplier for benchmark input lengths (1 is default)\n\n"
+            << "--bench-tolerance=[PERCENT]   Allowed MB/s drop against the baseline (5 is default)\n\n"
             << "All Options are case insensitive for alpha characters\n\n"
             << "Filename:\n\n"
-            << "ADPCMEncoder accepts WAV files\n\n";
+            << "ADPCMEncoder accepts WAV (RIFF, RF64, BW64, Wave64), AIFF and FLAC files, and decodes VAG files to WAV\n"
+            << "A FILENAME of - reads a WAV, AIFF or FLAC stream from stdin and writes the VAG to stdout\n"
+            << "Several files or a directory are each encoded to a VAG next to the input, longest first\n\n";
     }
 };
\ No newline at end of file
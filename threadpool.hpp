@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "counters.hpp"
+#include "trace.hpp"
+
+class ThreadPool
+{
+public:
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	explicit ThreadPool(unsigned threads = DefaultThreads())
+	{
+		threads = std::max(1u, threads);
+		for (unsigned i = 0; i < threads; i++)
+			workers.emplace_back([this]() { WorkerLoop(); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		for (auto& worker : workers)
+			worker.join();
+	}
+
+	unsigned GetThreadCount() const { return static_cast<unsigned>(workers.size()); }
+
+	template <typename Func>
+	auto Submit(Func&& func) -> std::future<std::invoke_result_t<Func>>
+	{
+		using Result = std::invoke_result_t<Func>;
+		auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Func>(func));
+		auto future = task->get_future();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+#ifdef ADPCM_TRACE
+			tasks.emplace_back([task, queued = Trace::Now(), file = Counters::Current()]() {
+				Trace::Get().RecordSince("QueueWait", queued);
+				CounterFile counted(file);
+				(*task)();
+			});
+#else
+			tasks.emplace_back([task, file = Counters::Current()]() {
+				CounterFile counted(file);
+				(*task)();
+			});
+#endif
+		}
+		wakeup.notify_one();
+		return future;
+	}
+
+	/*
+	 * Runs func(i) for every i in [0, count). The calling thread takes part in the loop,
+	 * so nesting a ParallelFor inside a pool task cannot starve the pool.
+	 */
+	template <typename Func>
+	void ParallelFor(uint64_t count, Func&& func)
+	{
+		if (!count)
+			return;
+
+		struct LoopState
+		{
+			std::atomic<uint64_t> next{ 0 };
+			std::mutex mutex;
+			std::condition_variable done;
+			unsigned active = 0;
+			bool closed = false;
+			std::exception_ptr error;
+		};
+
+		auto state = std::make_shared<LoopState>();
+
+		auto run = [state, count, &func]() {
+			try
+			{
+				for (uint64_t i = state->next++; i < count; i = state->next++)
+					func(i);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				if (!state->error)
+					state->error = std::current_exception();
+				state->next = count;
+			}
+		};
+
+		uint64_t helpers = std::min<uint64_t>(count - 1, GetThreadCount());
+		for (uint64_t i = 0; i < helpers; i++)
+		{
+			Submit([state, run]() {
+				{
+					std::lock_guard<std::mutex> lock(state->mutex);
+					if (state->closed)
+						return;
+					state->active++;
+				}
+				run();
+				std::lock_guard<std::mutex> lock(state->mutex);
+				if (--state->active == 0)
+					state->done.notify_all();
+			});
+		}
+
+		run();
+
+		TRACE_SCOPE("ParallelForJoin");
+		std::unique_lock<std::mutex> lock(state->mutex);
+		state->closed = true;
+		state->done.wait(lock, [&state]() { return state->active == 0; });
+
+		if (state->error)
+			std::rethrow_exception(state->error);
+	}
+
+	static unsigned DefaultThreads()
+	{
+		if (defaultthreads)
+			return defaultthreads;
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	static void SetDefaultThreads(unsigned threads) { defaultthreads = threads; }
+
+	static ThreadPool& Shared() { return *SharedSlot(); }
+
+	/*
+	 * Replaces the shared pool with one of the given size, which also becomes the default.
+	 * Only for when no work is in flight, the old pool is joined and references to it dangle.
+	 */
+	static void RestartShared(unsigned threads)
+	{
+		SetDefaultThreads(threads);
+		SharedSlot().reset();
+		SharedSlot() = std::make_unique<ThreadPool>(threads);
+	}
+
+private:
+	static inline unsigned defaultthreads = 0;
+
+	static std::unique_ptr<ThreadPool>& SharedSlot()
+	{
+		static std::unique_ptr<ThreadPool> pool = std::make_unique<ThreadPool>();
+		return pool;
+	}
+
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	bool stopping = false;
+
+	void WorkerLoop()
+	{
+		for (;;)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeup.wait(lock, [this]() { return stopping || !tasks.empty(); });
+				if (stopping && tasks.empty())
+					return;
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+};
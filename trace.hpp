@@ -0,0 +1,194 @@
+#pragma once
+
+/*
+ * Chrome Trace Event Format timeline of the encoder, viewable in chrome://tracing or
+ * Perfetto. Only built with ADPCM_TRACE defined (make trace=1); otherwise every macro
+ * below expands to nothing and its arguments are never evaluated.
+ *
+ *   TRACE_SCOPE(name[, detail])  span from here to the end of the enclosing block
+ *   TRACE_BYTES(bytes)           byte count of the innermost open span on this thread
+ *
+ * Recording only starts once Trace::Get().Enable() is called (--trace=FILE).
+ */
+
+#ifdef ADPCM_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class Trace
+{
+public:
+	struct Event
+	{
+		const char* name;
+		std::string detail;
+		int64_t start;
+		int64_t duration;
+		uint64_t bytes;
+	};
+
+	static Trace& Get()
+	{
+		static Trace trace;
+		return trace;
+	}
+
+	/* Starts recording; the calling thread becomes tid 0, named main. */
+	void Enable()
+	{
+		ThreadEvents();
+		enabled = true;
+	}
+
+	bool IsEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+	/* Microseconds since the trace clock started. */
+	static int64_t Now()
+	{
+		static const auto origin = std::chrono::steady_clock::now();
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count();
+	}
+
+	void Record(const char* name, std::string detail, int64_t start, int64_t end, uint64_t bytes)
+	{
+		ThreadEvents().events.push_back({ name, std::move(detail), start, end - start, bytes });
+	}
+
+	/* Span from start until now, for waits that begin on another thread. */
+	void RecordSince(const char* name, int64_t start)
+	{
+		if (IsEnabled())
+			Record(name, "", start, Now(), 0);
+	}
+
+	void Write(const std::string& path)
+	{
+		std::ofstream stream(path);
+		if (!stream.is_open())
+			throw std::runtime_error("Cannot write trace " + path);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		bool first = true;
+		for (auto& thread : threads)
+		{
+			stream << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread->tid
+				<< ",\"args\":{\"name\":\"" << (thread->tid == 0 ? "main" : "thread " + std::to_string(thread->tid)) << "\"}}";
+			first = false;
+			for (auto& event : thread->events)
+			{
+				stream << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"adpcm\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread->tid
+					<< ",\"ts\":" << event.start << ",\"dur\":" << event.duration << ",\"args\":{\"bytes\":" << event.bytes;
+				if (!event.detail.empty())
+					stream << ",\"file\":" << JsonString(event.detail);
+				stream << "}}";
+			}
+		}
+		stream << "\n]}\n";
+	}
+
+private:
+	struct ThreadBuffer
+	{
+		int tid;
+		std::vector<Event> events;
+	};
+
+	std::atomic<bool> enabled{ false };
+	std::mutex mutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> threads;
+
+	/* Every thread appends to its own buffer; the buffers outlive the threads. */
+	ThreadBuffer& ThreadEvents()
+	{
+		thread_local ThreadBuffer* buffer = nullptr;
+		if (!buffer)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			threads.push_back(std::make_unique<ThreadBuffer>());
+			buffer = threads.back().get();
+			buffer->tid = static_cast<int>(threads.size() - 1);
+		}
+		return *buffer;
+	}
+
+	static std::string JsonString(const std::string& value)
+	{
+		std::string out = "\"";
+		for (char c : value)
+		{
+			if (c == '"' || c == '\\')
+				out += '\\';
+			if (static_cast<unsigned char>(c) >= 0x20)
+				out += c;
+		}
+		return out + "\"";
+	}
+};
+
+class TraceScope
+{
+public:
+	TraceScope(const char* name, std::string detail = "") :
+		name(name),
+		enabled(Trace::Get().IsEnabled())
+	{
+		if (!enabled)
+			return;
+		this->detail = std::move(detail);
+		parent = Current();
+		Current() = this;
+		start = Trace::Now();
+	}
+
+	~TraceScope()
+	{
+		if (!enabled)
+			return;
+		Trace::Get().Record(name, std::move(detail), start, Trace::Now(), bytes);
+		Current() = parent;
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+	static void SetBytes(uint64_t count)
+	{
+		if (Current())
+			Current()->bytes = count;
+	}
+
+private:
+	const char* name;
+	bool enabled;
+	std::string detail;
+	TraceScope* parent = nullptr;
+	int64_t start = 0;
+	uint64_t bytes = 0;
+
+	static TraceScope*& Current()
+	{
+		thread_local TraceScope* current = nullptr;
+		return current;
+	}
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(...) TraceScope TRACE_CONCAT(traceScope, __LINE__)(__VA_ARGS__)
+#define TRACE_BYTES(bytes) TraceScope::SetBytes(bytes)
+
+#else
+
+#define TRACE_SCOPE(...) do {} while (0)
+#define TRACE_BYTES(bytes) do {} while (0)
+
+#endif
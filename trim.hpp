@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "kernels.hpp"
+#include "loop.hpp"
+#include "trace.hpp"
+
+/*
+ * Leading and trailing silence of a conversion, searched on its output so the tail of
+ * the FIR is kept; a sample counts as silent when its magnitude is at most threshold.
+ * A looping input keeps everything from its loop start on, the loop plan already drops
+ * what comes after the loop end. Input that is silent throughout keeps a single frame.
+ */
+struct SilenceTrim
+{
+    uint64_t skip = 0; //leading frames left out
+    uint64_t frames = 0; //frames kept after them
+
+    /* loop is the plan of the untrimmed input. */
+    template <typename T_Conversion>
+    static SilenceTrim Find(T_Conversion& conv, uint16_t channels, float threshold, const LoopPlan& loop)
+    {
+        TRACE_SCOPE("FindSilence");
+        uint64_t width = std::max<uint16_t>(1, channels);
+        uint64_t total = conv.GetOutSize() / width;
+        uint64_t leading = loop.looped ? std::min(loop.loopStart, total) : total;
+
+        SilenceTrim trim;
+        trim.skip = std::min(FirstLoud(conv, leading * width, threshold) / width, leading);
+        if (trim.skip == total)
+        {
+            trim.skip = 0;
+            trim.frames = std::min<uint64_t>(total, 1);
+            return trim;
+        }
+
+        uint64_t end = loop.looped ? total : LastLoud(conv, trim.skip * width, total * width, threshold) / width + 1;
+        trim.frames = end - trim.skip;
+        return trim;
+    }
+
+private:
+    static constexpr uint64_t WINDOW = 1 << 14;
+
+    static bool Loud(float sample, float threshold) { return !(std::fabs(sample) <= threshold); }
+
+    /* Index of the first loud sample before end, or end. */
+    template <typename T_Conversion>
+    static uint64_t FirstLoud(T_Conversion& conv, uint64_t end, float threshold)
+    {
+        std::vector<float> window(WINDOW);
+        for (uint64_t first = 0; first < end; first += WINDOW)
+        {
+            uint64_t count = std::min(WINDOW, end - first);
+            conv.ConvertRange(first, count, window.data());
+            if (Kernels::Active().quiet(window.data(), count, threshold))
+                continue;
+
+            for (uint64_t i = 0; i < count; i++)
+            {
+                if (Loud(window[i], threshold))
+                    return first + i;
+            }
+        }
+        return end;
+    }
+
+    /* Index of the last loud sample in [begin, end), or begin. */
+    template <typename T_Conversion>
+    static uint64_t LastLoud(T_Conversion& conv, uint64_t begin, uint64_t end, float threshold)
+    {
+        std::vector<float> window(WINDOW);
+        while (end > begin)
+        {
+            uint64_t count = std::min(WINDOW, end - begin);
+            uint64_t first = end - count;
+            conv.ConvertRange(first, count, window.data());
+            if (!Kernels::Active().quiet(window.data(), count, threshold))
+            {
+                for (uint64_t i = count; i-- > 0;)
+                {
+                    if (Loud(window[i], threshold))
+                        return first + i;
+                }
+            }
+            end = first;
+        }
+        return begin;
+    }
+};
+
+/* A conversion with the frames of a SilenceTrim cut off both ends. */
+template <typename T_Conversion>
+class TrimmedConversion
+{
+public:
+    TrimmedConversion(T_Conversion& conv, uint16_t channels, const SilenceTrim& trim) :
+        conv(conv),
+        offset(trim.skip * std::max<uint16_t>(1, channels)),
+        size(trim.frames * std::max<uint16_t>(1, channels))
+    {
+    }
+
+    uint64_t GetOutSize() const { return size; }
+
+    void ConvertRange(uint64_t first, uint64_t count, float* out)
+    {
+        conv.ConvertRange(offset + first, count, out);
+    }
+
+private:
+    T_Conversion& conv;
+    uint64_t offset;
+    uint64_t size;
+};
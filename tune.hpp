@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "benchmark.hpp"
+#include "encoder.hpp"
+#include "kernels.hpp"
+#include "threadpool.hpp"
+
+/*
+ * Tuned settings of one host: worker threads, SIMD kernels and the block counts of the
+ * two phase encode. Stored as key=value lines in <config>/adpcmencoder/<host>.profile, a
+ * zero or empty value leaves the built in default.
+ */
+struct TuneProfile
+{
+    unsigned jobs = 0;
+    std::string kernel;
+    uint64_t analyzeBlocks = 0;
+    uint64_t segmentBlocks = 0;
+
+    /* The profile file of this host, empty when there is no configuration directory. */
+    static std::filesystem::path Path()
+    {
+        std::filesystem::path directory;
+#ifdef _WIN32
+        if (const char* appdata = std::getenv("APPDATA"))
+            directory = appdata;
+#else
+        if (const char* config = std::getenv("XDG_CONFIG_HOME"); config && *config)
+            directory = config;
+        else if (const char* home = std::getenv("HOME"); home && *home)
+            directory = std::filesystem::path(home) / ".config";
+#endif
+        if (directory.empty())
+            return {};
+        return directory / "adpcmencoder" / (HostName() + ".profile");
+    }
+
+    static std::string HostName()
+    {
+        std::string name;
+#ifdef _WIN32
+        if (const char* computer = std::getenv("COMPUTERNAME"))
+            name = computer;
+#else
+        char buffer[256]{};
+        if (gethostname(buffer, sizeof(buffer) - 1) == 0)
+            name = buffer;
+#endif
+        // the name ends up in a file name
+        for (auto& c : name)
+        {
+            if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '.' && c != '_')
+                c = '_';
+        }
+        return name.empty() ? "localhost" : name;
+    }
+
+    static TuneProfile Load(const std::filesystem::path& path)
+    {
+        std::ifstream stream(path);
+        if (!stream.is_open())
+            throw std::runtime_error("Cannot open profile " + path.string());
+
+        TuneProfile profile;
+        std::string line;
+        for (uint64_t number = 1; std::getline(stream, line); number++)
+        {
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            size_t equals = line.find('=');
+            std::string key = line.substr(0, equals);
+            std::string value = equals == std::string::npos ? "" : line.substr(equals + 1);
+            try
+            {
+                if (key == "jobs")
+                    profile.jobs = static_cast<unsigned>(std::stoul(value));
+                else if (key == "kernel")
+                    profile.kernel = value;
+                else if (key == "analyze-blocks")
+                    profile.analyzeBlocks = std::stoull(value);
+                else if (key == "segment-blocks")
+                    profile.segmentBlocks = std::stoull(value);
+                else if (key == "convert-block")
+                    continue; // written by earlier versions, which tuned a path plain encodes do not take
+                else
+                    throw std::invalid_argument(key);
+            }
+            catch (const std::logic_error&)
+            {
+                throw std::runtime_error("Malformed line " + std::to_string(number) + " in profile " + path.string());
+            }
+        }
+        return profile;
+    }
+
+    void Save(const std::filesystem::path& path) const
+    {
+        std::filesystem::create_directories(path.parent_path());
+        std::ofstream stream(path);
+        if (!stream.is_open())
+            throw std::runtime_error("Cannot write profile " + path.string());
+
+        std::time_t now = std::time(nullptr);
+        stream << "# ADPCMEncoder --autotune of " << HostName() << ", " << std::put_time(std::localtime(&now), "%Y-%m-%d %H:%M") << "\n"
+            << "jobs=" << jobs << "\n"
+            << "kernel=" << kernel << "\n"
+            << "analyze-blocks=" << analyzeBlocks << "\n"
+            << "segment-blocks=" << segmentBlocks << "\n";
+        if (!stream)
+            throw std::runtime_error("Cannot write profile " + path.string());
+    }
+
+    /* Makes the settings of the profile the current ones, before the shared pool is used. */
+    void Apply(bool keepJobs, bool keepKernel) const
+    {
+        if (jobs && !keepJobs)
+            ThreadPool::SetDefaultThreads(jobs);
+        if (!kernel.empty() && !keepKernel)
+            Kernels::Select(kernel);
+        if (analyzeBlocks)
+            VagEncodeSettings::analyzeBlocks = analyzeBlocks;
+        if (segmentBlocks)
+            VagEncodeSettings::segmentBlocks = segmentBlocks;
+    }
+};
+
+/*
+ * Times calibration runs over the settings in a TuneProfile and saves the fastest ones.
+ * The workload is a batch of short synthetic 16 bit stereo inputs plus one long one,
+ * encoded concurrently with the FIR on through Encoder::EncodeVag, the fused path of a
+ * plain encode, so both the parallelism across files and the two phase encode within a
+ * file are exercised. The kernels are timed first, then the thread counts, then the
+ * analysis and segment block counts, each with the best of the previous ones. A setting
+ * given on the command line is kept.
+ */
+class AutoTune
+{
+public:
+    AutoTune() = delete;
+    AutoTune(const AutoTune&) = delete;
+
+    AutoTune(bool keepJobs, bool keepKernel) :
+        keepJobs(keepJobs),
+        keepKernel(keepKernel)
+    {
+    }
+
+    void Execute()
+    {
+        std::filesystem::path path = TuneProfile::Path();
+        if (path.empty())
+            throw std::runtime_error("No configuration directory to store the profile in, set HOME or XDG_CONFIG_HOME");
+
+        Generate();
+
+        TuneProfile best;
+        best.jobs = ThreadPool::Shared().GetThreadCount();
+        best.kernel = Kernels::SelectedName();
+        best.analyzeBlocks = VagEncodeSettings::analyzeBlocks;
+        best.segmentBlocks = VagEncodeSettings::segmentBlocks;
+
+        Run(); // warm up the pool and the caches
+
+        if (!keepKernel)
+        {
+            std::vector<std::string> names;
+            for (auto table : Kernels::Supported())
+                names.push_back(table->name);
+            best.kernel = Search("kernel", names, best.kernel, [](const std::string& name) { Kernels::Select(name); });
+        }
+
+        if (!keepJobs)
+        {
+            std::vector<unsigned> counts;
+            unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned count = 1; count < hardware; count *= 2)
+                counts.push_back(count);
+            counts.push_back(hardware);
+            best.jobs = Search("jobs", counts, best.jobs, [](unsigned count) { ThreadPool::RestartShared(count); });
+        }
+
+        std::vector<uint64_t> analyze = { 16, 32, 64, 128, 256 };
+        best.analyzeBlocks = Search("analyze-blocks", analyze, best.analyzeBlocks, [](uint64_t count) { VagEncodeSettings::analyzeBlocks = count; });
+
+        std::vector<uint64_t> segments = { 256, 1024, 4096 };
+        best.segmentBlocks = Search("segment-blocks", segments, best.segmentBlocks, [](uint64_t count) { VagEncodeSettings::segmentBlocks = count; });
+
+        best.Save(path);
+        std::cout << "Profile written to " << path.string() << ": " << best.jobs << " jobs, " << best.kernel
+            << " kernels, " << best.analyzeBlocks << " blocks per analysis task, " << best.segmentBlocks << " blocks per segment\n";
+    }
+
+private:
+    static constexpr uint32_t SHORTSECONDS = 2;
+    static constexpr uint32_t LONGSECONDS = 30;
+    static constexpr int ROUNDS = 3;
+    static constexpr double MARGIN = 1.02; //how much faster than the current setting another one has to be
+
+    bool keepJobs;
+    bool keepKernel;
+    std::vector<std::unique_ptr<File>> inputs;
+    uint64_t bytes = 0;
+
+    /* Loads the synthetic inputs, two short ones per hardware thread within 8 to 64. */
+    void Generate()
+    {
+        std::filesystem::path directory = std::filesystem::temp_directory_path() / ("adpcmencoder-tune-" + std::to_string(Benchmark::ProcessId()));
+        std::filesystem::create_directories(directory);
+
+        try
+        {
+            uint64_t count = std::clamp<uint64_t>(2ull * std::thread::hardware_concurrency(), 8, 64);
+            for (uint64_t i = 0; i <= count; i++)
+            {
+                Benchmark::CorpusCase input{ 2, 48000, static_cast<double>(i == count ? LONGSECONDS : SHORTSECONDS) };
+                std::string file = (directory / ("tune-" + std::to_string(i) + ".wav")).string();
+                bytes += Benchmark::GenerateInput(Benchmark::formats[1], input, 1, static_cast<uint32_t>(i), file);
+                inputs.push_back(Encoder::LoadInput(file, Encoder::WAVTYPE));
+            }
+        }
+        catch (...)
+        {
+            std::filesystem::remove_all(directory);
+            throw;
+        }
+        std::filesystem::remove_all(directory);
+    }
+
+    /* Seconds for one pass over the inputs, the long one first so it does not trail. */
+    double Run()
+    {
+        auto start = std::chrono::steady_clock::now();
+        ThreadPool::Shared().ParallelFor(inputs.size(), [this](uint64_t i) {
+            const File& file = *inputs[inputs.size() - 1 - i];
+            Encoder::ConversionType conversion = Encoder::CreateConversion(file, true);
+            Encoder::EncodeVag(file, conversion, "", EncodeOptions{});
+        });
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    /*
+     * Applies every candidate in turn, leaves the fastest one applied and returns it. The
+     * current setting is kept unless another one beats it by MARGIN.
+     */
+    template <typename T_Value, typename Apply>
+    T_Value Search(const std::string& setting, const std::vector<T_Value>& candidates, const T_Value& current, Apply&& apply)
+    {
+        std::vector<double> times;
+        for (auto& candidate : candidates)
+        {
+            apply(candidate);
+            double seconds = Run();
+            for (int round = 1; round < ROUNDS; round++)
+                seconds = std::min(seconds, Run());
+            times.push_back(seconds);
+
+            std::cout << std::left << std::setw(16) << setting << std::setw(10) << candidate << std::right << std::fixed << std::setprecision(1)
+                << std::setw(10) << bytes / seconds / (1024.0 * 1024.0) << " MB/s\n";
+        }
+
+        size_t fastest = std::min_element(times.begin(), times.end()) - times.begin();
+        auto kept = std::find(candidates.begin(), candidates.end(), current);
+        T_Value best = kept != candidates.end() && times[kept - candidates.begin()] <= times[fastest] * MARGIN ? current : candidates[fastest];
+        apply(best);
+        return best;
+    }
+};
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
 #include <cmath>
+#include <filesystem>
 #include <fstream>
 #ifdef _MSC_VER
 #include <intrin.h>
@@ -12,20 +14,97 @@
 #include <iostream>
 #include <iterator>
 #include <limits>
+#include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "counters.hpp"
+#include "kernels.hpp"
+#include "threadpool.hpp"
+#include "trace.hpp"
 
 struct vagfile_header_t;
 typedef struct vagfile_header_t VagFileHeader;
 struct vagfile_holder_t;
 typedef struct vagfile_holder_t VagFile;
 
-static float enclut[5][2] = {{0.0, 0.0},
-                             {-60.0 / 64.0, 0.0},
-                             {-115.0 / 64.0, 52.0 / 64.0},
-                             {-98.0 / 64.0, 55.0 / 64.0},
-                             {-122.0 / 64.0, 60.0 / 64.0}};
+constexpr float enclut[5][2] = {{0.0, 0.0},
+                                {-60.0 / 64.0, 0.0},
+                                {-115.0 / 64.0, 52.0 / 64.0},
+                                {-98.0 / 64.0, 55.0 / 64.0},
+                                {-122.0 / 64.0, 60.0 / 64.0}};
+
+constexpr int VAG_PREDICTORS = 5;
+constexpr int VAG_SHIFTS = 13;
+constexpr int VAG_BLOCK_SAMPLES = 28;
+constexpr int VAG_BLOCK_SIZE = 16;
+constexpr int VAG_FUSED_WINDOW = 16 * VAG_BLOCK_SAMPLES;
+
+/* Runtime settings of the two phase encode, tuned by --autotune. */
+struct VagEncodeSettings
+{
+    static inline uint64_t analyzeBlocks = 64; //blocks one pool task analyzes
+    static inline uint64_t segmentBlocks = 1024; //blocks quantized while the next ones are analyzed
+};
+
+static_assert(VAG_BLOCK_SAMPLES == kernels::ANALYZE_SAMPLES, "analyze kernels work on whole VAG blocks");
+
+constexpr float VagClampInput(float sample)
+{
+    return std::min(std::max(sample, -30720.0f), 30719.0f);
+}
+
+/*
+ * Quantization kernels specialized per predictor and shift so the coefficients and the
+ * shift multiplier fold into immediates. Predictor 0 degenerates into a plain copy of the
+ * residual. The predictor search before it runs through the dispatched analyze kernel.
+ */
+template <int Predict>
+struct VagBlockKernel
+{
+    static constexpr float coef0 = enclut[Predict][0];
+    static constexpr float coef1 = enclut[Predict][1];
+
+    template <int Shift>
+    static constexpr void Quantize(const float *residual, float &hist_1, float &hist_2, int16_t *outBuf)
+    {
+        constexpr float power2 = static_cast<float>(1u << Shift);
+        for (int k = 0; k < VAG_BLOCK_SAMPLES; k++)
+        {
+            float s_double_trans = residual[k];
+            if constexpr (Predict != 0)
+                s_double_trans = residual[k] + hist_1 * coef0 + hist_2 * coef1;
+
+            float s_double = s_double_trans * power2;
+            int sample = (int)(((int)s_double + 0x800) & 0xFFFFF000);
+            sample = std::min(std::max(sample, static_cast<int>(std::numeric_limits<int16_t>::min())),
+                static_cast<int>(std::numeric_limits<int16_t>::max()));
+
+            outBuf[k] = static_cast<int16_t>(sample);
+
+            sample >>= Shift;
+            hist_2 = hist_1;
+            hist_1 = sample - s_double_trans;
+        }
+    }
+};
+
+using VagQuantizeFn = void (*)(const float *, float &, float &, int16_t *);
+
+template <int Predict, size_t... Shift>
+constexpr std::array<VagQuantizeFn, sizeof...(Shift)> MakeVagQuantizeRow(std::index_sequence<Shift...>)
+{
+    return {{&VagBlockKernel<Predict>::template Quantize<Shift>...}};
+}
+
+template <size_t... Predict>
+constexpr std::array<std::array<VagQuantizeFn, VAG_SHIFTS>, sizeof...(Predict)> MakeVagQuantizeTable(std::index_sequence<Predict...>)
+{
+    return {{MakeVagQuantizeRow<Predict>(std::make_index_sequence<VAG_SHIFTS>{})...}};
+}
+
+constexpr std::array<std::array<VagQuantizeFn, VAG_SHIFTS>, VAG_PREDICTORS> vagQuantizeTable = MakeVagQuantizeTable(std::make_index_sequence<VAG_PREDICTORS>{});
 
 enum VAGFlag
 {
@@ -47,6 +126,172 @@ typedef struct enc_block_t
     uint8_t sample[14];
 } EncBlock;
 
+/*
+ * What the analysis of a block hands to its quantization: predictor, shift and the
+ * residual of that predictor, or for a silent block the clamped block itself.
+ */
+struct VagBlockPlan
+{
+    float residual[VAG_BLOCK_SAMPLES];
+    int8_t predict;
+    int8_t shift;
+    bool silent;
+};
+
+/*
+ * Encoder state carried from one 28 sample block to the next: the input history the
+ * predictor search runs from, and the quantization error fed back into the next block.
+ * The two are independent, so a block can be analyzed (Analyze, which only moves the
+ * input history) well ahead of being quantized (Quantize, which only moves the error).
+ *
+ * Blocks with no sample above silence skip the search and are written as the block the
+ * search settles on for digital silence, predictor 0 at shift 12 with all nibbles zero.
+ * At the default of 0 that is exactly what the full path produces; a higher threshold
+ * also flattens near silent blocks to zero.
+ */
+struct VagBlockEncoder
+{
+    float _hist_1 = 0.0, _hist_2 = 0.0;
+    float hist_1 = 0.0, hist_2 = 0.0;
+    float silence = 0.0;
+
+    template <typename T_Sample>
+    void EncodeBlock(const T_Sample *chunk, uint8_t flags, uint8_t *outBuffer)
+    {
+        VagBlockPlan plan;
+        Analyze(chunk, plan);
+        Quantize(plan, flags, outBuffer);
+    }
+
+    /* Clamps a block and picks its predictor and shift, from the input history alone. */
+    template <typename T_Sample>
+    void Analyze(const T_Sample *chunk, VagBlockPlan &plan)
+    {
+        float clamped[VAG_BLOCK_SAMPLES];
+        for (int k = 0; k < VAG_BLOCK_SAMPLES; k++)
+            clamped[k] = VagClampInput(static_cast<float>(chunk[k]));
+
+        if (Kernels::Active().quiet(clamped, VAG_BLOCK_SAMPLES, silence))
+        {
+            _hist_1 = clamped[VAG_BLOCK_SAMPLES - 1];
+            _hist_2 = clamped[VAG_BLOCK_SAMPLES - 2];
+            std::copy_n(clamped, VAG_BLOCK_SAMPLES, plan.residual);
+            plan.silent = true;
+            return;
+        }
+
+        float residual[VAG_PREDICTORS * VAG_BLOCK_SAMPLES];
+        float maxima[VAG_PREDICTORS];
+        Kernels::Active().analyze(clamped, _hist_1, _hist_2, enclut, VAG_PREDICTORS, residual, maxima);
+        Plan(clamped, residual, maxima, plan);
+    }
+
+    /* Quantizes and writes an analyzed block; blocks have to come in stream order. */
+    constexpr void Quantize(const VagBlockPlan &plan, uint8_t flags, uint8_t *outBuffer)
+    {
+        if (plan.silent)
+        {
+            EncodeSilentBlock(plan.residual, flags, outBuffer);
+            return;
+        }
+
+        EncBlock block{0, 0, 0, {0}};
+        block.predict = plan.predict;
+        block.shift = plan.shift;
+        block.flags = flags;
+
+        int16_t outBuf[VAG_BLOCK_SAMPLES]{};
+        vagQuantizeTable[plan.predict][plan.shift](plan.residual, hist_1, hist_2, outBuf);
+
+        for (int k = 0; k < 14; k++)
+        {
+            block.sample[k] = static_cast<uint8_t>((((outBuf[(k * 2) + 1] >> 8) & 0xf0) | ((outBuf[k * 2] >> 12) & 0xf)));
+        }
+
+        int8_t lastPredictAndShift = static_cast<int8_t>(((block.predict << 4) & 0xF0) | (block.shift & 0x0F));
+        *outBuffer++ = lastPredictAndShift;
+        *outBuffer++ = block.flags;
+        for (int h = 0; h < 14; h++)
+            *outBuffer++ = block.sample[h];
+    }
+
+    /*
+     * EncodeBlock through the scalar analyze kernel and without the silence shortcut, which
+     * leaves the output as it is at the default threshold; usable in constant expressions.
+     */
+    template <typename T_Sample>
+    constexpr void EncodeBlockScalar(const T_Sample *chunk, uint8_t flags, uint8_t *outBuffer)
+    {
+        float clamped[VAG_BLOCK_SAMPLES]{};
+        for (int k = 0; k < VAG_BLOCK_SAMPLES; k++)
+            clamped[k] = VagClampInput(static_cast<float>(chunk[k]));
+
+        float residual[VAG_PREDICTORS * VAG_BLOCK_SAMPLES]{};
+        float maxima[VAG_PREDICTORS]{};
+        kernels::AnalyzeScalar(clamped, _hist_1, _hist_2, enclut, VAG_PREDICTORS, residual, maxima);
+        VagBlockPlan plan{};
+        Plan(clamped, residual, maxima, plan);
+        Quantize(plan, flags, outBuffer);
+    }
+
+private:
+    /* Picks predictor and shift from the residuals and peaks of all predictors. */
+    constexpr void Plan(const float *clamped, const float *residual, const float *maxima, VagBlockPlan &plan)
+    {
+        int predict = 0, shift = 0;
+        float min = 1e10;
+        for (int j = 0; j < VAG_PREDICTORS; j++)
+        {
+            float max = maxima[j];
+
+            if (max < min)
+            {
+                min = max;
+                predict = j;
+            }
+            if (min <= 7)
+            {
+                predict = 0;
+                break;
+            }
+        }
+
+        _hist_1 = clamped[VAG_BLOCK_SAMPLES - 1];
+        _hist_2 = clamped[VAG_BLOCK_SAMPLES - 2];
+
+        int min2 = static_cast<int>(min);
+        int shift_mask = 0x4000;
+        shift = 0;
+
+        while (shift < 12)
+        {
+            if (shift_mask & (min2 + (shift_mask >> 3)))
+            {
+                break;
+            }
+            shift++;
+            shift_mask >>= 1;
+        }
+        plan.predict = static_cast<int8_t>(predict);
+        plan.shift = static_cast<int8_t>(shift);
+        plan.silent = false;
+        for (int k = 0; k < VAG_BLOCK_SAMPLES; k++)
+            plan.residual[k] = residual[predict * VAG_BLOCK_SAMPLES + k];
+    }
+
+    /* The state the predictor 0 quantization leaves behind when every sample rounds to 0. */
+    constexpr void EncodeSilentBlock(const float *clamped, uint8_t flags, uint8_t *outBuffer)
+    {
+        hist_1 = 0.0f - clamped[VAG_BLOCK_SAMPLES - 1];
+        hist_2 = 0.0f - clamped[VAG_BLOCK_SAMPLES - 2];
+
+        *outBuffer++ = VAG_SHIFTS - 1;
+        *outBuffer++ = flags;
+        for (int h = 2; h < VAG_BLOCK_SIZE; h++)
+            *outBuffer++ = 0;
+    }
+};
+
 struct vagfile_header_t
 {
     uint8_t magic[4];
@@ -64,9 +309,12 @@ struct vagfile_holder_t
 {
     struct vagfile_header_t header{};
     std::vector<uint8_t> samples;
+    std::string path;
 
-    vagfile_holder_t(uint32_t sampleRate, uint16_t channels, std::string filename)
+    /* filename is where WriteVagFile writes; the header names only its last component. */
+    vagfile_holder_t(uint32_t sampleRate, uint16_t channels, std::string filename) : path(filename)
     {
+        filename = std::filesystem::path(filename).filename().string();
         header.magic[0] = 'V';
         header.magic[1] = 'A';
         header.magic[2] = 'G';
@@ -80,182 +328,219 @@ struct vagfile_holder_t
 
     void WriteVagFile()
     {
-        std::ofstream stream(reinterpret_cast<char*>(header.filename), std::ios::binary);
+        TRACE_SCOPE("WriteVagFile", path);
+        TRACE_BYTES(samples.size());
+        COUNTER_SCOPE(WRITE);
+        std::ofstream stream(path, std::ios::binary);
+
+        if (!stream.is_open())
+            throw std::runtime_error("Cannot open VAG output file " + path);
+
         size_t size = samples.size();
-        stream.write(reinterpret_cast<char *>(&header), sizeof(VagFileHeader));
-        char pad[16] = {0};
-        stream.write(&pad[0], 16);
+        WriteHeader(stream);
         stream.write(reinterpret_cast<char *>(samples.data()), size);
         stream.close();
     }
 
-    void CreateVagSamples(int16_t *insamples, uint64_t len, uint32_t loopStart, uint32_t loopEnd, bool loopFlag, uint32_t channels)
+    /* The whole file as WriteVagFile writes it, for writers that take a buffer. */
+    std::vector<uint8_t> GetImage() const
     {
-        float _hist_1 = 0.0, _hist_2 = 0.0;
-        float hist_1 = 0.0, hist_2 = 0.0;
-
-        int fullChunks = static_cast<int>(len / 28);
-        int remaining = (fullChunks % 28);
-        constexpr uint32_t sizeOfWrite = 16;
-        if (remaining)
-        {
-            fullChunks++;
-        }
-
-        int sizeOfOut = fullChunks * sizeOfWrite;
+        std::vector<uint8_t> image(sizeof(VagFileHeader) + 16 + samples.size());
+        std::copy_n(reinterpret_cast<const uint8_t *>(&header), sizeof(VagFileHeader), image.data());
+        std::copy(samples.begin(), samples.end(), image.begin() + sizeof(VagFileHeader) + 16);
+        return image;
+    }
 
+    /*
+     * Exact size of the ADPCM data CreateVagSamples produces for len input samples:
+     * one 16 byte block per 28 samples, plus the terminating block when not looping.
+     */
+    static constexpr uint64_t PredictSize(uint64_t len, bool loopFlag)
+    {
+        uint64_t blocks = (len + VAG_BLOCK_SAMPLES - 1) / VAG_BLOCK_SAMPLES;
         if (!loopFlag)
-            sizeOfOut += sizeOfWrite;
+            blocks++;
+        return blocks * VAG_BLOCK_SIZE;
+    }
 
-        samples.resize(sizeOfOut);
+    /*
+     * Without a loop only the last block is marked. With one, the blocks before loopStart
+     * play once, loopStart sets the loop address, and the end block, loopEnd or the last
+     * one, jumps back to it.
+     */
+    static constexpr uint8_t BlockFlags(uint64_t block, uint64_t len, uint32_t loopStart, uint32_t loopEnd, bool loopFlag)
+    {
+        bool last = len - block * VAG_BLOCK_SAMPLES <= VAG_BLOCK_SAMPLES;
+        if (!loopFlag)
+            return last ? VAGF_LOOP_LAST_BLOCK : VAGF_NOTHING;
+        if (last || block == loopEnd)
+            return VAGF_LOOP_END;
+        if (block == loopStart)
+            return VAGF_LOOP_START;
+        return block > loopStart ? VAGF_LOOP_REGION : VAGF_NOTHING;
+    }
 
-        auto outBuffer = samples.begin();
+    template <typename T_Sample>
+    void CreateVagSamples(const T_Sample *insamples, uint64_t len, uint32_t loopStart, uint32_t loopEnd, bool loopFlag, uint32_t channels)
+    {
+        samples.resize(PredictSize(len, loopFlag));
+        EncodeSamples(insamples, len, loopStart, loopEnd, loopFlag, samples.data());
+        SetDataLength();
+    }
 
-        uint32_t bytesRead = 0;
-        EncBlock block{0, 0, 0, {0}};
-        for (int i = 0; i < fullChunks; i++)
-        {
+    /* Encodes len samples into outBuffer, which has to hold PredictSize(len, loopFlag) bytes. */
+    template <typename T_Sample>
+    static void EncodeSamples(const T_Sample *insamples, uint64_t len, uint32_t loopStart, uint32_t loopEnd, bool loopFlag, uint8_t *outBuffer)
+    {
+        TRACE_SCOPE("CreateVagSamples");
+        EncodeSource<T_Sample>([insamples](uint64_t first, uint64_t count, T_Sample *window) {
+            std::copy_n(insamples + first, count, window);
+        }, len, loopStart, loopEnd, loopFlag, outBuffer);
+    }
 
-            int chunkSize = 28;
-            if (i == fullChunks - 1)
-            {
-                chunkSize = remaining;
-            }
-            int predict = 0, shift;
-            float min = 1e10;
-            float s_1 = 0.0, s_2 = 0.0;
-            float predictBuf[28][5];
-            for (int j = 0; j < 5; j++)
-            {
-                float max = 0.0;
+    /*
+     * Encodes len samples without an intermediate buffer of the whole stream: source(first,
+     * count, window) fills a small window of samples which is analyzed before the next one is
+     * requested, so the data stays in cache between conversion and encoding. The source is
+     * called from several pool threads at once, for different ranges.
+     */
+    template <typename T_Sample, typename Source>
+    void EncodeFromSource(Source &&source, uint64_t len, uint32_t loopStart, uint32_t loopEnd, bool loopFlag)
+    {
+        samples.resize(PredictSize(len, loopFlag));
+        EncodeSource<T_Sample>(std::forward<Source>(source), len, loopStart, loopEnd, loopFlag, samples.data());
+        SetDataLength();
+    }
 
-                s_1 = _hist_1;
-                s_2 = _hist_2;
+    /* EncodeFromSource into outBuffer, which has to hold PredictSize(len, loopFlag) bytes. */
+    template <typename T_Sample, typename Source>
+    static void EncodeSource(Source &&source, uint64_t len, uint32_t loopStart, uint32_t loopEnd, bool loopFlag, uint8_t *outBuffer)
+    {
+        EncodeSourceBlocks<T_Sample>([](uint64_t) {}, std::forward<Source>(source), len, loopStart, loopEnd, loopFlag, [&outBuffer](const uint8_t *blocks, uint64_t size) {
+            outBuffer = std::copy_n(blocks, size, outBuffer);
+        });
+    }
 
-                for (int k = 0; k < chunkSize; k++)
-                {
-                    float sample = insamples[k];
-                    if (sample > 30719.0)
-                    {
-                        sample = 30719.0;
-                    }
-                    if (sample < -30720.0)
-                    {
-                        sample = -30720.0;
-                    }
-
-                    float ds = sample + s_1 * enclut[j][0] + s_2 * enclut[j][1];
-
-                    predictBuf[k][j] = ds;
-
-                    if (fabs(ds) > max)
-                    {
-                        max = fabs(ds);
-                    }
-
-                    s_2 = s_1;
-                    s_1 = sample;
-                }
-                if (max < min)
-                {
-                    min = max;
-                    predict = j;
-                }
-                if (min <= 7)
+    /*
+     * EncodeSource in two phases. The predictor and shift of a block depend on the input
+     * alone, so the analysis runs on the pool over ranges of VagEncodeSettings::analyzeBlocks,
+     * each starting from the two input samples before it. Only the quantization feeds its
+     * error into the next block; it goes through the blocks in order a segment at a time, while
+     * the pool analyzes the next segment. prefetch(end) is called on the calling thread
+     * before samples below end are requested, and sink(blocks, size) gets the encoded
+     * blocks of every segment there, so the output can be written out while the input is
+     * still arriving.
+     */
+    template <typename T_Sample, typename Prefetch, typename Source, typename Sink>
+    static void EncodeSourceBlocks(Prefetch &&prefetch, Source &&source, uint64_t len, uint32_t loopStart, uint32_t loopEnd, bool loopFlag, Sink &&sink, float silence = 0.0f)
+    {
+        TRACE_SCOPE("ConvertAndEncode");
+        TRACE_BYTES(len * sizeof(T_Sample));
+        uint64_t blocks = (len + VAG_BLOCK_SAMPLES - 1) / VAG_BLOCK_SAMPLES;
+        uint64_t segmentSize = std::max<uint64_t>(1, VagEncodeSettings::segmentBlocks);
+        uint64_t analyzeSize = std::max<uint64_t>(1, VagEncodeSettings::analyzeBlocks);
+        uint64_t segments = (blocks + segmentSize - 1) / segmentSize;
+        uint64_t capacity = std::min(blocks, segmentSize);
+
+        // one segment is analyzed into one set of plans while the other is quantized
+        std::vector<VagBlockPlan> plans[2] = { std::vector<VagBlockPlan>(capacity), std::vector<VagBlockPlan>(capacity) };
+        std::vector<uint8_t> encoded(std::max(capacity, uint64_t{ 1 }) * VAG_BLOCK_SIZE);
+        VagBlockEncoder quantizer;
+
+        for (uint64_t segment = 0; segment <= segments; segment++)
+        {
+            uint64_t first = segment * segmentSize;
+            uint64_t count = segment < segments ? std::min(segmentSize, blocks - first) : 0;
+            uint64_t previous = segment ? std::min(segmentSize, blocks - (first - segmentSize)) : 0;
+            uint64_t tasks = (count + analyzeSize - 1) / analyzeSize;
+            VagBlockPlan *analyzed = plans[segment & 1].data();
+            const VagBlockPlan *planned = plans[(segment + 1) & 1].data();
+
+            if (count)
+                prefetch(std::min(len, (first + count) * VAG_BLOCK_SAMPLES));
+
+            // task 0 quantizes the previous segment, the others analyze this one
+            ThreadPool::Shared().ParallelFor(tasks + 1, [&](uint64_t task) {
+                if (!task)
                 {
-                    predict = 0;
-                    break;
+                    COUNTER_SCOPE(ENCODE);
+                    uint64_t block = first - segmentSize;
+                    for (uint64_t b = 0; b < previous; b++)
+                        quantizer.Quantize(planned[b], BlockFlags(block + b, len, loopStart, loopEnd, loopFlag), encoded.data() + b * VAG_BLOCK_SIZE);
+                    return;
                 }
-            }
-            
-            _hist_1 = s_1;
-            _hist_2 = s_2;
 
-            float d_samples[28];
-            for (int i = 0; i < 28; i++)
-            {
-                d_samples[i] = predictBuf[i][predict];
-            }
+                uint64_t begin = first + (task - 1) * analyzeSize;
+                uint64_t end = std::min(first + count, begin + analyzeSize);
+                AnalyzeBlocks<T_Sample>(source, begin, end, len, silence, analyzed + (begin - first));
+            });
 
-            int min2 = static_cast<int>(min);
-            int shift_mask = 0x4000;
-            shift = 0;
+            if (previous)
+                sink(static_cast<const uint8_t *>(encoded.data()), previous * VAG_BLOCK_SIZE);
+        }
 
-            while (shift < 12)
-            {
-                if (shift_mask & (min2 + (shift_mask >> 3)))
-                {
-                    break;
-                }
-                shift++;
-                shift_mask >>= 1;
-            }
-            block.predict = predict;
-            block.shift = shift;
+        if (!loopFlag)
+        {
+            WriteTerminator(encoded.data(), loopFlag);
+            sink(static_cast<const uint8_t *>(encoded.data()), static_cast<uint64_t>(VAG_BLOCK_SIZE));
+        }
+    }
 
-            if (len - bytesRead > 28)
-            {
-                block.flags = VAGF_NOTHING;
-                if (loopFlag)
-                {
-                    block.flags = VAGF_LOOP_REGION;
-                    if (i == loopStart)
-                    {
-                        block.flags = VAGF_LOOP_START;
-                    }
-                    if (i == loopEnd)
-                    {
-                        block.flags = VAGF_LOOP_END;
-                    }
-                }
-            }
-            else
-            {
-                block.flags = VAGF_LOOP_LAST_BLOCK;
-                if (loopFlag)
-                {
-                    block.flags = VAGF_LOOP_END;
-                }
-            }
+    /* Analyzes blocks [begin, end) of a len sample stream into plans, window by window. */
+    template <typename T_Sample, typename Source>
+    static void AnalyzeBlocks(Source &source, uint64_t begin, uint64_t end, uint64_t len, float silence, VagBlockPlan *plans)
+    {
+        VagBlockEncoder encoder;
+        encoder.silence = silence;
 
-            int16_t outBuf[28];
-            uint32_t power2 = (1 << shift);
-            for (int k = 0; k < 28; k++)
-            {
-                float s_double_trans = d_samples[k] + hist_1 * enclut[predict][0] + hist_2 * enclut[predict][1];
-                float s_double = s_double_trans * power2;
-                int sample = (int)(((int)s_double + 0x800) & 0xFFFFF000);
+        T_Sample window[VAG_FUSED_WINDOW];
+        if (begin)
+        {
+            source(begin * VAG_BLOCK_SAMPLES - 2, 2, window);
+            encoder._hist_1 = VagClampInput(static_cast<float>(window[1]));
+            encoder._hist_2 = VagClampInput(static_cast<float>(window[0]));
+        }
 
-                if (sample > std::numeric_limits<int16_t>::max())
-                {
-                    sample = std::numeric_limits<int16_t>::max();
-                }
-                if (sample < std::numeric_limits<int16_t>::min())
-                {
-                    sample = std::numeric_limits<int16_t>::min();
-                }
+        for (uint64_t block = begin; block < end; block += VAG_FUSED_WINDOW / VAG_BLOCK_SAMPLES)
+        {
+            uint64_t first = block * VAG_BLOCK_SAMPLES;
+            uint64_t count = std::min<uint64_t>(std::min<uint64_t>(VAG_FUSED_WINDOW, (end - block) * VAG_BLOCK_SAMPLES), len - first);
+            source(first, count, window);
 
-                outBuf[k] = static_cast<int16_t>(sample);
+            uint64_t windowBlocks = (count + VAG_BLOCK_SAMPLES - 1) / VAG_BLOCK_SAMPLES;
+            std::fill(window + count, window + windowBlocks * VAG_BLOCK_SAMPLES, T_Sample{});
 
-                sample >>= shift;
-                hist_2 = hist_1;
-                hist_1 = sample - s_double_trans;
-            }
+            COUNTER_SCOPE(ENCODE);
+            for (uint64_t b = 0; b < windowBlocks; b++)
+                encoder.Analyze(window + b * VAG_BLOCK_SAMPLES, plans[block - begin + b]);
+        }
+    }
 
-            for (int k = 0; k < 14; k++)
-            {
-                block.sample[k] = static_cast<uint8_t>((((outBuf[(k * 2) + 1] >> 8) & 0xf0) | ((outBuf[k * 2] >> 12) & 0xf)));
-            }
+    /* Stores the size of samples in the header once they have been encoded. */
+    void SetDataLength()
+    {
+        SetDataLength(samples.size());
+    }
 
-            insamples += 28;
-            int8_t lastPredictAndShift = static_cast<int8_t>(((block.predict << 4) & 0xF0) | (block.shift & 0x0F));
-            *outBuffer++ = lastPredictAndShift;
-            *outBuffer++ = block.flags;
-            for (int h = 0; h < 14; h++)
-                *outBuffer++ = block.sample[h];
-            bytesRead += chunkSize;
-        }
+    /* Stores a data size up front, for output that is written while it is encoded. */
+    void SetDataLength(uint64_t size)
+    {
+        if (size > std::numeric_limits<uint32_t>::max())
+            throw std::runtime_error("VAG data exceeds the 4 GB limit of the VAG header");
 
+        header.dataLength = BYTESWAP(static_cast<uint32_t>(size));
+    }
+
+    /* Writes the header and the 16 bytes of padding that come before the ADPCM data. */
+    void WriteHeader(std::ostream &stream) const
+    {
+        char pad[16] = {0};
+        stream.write(reinterpret_cast<const char *>(&header), sizeof(VagFileHeader));
+        stream.write(&pad[0], 16);
+    }
+
+    static constexpr void WriteTerminator(uint8_t *outBuffer, bool loopFlag)
+    {
         if (!loopFlag)
         {
             *outBuffer++ = 0;
@@ -263,7 +548,5 @@ struct vagfile_holder_t
             for (int h = 0; h < 14; h++)
                 *outBuffer++ = 0;
         }
-
-        header.dataLength = BYTESWAP(samples.size());
     }
 };
\ No newline at end of file
@@ -0,0 +1,346 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "threadpool.hpp"
+#include "trace.hpp"
+#include "vag.hpp"
+
+struct vagindex_header_t;
+typedef struct vagindex_header_t VagIndexHeader;
+
+/* Sidecar index header, little endian like the bank format. */
+struct vagindex_header_t
+{
+    uint8_t magic[4];
+    uint32_t version;
+    uint32_t interval;
+    uint32_t count;
+    uint64_t vagSize;
+    uint64_t blocks;
+    uint64_t dataHash; //64 bit FNV-1a of the VAG header and of sampled blocks around checkpoints
+};
+
+static_assert(sizeof(VagIndexHeader) == 40, "index header has to stay 40 bytes");
+
+/*
+ * Random access decoder for VAGp files. A block only decodes correctly from the two
+ * samples before it, so the decoder keeps a sparse index of that history every interval
+ * blocks; a range is then decoded from the checkpoint before it instead of from the
+ * start of the file. The index is built on the thread pool or loaded from a sidecar
+ * file (<vag>.idx) written by an earlier run. Only the blocks a range needs are read
+ * from the file, so with an index a seek costs the range and at most one interval.
+ *
+ * Multi-channel VAGp files hold one interleaved stream, so positions are frames and
+ * the output is interleaved like the input of the encoder. VAG headers do not record
+ * the input length, so the frame count is that of the whole blocks: the zero padding of
+ * the last block, up to 27 samples, decodes as silence at the end.
+ */
+class VagDecoder
+{
+public:
+    static constexpr uint32_t DEFAULT_INTERVAL = 256;
+    static constexpr uint32_t INDEX_VERSION = 3;
+    static constexpr uint64_t HASH_SAMPLES = 64; //checkpoints whose surrounding blocks the index hash covers
+
+    struct Checkpoint
+    {
+        int16_t hist_1;
+        int16_t hist_2;
+    };
+
+    VagDecoder() = delete;
+    VagDecoder(const VagDecoder&) = delete;
+
+    explicit VagDecoder(std::string path) :
+        path(path)
+    {
+        Load();
+    }
+
+    uint32_t GetSampleRate() const { return samplerate; }
+
+    uint16_t GetChannels() const { return channels; }
+
+    uint64_t GetBlockCount() const { return blocks; }
+
+    /* Frames in the whole blocks, which includes the padding of the last one. */
+    uint64_t GetFrameCount() const { return blocks * VAG_BLOCK_SAMPLES / channels; }
+
+    bool HasIndex() const { return interval != 0; }
+
+    static std::string IndexPath(const std::string& vagPath) { return vagPath + ".idx"; }
+
+    /* Decodes one block from the history of the block before it and advances the history. */
+    static void DecodeBlock(const uint8_t* block, int32_t& hist_1, int32_t& hist_2, int16_t* outBuf)
+    {
+        static constexpr int32_t declut[VAG_PREDICTORS][2] = { { 0, 0 }, { 60, 0 }, { 115, -52 }, { 98, -55 }, { 122, -60 } };
+
+        int predict = std::min(block[0] >> 4, VAG_PREDICTORS - 1);
+        int shift = block[0] & 0x0F;
+        if (shift > 12)
+            shift = 9; // the SPU treats the reserved shifts like 9
+
+        for (int k = 0; k < VAG_BLOCK_SAMPLES; k++)
+        {
+            int32_t nibble = (block[2 + k / 2] >> ((k & 1) * 4)) & 0x0F;
+            int32_t delta = static_cast<int16_t>(nibble << 12) >> shift;
+            int32_t sample = delta + ((hist_1 * declut[predict][0] + hist_2 * declut[predict][1] + 32) >> 6);
+            sample = std::min(std::max(sample, static_cast<int32_t>(std::numeric_limits<int16_t>::min())),
+                static_cast<int32_t>(std::numeric_limits<int16_t>::max()));
+
+            outBuf[k] = static_cast<int16_t>(sample);
+            hist_2 = hist_1;
+            hist_1 = sample;
+        }
+    }
+
+    /*
+     * Builds the checkpoint index. Runs of checkpoints are decoded in parallel from silent
+     * history, then fixed up in order from the true end of the run before them. The fix-up
+     * stops at the first checkpoint that already agrees, which any predictor 0 block or
+     * clipped sample brings about quickly, so it rarely touches more than a few blocks.
+     */
+    void BuildIndex(uint32_t blockInterval = DEFAULT_INTERVAL)
+    {
+        TRACE_SCOPE("BuildIndex", path);
+        TRACE_BYTES(blocks * VAG_BLOCK_SIZE);
+        if (!blockInterval)
+            throw std::runtime_error("Index interval must be at least one block");
+
+        uint64_t count = (blocks + blockInterval - 1) / blockInterval;
+        uint64_t runLength = std::max<uint64_t>(1, count / (4 * ThreadPool::DefaultThreads()));
+        uint64_t runs = (count + runLength - 1) / runLength;
+
+        std::vector<Checkpoint> index(count);
+        std::vector<Checkpoint> runEnd(runs);
+        std::vector<uint8_t> data = ReadBlocks(0, blocks);
+
+        auto decodeSpan = [&](uint64_t span, int32_t& hist_1, int32_t& hist_2) {
+            int16_t outBuf[VAG_BLOCK_SAMPLES];
+            uint64_t end = std::min(blocks, (span + 1) * blockInterval);
+            for (uint64_t block = span * blockInterval; block < end; block++)
+                DecodeBlock(data.data() + block * VAG_BLOCK_SIZE, hist_1, hist_2, outBuf);
+        };
+
+        ThreadPool::Shared().ParallelFor(runs, [&](uint64_t run) {
+            int32_t hist_1 = 0, hist_2 = 0;
+            for (uint64_t span = run * runLength; span < std::min(count, (run + 1) * runLength); span++)
+            {
+                index[span] = { static_cast<int16_t>(hist_1), static_cast<int16_t>(hist_2) };
+                decodeSpan(span, hist_1, hist_2);
+            }
+            runEnd[run] = { static_cast<int16_t>(hist_1), static_cast<int16_t>(hist_2) };
+        });
+
+        for (uint64_t run = 1; run < runs; run++)
+        {
+            int32_t hist_1 = runEnd[run - 1].hist_1, hist_2 = runEnd[run - 1].hist_2;
+            bool converged = false;
+            for (uint64_t span = run * runLength; span < std::min(count, (run + 1) * runLength); span++)
+            {
+                if (index[span].hist_1 == hist_1 && index[span].hist_2 == hist_2)
+                {
+                    converged = true;
+                    break;
+                }
+                index[span] = { static_cast<int16_t>(hist_1), static_cast<int16_t>(hist_2) };
+                decodeSpan(span, hist_1, hist_2);
+            }
+            if (!converged)
+                runEnd[run] = { static_cast<int16_t>(hist_1), static_cast<int16_t>(hist_2) };
+        }
+
+        checkpoints = std::move(index);
+        interval = blockInterval;
+    }
+
+    /* Loads the sidecar index, false if it is missing or was built for a different file. */
+    bool LoadIndex(const std::string& indexPath)
+    {
+        std::ifstream stream(indexPath, std::ios::binary);
+        if (!stream.is_open())
+            return false;
+
+        VagIndexHeader header{};
+        if (!stream.read(reinterpret_cast<char*>(&header), sizeof(header)))
+            return false;
+
+        // a re-encode with other options can keep the size, so some of the data has to match too
+        if (!std::equal(header.magic, header.magic + 4, "VIDX") || header.version != INDEX_VERSION || !header.interval
+            || header.vagSize != vagSize || header.blocks != blocks
+            || header.count != (blocks + header.interval - 1) / header.interval
+            || header.dataHash != DataHash(header.interval))
+            return false;
+
+        std::vector<Checkpoint> index(header.count);
+        if (!stream.read(reinterpret_cast<char*>(index.data()), index.size() * sizeof(Checkpoint)))
+            return false;
+
+        checkpoints = std::move(index);
+        interval = header.interval;
+        return true;
+    }
+
+    void SaveIndex(const std::string& indexPath) const
+    {
+        if (!HasIndex())
+            throw std::runtime_error("No index to save for " + path);
+
+        std::ofstream stream(indexPath, std::ios::binary);
+        if (!stream.is_open())
+            throw std::runtime_error("Cannot open index output file " + indexPath);
+
+        VagIndexHeader header{};
+        std::copy_n("VIDX", 4, header.magic);
+        header.version = INDEX_VERSION;
+        header.interval = interval;
+        header.count = static_cast<uint32_t>(checkpoints.size());
+        header.vagSize = vagSize;
+        header.blocks = blocks;
+        header.dataHash = DataHash(interval);
+
+        stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        stream.write(reinterpret_cast<const char*>(checkpoints.data()), checkpoints.size() * sizeof(Checkpoint));
+    }
+
+    /*
+     * Decodes frames frames starting at firstFrame into outBuffer. With an index every
+     * checkpoint span of the range is decoded on the pool; without one the range is
+     * decoded from the start of the file.
+     */
+    void Decode(uint64_t firstFrame, uint64_t frames, int16_t* outBuffer) const
+    {
+        TRACE_SCOPE("DecodeRange", path);
+        if (firstFrame > GetFrameCount() || frames > GetFrameCount() - firstFrame)
+            throw std::out_of_range("Decode range is past the end of " + path);
+        if (!frames)
+            return;
+
+        uint64_t first = firstFrame * channels;
+        uint64_t last = (firstFrame + frames) * channels;
+        uint64_t endBlock = (last + VAG_BLOCK_SAMPLES - 1) / VAG_BLOCK_SAMPLES;
+        uint64_t span = HasIndex() ? interval : blocks;
+        uint64_t firstSpan = first / VAG_BLOCK_SAMPLES / span;
+        uint64_t lastSpan = (endBlock - 1) / span;
+        uint64_t startBlock = firstSpan * span;
+        std::vector<uint8_t> data = ReadBlocks(startBlock, endBlock - startBlock);
+        TRACE_BYTES((last - first) * sizeof(int16_t));
+
+        ThreadPool::Shared().ParallelFor(lastSpan - firstSpan + 1, [&](uint64_t i) {
+            uint64_t current = firstSpan + i;
+            int32_t hist_1 = HasIndex() ? checkpoints[current].hist_1 : 0;
+            int32_t hist_2 = HasIndex() ? checkpoints[current].hist_2 : 0;
+            int16_t outBuf[VAG_BLOCK_SAMPLES];
+
+            for (uint64_t block = current * span; block < std::min(endBlock, (current + 1) * span); block++)
+            {
+                DecodeBlock(data.data() + (block - startBlock) * VAG_BLOCK_SIZE, hist_1, hist_2, outBuf);
+
+                uint64_t blockStart = block * VAG_BLOCK_SAMPLES;
+                uint64_t from = std::max(first, blockStart);
+                uint64_t to = std::min(last, blockStart + VAG_BLOCK_SAMPLES);
+                if (from < to)
+                    std::copy(outBuf + (from - blockStart), outBuf + (to - blockStart), outBuffer + (from - first));
+            }
+        });
+    }
+
+private:
+    std::string path;
+    VagFileHeader fileHeader{};
+    uint64_t vagSize = 0;
+    uint64_t blocks = 0;
+    uint32_t samplerate = 0;
+    uint16_t channels = 1;
+    uint32_t interval = 0;
+    std::vector<Checkpoint> checkpoints;
+
+    static constexpr uint64_t DATA_OFFSET = sizeof(VagFileHeader) + 16;
+
+    static void Hash(uint64_t& hash, const uint8_t* bytes, uint64_t size)
+    {
+        for (uint64_t i = 0; i < size; i++)
+        {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ull;
+        }
+    }
+
+    /*
+     * 64 bit FNV-1a of the VAG header and, for up to HASH_SAMPLES checkpoints spread over
+     * the file, of the block each one starts at and the block whose history it holds.
+     * Reads a few kilobytes whatever the size of the file.
+     */
+    uint64_t DataHash(uint32_t blockInterval) const
+    {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        Hash(hash, reinterpret_cast<const uint8_t*>(&fileHeader), sizeof(fileHeader));
+
+        uint64_t count = (blocks + blockInterval - 1) / blockInterval;
+        uint64_t step = std::max<uint64_t>(1, count / HASH_SAMPLES);
+        for (uint64_t checkpoint = 0; checkpoint < count; checkpoint += step)
+        {
+            uint64_t block = checkpoint * blockInterval;
+            uint64_t first = block ? block - 1 : block;
+            std::vector<uint8_t> sample = ReadBlocks(first, std::min(blocks, block + 1) - first);
+            Hash(hash, sample.data(), sample.size());
+        }
+        return hash;
+    }
+
+    /* Reads count ADPCM blocks starting at block first. */
+    std::vector<uint8_t> ReadBlocks(uint64_t first, uint64_t count) const
+    {
+        std::vector<uint8_t> bytes(count * VAG_BLOCK_SIZE);
+        if (!count)
+            return bytes;
+
+        std::ifstream stream(path, std::ios::binary);
+        stream.seekg(static_cast<std::streamoff>(DATA_OFFSET + first * VAG_BLOCK_SIZE));
+        if (!stream.read(reinterpret_cast<char*>(bytes.data()), static_cast<std::streamsize>(bytes.size())))
+            throw std::runtime_error("VAG data is truncated in " + path);
+        TRACE_BYTES(bytes.size());
+        return bytes;
+    }
+
+    /*
+     * Reads the header and finds the blocks that play: all of them for a looping stream,
+     * all but the last for one closed by a playback end block.
+     */
+    void Load()
+    {
+        TRACE_SCOPE("LoadVag", path);
+        std::ifstream stream(path, std::ios::binary);
+        if (!stream.is_open())
+            throw std::runtime_error("File is unable to be opened " + path);
+
+        VagFileHeader& header = fileHeader;
+        if (!stream.read(reinterpret_cast<char*>(&header), sizeof(VagFileHeader)))
+            throw std::runtime_error("VAG file is too short");
+
+        std::string magic(header.magic, header.magic + 4);
+        if (magic == "VAGi")
+            throw std::runtime_error("Interleaved VAG files cannot be decoded, " + path);
+        if (magic != "VAGp")
+            throw std::runtime_error("File is not a VAG file " + path);
+
+        vagSize = std::filesystem::file_size(path);
+        samplerate = BYTESWAP(header.sampleRate);
+        channels = std::max<uint16_t>(1, header.channels);
+
+        uint64_t available = vagSize > DATA_OFFSET ? vagSize - DATA_OFFSET : 0;
+        uint64_t dataLength = std::min<uint64_t>(BYTESWAP(header.dataLength), available);
+
+        blocks = dataLength / VAG_BLOCK_SIZE;
+        if (blocks && ReadBlocks(blocks - 1, 1)[1] == VAGF_PLAYBACK_END)
+            blocks--;
+    }
+};
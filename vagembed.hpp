@@ -0,0 +1,82 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "convertpcm16.hpp"
+#include "kernels.hpp"
+#include "vag.hpp"
+
+/*
+ * VAG encoding in constant expressions, for sounds embedded in a binary without a code
+ * generation step. Encode turns an array of interleaved 16 bit samples into the ADPCM
+ * data of a plain VAG, what a .vag file holds after its 64 bytes of header and padding:
+ * the same bytes the encoder produces for those samples in a 16 bit WAV with no loop.
+ * The samples go through the int16 path of ConvertPCM16 with the scalar kernels, the
+ * noise FIR unless NoiseReduce is off, and then the block encoder of CreateVagSamples.
+ *
+ *   constexpr std::array<int16_t, 6> click = { 0, 9000, 18000, -18000, -9000, 0 };
+ *   constexpr auto vag = VagEmbed::Encode(click);
+ *
+ * Each sample costs around a thousand constant evaluation steps; GCC's default limit
+ * fits about 20000 samples, longer sounds need -fconstexpr-ops-limit raised (GCC),
+ * -fconstexpr-steps (Clang) or /constexpr:steps (MSVC).
+ */
+class VagEmbed
+{
+public:
+    VagEmbed() = delete;
+
+    template <size_t N>
+    static constexpr size_t DataSize = static_cast<size_t>(VagFile::PredictSize(N, false));
+
+    template <uint16_t Channels = 1, bool NoiseReduce = true, size_t N>
+    static constexpr std::array<uint8_t, DataSize<N>> Encode(const std::array<int16_t, N>& pcm)
+    {
+        static_assert(Channels > 0 && N % Channels == 0, "the samples have to be whole frames");
+
+        std::array<int16_t, N> converted = Convert<Channels, NoiseReduce>(pcm);
+        std::array<uint8_t, DataSize<N>> vag{};
+        VagBlockEncoder encoder;
+
+        for (size_t block = 0; block * VAG_BLOCK_SAMPLES < N; block++)
+        {
+            // the tail is zero padded, as in CreateVagSamples
+            int16_t chunk[VAG_BLOCK_SAMPLES]{};
+            for (size_t k = 0; k < VAG_BLOCK_SAMPLES && block * VAG_BLOCK_SAMPLES + k < N; k++)
+                chunk[k] = converted[block * VAG_BLOCK_SAMPLES + k];
+            encoder.EncodeBlockScalar(chunk, VagFile::BlockFlags(block, N, 0, 0, false), vag.data() + block * VAG_BLOCK_SIZE);
+        }
+
+        VagFile::WriteTerminator(vag.data() + vag.size() - VAG_BLOCK_SIZE, false);
+        return vag;
+    }
+
+    /* What ConvertPCM16<int16_t>::convert makes of pcm. */
+    template <uint16_t Channels = 1, bool NoiseReduce = true, size_t N>
+    static constexpr std::array<int16_t, N> Convert(const std::array<int16_t, N>& pcm)
+    {
+        std::array<float, N> unpacked{};
+        for (size_t i = 0; i < N; i++)
+            unpacked[i] = static_cast<float>(pcm[i]);
+
+        std::array<int16_t, N> converted{};
+        if constexpr (!NoiseReduce)
+        {
+            kernels::PackInt16Scalar(unpacked.data(), N, converted.data());
+            return converted;
+        }
+
+        // the frames before the first full window pass through, as in ConvertRange
+        constexpr size_t lookbehind = std::min<size_t>(N, (NOISE_FIR_COEFFICIENTS.size() - 1) * Channels);
+        std::array<float, N> filtered{};
+        for (size_t i = 0; i < lookbehind; i++)
+            filtered[i] = unpacked[i];
+        if (N > lookbehind)
+            kernels::Fir4Scalar(unpacked.data() + lookbehind, N - lookbehind, Channels, NOISE_FIR_COEFFICIENTS.data(), filtered.data() + lookbehind);
+
+        kernels::PackInt16Scalar(filtered.data(), N, converted.data());
+        return converted;
+    }
+};
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "threadpool.hpp"
+#include "vag.hpp"
+
+struct vagstream_seek_t;
+typedef struct vagstream_seek_t VagStreamSeek;
+struct vagstream_holder_t;
+typedef struct vagstream_holder_t VagStream;
+
+/* One seek table entry per row of interleave units, both fields big endian like the VAG header. */
+struct vagstream_seek_t
+{
+    uint32_t sample;
+    uint32_t offset;
+};
+
+/*
+ * Interleaved VAG layout for streaming from disc. Every channel is encoded as its own
+ * ADPCM stream and cut into units of interleave bytes; a row holds one unit per channel
+ * and rows are whole sectors, so the runtime refills its buffers with one aligned read.
+ *
+ * The file starts with the VAG header ("VAGi", interleave in reserved4, dataLength per
+ * channel), followed by the seek table: "SEEK", row count, samples per unit, offset of
+ * the first row, then the first sample and file offset of every row. The header area is
+ * padded to a whole sector.
+ *
+ * Every unit loops on itself until the runtime replaces it: its first block starts the
+ * loop, its last block ends it. The last unit stops playback on its final sample block.
+ */
+struct vagstream_holder_t
+{
+    struct vagfile_header_t header{};
+    std::vector<uint8_t> samples;
+    std::vector<VagStreamSeek> seekTable;
+    std::string path;
+    uint32_t interleave;
+    uint32_t sector;
+    uint16_t channels;
+
+    vagstream_holder_t(uint32_t sampleRate, uint16_t channels, std::string filename, uint32_t interleave, uint32_t sector) :
+        path(filename),
+        interleave(interleave),
+        sector(sector),
+        channels(channels)
+    {
+        if (!channels)
+            throw std::runtime_error("Interleaved VAG needs at least one channel");
+
+        // every unit is a loop of its own, which needs separate start and end blocks
+        if (!sector || interleave < 2 * VAG_BLOCK_SIZE || interleave % VAG_BLOCK_SIZE)
+            throw std::runtime_error("Interleave must be a multiple of 16 bytes, at least 32");
+
+        if ((static_cast<uint64_t>(interleave) * channels) % sector)
+            throw std::runtime_error("Interleave times channels must be a multiple of the sector size");
+
+        header.magic[0] = 'V';
+        header.magic[1] = 'A';
+        header.magic[2] = 'G';
+        header.magic[3] = 'i';
+        header.version = BYTESWAP(32);
+        header.reserved4 = BYTESWAP(interleave);
+        header.sampleRate = BYTESWAP(sampleRate);
+        header.channels = static_cast<uint8_t>(channels);
+        // the header has room for the file name, the directories only matter for writing
+        filename = std::filesystem::path(filename).filename().string();
+        auto endIter = (filename.size() <= 16) ? filename.end() : filename.begin() + 16;
+        std::copy(filename.begin(), endIter, &header.filename[0]);
+    }
+
+    uint32_t BlocksPerUnit() const { return interleave / VAG_BLOCK_SIZE; }
+
+    uint64_t RowSize() const { return static_cast<uint64_t>(interleave) * channels; }
+
+    /* Rows needed for frames samples per channel, at least one so an empty input still plays and stops. */
+    uint64_t RowCount(uint64_t frames) const
+    {
+        uint64_t blocks = std::max<uint64_t>(1, (frames + VAG_BLOCK_SAMPLES - 1) / VAG_BLOCK_SAMPLES);
+        return (blocks + BlocksPerUnit() - 1) / BlocksPerUnit();
+    }
+
+    /* Size of the header and seek table, rounded up to whole sectors. */
+    uint64_t HeaderAreaSize(uint64_t rows) const
+    {
+        uint64_t size = sizeof(VagFileHeader) + 16 + rows * sizeof(VagStreamSeek);
+        return (size + sector - 1) / sector * sector;
+    }
+
+    /* Exact size of the interleaved file for frames samples per channel. */
+    uint64_t PredictSize(uint64_t frames) const
+    {
+        uint64_t rows = RowCount(frames);
+        return HeaderAreaSize(rows) + rows * RowSize();
+    }
+
+    static uint8_t UnitBlockFlags(uint64_t block, uint64_t blocksPerUnit, uint64_t lastBlock)
+    {
+        if (block == lastBlock)
+            return VAGF_LOOP_LAST_BLOCK;
+
+        uint64_t position = block % blocksPerUnit;
+        if (position == blocksPerUnit - 1)
+            return VAGF_LOOP_END;
+        if (position == 0)
+            return VAGF_LOOP_START;
+        return VAGF_LOOP_REGION;
+    }
+
+    /*
+     * Encodes len interleaved samples. Channels are independent ADPCM streams, so each one
+     * is encoded on the pool straight into its units of the interleaved data.
+     */
+    template <typename T_Sample>
+    void CreateVagSamples(const T_Sample *insamples, uint64_t len)
+    {
+        TRACE_SCOPE("CreateVagSamples");
+        TRACE_BYTES(len * sizeof(T_Sample));
+        uint64_t frames = len / channels;
+        uint64_t rows = RowCount(frames);
+        uint64_t blocksPerUnit = BlocksPerUnit();
+        uint64_t dataBlocks = std::max<uint64_t>(1, (frames + VAG_BLOCK_SAMPLES - 1) / VAG_BLOCK_SAMPLES);
+
+        samples.assign(rows * RowSize(), 0);
+
+        ThreadPool::Shared().ParallelFor(channels, [&](uint64_t channel) {
+            COUNTER_SCOPE(ENCODE);
+            VagBlockEncoder encoder;
+            T_Sample chunk[VAG_BLOCK_SAMPLES];
+
+            for (uint64_t block = 0; block < rows * blocksPerUnit; block++)
+            {
+                uint64_t row = block / blocksPerUnit;
+                uint8_t *outBuffer = samples.data() + row * RowSize() + channel * interleave + (block % blocksPerUnit) * VAG_BLOCK_SIZE;
+
+                if (block >= dataBlocks)
+                {
+                    // padding after the end of playback is never reached by the voice
+                    outBuffer[1] = VAGF_PLAYBACK_END;
+                    continue;
+                }
+
+                uint64_t first = block * VAG_BLOCK_SAMPLES;
+                for (uint64_t k = 0; k < VAG_BLOCK_SAMPLES; k++)
+                    chunk[k] = first + k < frames ? insamples[(first + k) * channels + channel] : T_Sample{};
+
+                encoder.EncodeBlock(chunk, UnitBlockFlags(block, blocksPerUnit, dataBlocks - 1), outBuffer);
+            }
+        });
+
+        uint64_t dataOffset = HeaderAreaSize(rows);
+        uint64_t samplesPerUnit = blocksPerUnit * VAG_BLOCK_SAMPLES;
+        uint64_t fileSize = dataOffset + samples.size();
+        if (fileSize > std::numeric_limits<uint32_t>::max())
+            throw std::runtime_error("Interleaved VAG exceeds the 4 GB limit of the seek table");
+
+        seekTable.resize(rows);
+        for (uint64_t row = 0; row < rows; row++)
+        {
+            seekTable[row].sample = BYTESWAP(static_cast<uint32_t>(std::min(row * samplesPerUnit, frames)));
+            seekTable[row].offset = BYTESWAP(static_cast<uint32_t>(dataOffset + row * RowSize()));
+        }
+
+        header.dataLength = BYTESWAP(static_cast<uint32_t>(rows * interleave));
+    }
+
+    void WriteVagFile()
+    {
+        TRACE_SCOPE("WriteVagFile", path);
+        std::ofstream stream(path, std::ios::binary);
+
+        if (!stream.is_open())
+            throw std::runtime_error("Cannot open VAG output file " + path);
+
+        WriteVagFile(stream);
+    }
+
+    void WriteVagFile(std::ostream &stream)
+    {
+        COUNTER_SCOPE(WRITE);
+        uint64_t rows = seekTable.size();
+        uint32_t tableHeader[4] = {
+            0,
+            BYTESWAP(static_cast<uint32_t>(rows)),
+            BYTESWAP(BlocksPerUnit() * VAG_BLOCK_SAMPLES),
+            BYTESWAP(static_cast<uint32_t>(HeaderAreaSize(rows))) };
+        std::copy_n("SEEK", 4, reinterpret_cast<char *>(&tableHeader[0]));
+
+        std::vector<char> area(HeaderAreaSize(rows), 0);
+        char *out = area.data();
+        out = std::copy_n(reinterpret_cast<const char *>(&header), sizeof(VagFileHeader), out);
+        out = std::copy_n(reinterpret_cast<const char *>(tableHeader), sizeof(tableHeader), out);
+        std::copy_n(reinterpret_cast<const char *>(seekTable.data()), rows * sizeof(VagStreamSeek), out);
+
+        stream.write(area.data(), area.size());
+        stream.write(reinterpret_cast<const char *>(samples.data()), samples.size());
+        TRACE_BYTES(area.size() + samples.size());
+    }
+};
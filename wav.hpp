@@ -1,6 +1,7 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
 #include <iostream>
 #include <iterator>
 #include <memory>
@@ -31,12 +32,24 @@ struct wavfile_header_t
 struct wavfile_holder_t : public File
 {
     WavFileHeader header{};
+    uint64_t dataSize{};
     wavfile_holder_t() = delete;
-    wavfile_holder_t(std::string name)
+    wavfile_holder_t(std::string name, bool headerOnly = false)
     {
+        headeronly = headerOnly;
         LoadWavFile(name);
     }
 
+    /*
+     * Parses the headers of a pipe or other stream, the samples are read on demand with
+     * FillSamples. Without streaming the whole stream is read up front, like a file.
+     */
+    explicit wavfile_holder_t(std::istream& stream, bool streaming = true)
+    {
+        streamed = streaming;
+        LoadWavStream(stream);
+    }
+
     ~wavfile_holder_t() = default;
 
     enum AudioFormatCode
@@ -46,55 +59,177 @@ struct wavfile_holder_t : public File
         Float = 3,
         ALaw = 6,
         ULaw = 7,
+        IMAADPCM = 0x11,
         Extensible = 0xFFFE
     };
 
+    enum ContainerType
+    {
+        RIFF,
+        RF64,
+        WAVE64
+    };
+
+    /* Writes frames of interleaved 16 bit PCM as a plain RIFF file. */
+    static void WriteWavFile(const std::string& path, uint32_t sampleRate, uint16_t channels, const int16_t* pcm, uint64_t frames)
+    {
+        TRACE_SCOPE("WriteWavFile", path);
+        std::ofstream stream(path, std::ios::binary);
+        if (!stream.is_open())
+            throw std::runtime_error("Cannot open WAV output file " + path);
+
+        WriteWavFile(stream, sampleRate, channels, pcm, frames);
+    }
+
+    static void WriteWavFile(std::ostream& stream, uint32_t sampleRate, uint16_t channels, const int16_t* pcm, uint64_t frames)
+    {
+        uint64_t dataLength = frames * channels * sizeof(int16_t);
+        if (dataLength > 0xFFFFFFFF - 36)
+            throw std::runtime_error("Decoded audio exceeds the 4 GB limit of a RIFF file");
+
+        WavFileHeader header{};
+        std::copy_n("RIFF", 4, header.riff_tag);
+        std::copy_n("WAVE", 4, header.wav_tag);
+        std::copy_n("fmt ", 4, header.fmt_tag);
+        std::copy_n("data", 4, header.data_tag);
+        header.riff_length = static_cast<uint32_t>(36 + dataLength);
+        header.fmt_length = 16;
+        header.audio_format = PCM;
+        header.num_channels = static_cast<int16_t>(channels);
+        header.sample_rate = sampleRate;
+        header.byte_rate = sampleRate * channels * sizeof(int16_t);
+        header.block_align = static_cast<int16_t>(channels * sizeof(int16_t));
+        header.bits_per_sample = 16;
+        header.data_length = static_cast<uint32_t>(dataLength);
+
+        stream.write(reinterpret_cast<const char*>(&header), sizeof(WavFileHeader));
+        stream.write(reinterpret_cast<const char*>(pcm), dataLength);
+        TRACE_BYTES(sizeof(WavFileHeader) + dataLength);
+    }
+
 private:
+    ContainerType container = RIFF;
+    uint64_t ds64DataSize{};
+    uint16_t formatCode{};
+    uint16_t samplesPerBlock{};
+    uint64_t factFrames{};
+    uint64_t dataPadding{};
+    uint64_t cueStart = UINT64_MAX;
+    std::vector<std::pair<int16_t, int16_t>> adpcmCoefs;
+
+    /* Sony Wave64 chunk GUIDs share this tail, their first four bytes are the RIFF FourCC. */
+    static constexpr std::array<uint8_t, 12> wave64GuidTail = { 0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A };
+    static constexpr std::array<uint8_t, 16> wave64RiffGuid = { 'r', 'i', 'f', 'f', 0x2E, 0x91, 0xCF, 0x11, 0xA5, 0xD6, 0x28, 0xDB, 0x04, 0xC1, 0x00, 0x00 };
+
+    template <typename IntType> static IntType ReadLittleEndian(const uint8_t* buffer)
+    {
+        IntType value{};
+        for (size_t i = 0; i < sizeof(IntType); i++)
+            value |= static_cast<IntType>(static_cast<IntType>(buffer[i]) << (8 * i));
+        return value;
+    }
+
+    static bool ReadBytes(std::istream& stream, uint8_t* buffer, size_t count)
+    {
+        stream.read(reinterpret_cast<char*>(buffer), count);
+        return static_cast<size_t>(stream.gcount()) == count;
+    }
+
     void LoadWavFile(std::string name)
     {
-        auto filedata = LoadFile(name);
+        std::ifstream filehandle(name, std::ios::binary);
 
-        std::vector<uint8_t>::iterator buffer = filedata.begin();
+        if (!filehandle.is_open())
+            throw std::runtime_error("File is unable to be opened");
 
-        std::copy(buffer, buffer + 36, &header.riff_tag[0]);
+        LoadWavStream(filehandle);
+    }
 
-        buffer = filedata.begin() + 20 + header.fmt_length;
+    void LoadWavStream(std::istream& stream)
+    {
+        TRACE_SCOPE("ParseWav");
+        ReadContainerHeader(stream);
 
-        std::string data(buffer, buffer + 4);
-        
-        if (data == "data")
-            std::copy(data.begin(), data.end(), &header.data_tag[0]);
-        else
-             throw std::runtime_error("WAV file does not have DATA tag");   
+        bool foundFormat = false, foundData = false;
+        std::string chunkID;
+        uint64_t chunkSize;
 
-        buffer += 4;
+        while (!foundData && ReadChunkHeader(stream, chunkID, chunkSize))
+        {
+            if (chunkID == "fmt ")
+            {
+                ReadFormatChunk(stream, chunkSize);
+                foundFormat = true;
+            }
+            else if (chunkID == "ds64")
+            {
+                ReadDs64Chunk(stream, chunkSize);
+            }
+            else if (chunkID == "fact" && chunkSize >= 4)
+            {
+                uint8_t frames[4];
+                if (!ReadBytes(stream, frames, 4))
+                    throw std::runtime_error("WAV FACT chunk is truncated");
+                factFrames = ReadLittleEndian<uint32_t>(frames);
+                SkipChunk(stream, chunkSize - 4);
+            }
+            else if (chunkID == "smpl" || chunkID == "cue ")
+            {
+                ReadLoopChunk(stream, chunkID, chunkSize);
+            }
+            else if (chunkID == "data")
+            {
+                if (!foundFormat)
+                    throw std::runtime_error("WAV file has DATA before FMT chunk");
 
-        std::copy(buffer, buffer + 4, reinterpret_cast<uint8_t *>(&header.data_length));
+                if (container == RF64 && chunkSize == 0xFFFFFFFF)
+                    chunkSize = ds64DataSize;
 
-        int dataSize = header.data_length;
+                // streamed writers leave the size at 0 or -1, trust the file length instead
+                uint64_t remaining = RemainingBytes(stream);
+                if (remaining != UINT64_MAX && (chunkSize > remaining || chunkSize == 0))
+                    chunkSize = remaining;
 
-        buffer += 4;
+                // a pipe has no length to fall back on, the data runs to its end
+                bool unknownSize = remaining == UINT64_MAX && (chunkSize == 0 || chunkSize == 0xFFFFFFFF);
 
-        samples = new (std::nothrow) uint8_t[dataSize];
+                std::copy_n(chunkID.data(), 4, header.data_tag);
+                header.data_length = static_cast<uint32_t>(std::min<uint64_t>(chunkSize, 0xFFFFFFFF));
 
-        if (!samples)
-        {   
-            std::cerr << "Unable to create WAV samples buffer\n";
-            throw std::bad_alloc();
+                dataSize = unknownSize ? ReadSamplesToEnd(stream) : ReadSamples(stream, chunkSize);
+                dataPadding = ChunkPadding(chunkSize);
+                // ADPCM files may end on a short block, the decoders handle it
+                if (header.block_align > 0 && formatCode != MSADPCM && formatCode != IMAADPCM)
+                    dataSize -= dataSize % header.block_align;
+                foundData = true;
+            }
+            else
+            {
+                SkipChunk(stream, chunkSize);
+            }
         }
 
-        std::copy(buffer, buffer + dataSize, samples);
+        if (!foundData)
+            throw std::runtime_error("WAV file does not have DATA tag");
 
         channels = header.num_channels;
         samplerate = header.sample_rate;
         samplessize = dataSize;
         bps = header.bits_per_sample;
 
-        switch (header.audio_format)
+        // only plain PCM and float are converted straight from a partially read stream
+        if (formatCode != PCM && formatCode != Float)
+            FillSamples(UINT64_MAX);
+
+        switch (formatCode)
         {
             case PCM:
                 break;
             case MSADPCM:
+                MSADPCMDecompression(static_cast<uint16_t>(header.block_align), samplesPerBlock, adpcmCoefs);
+                break;
+            case IMAADPCM:
+                IMAADPCMDecompression(static_cast<uint16_t>(header.block_align), samplesPerBlock);
                 break;
             case Float:
                 isfloat = true;
@@ -105,10 +240,254 @@ private:
             case ULaw:
                 ULawDecompression();
                 break;
-            case Extensible:
-                break;
             default:
                 break;
         }
+
+        // the last ADPCM block may carry padding codes, the FACT chunk has the real length
+        if ((formatCode == MSADPCM || formatCode == IMAADPCM) && factFrames && channels)
+            samplessize = std::min<uint64_t>(samplessize, factFrames * channels * 2);
+
+        // most writers put smpl and cue after the samples, a pipe still being read cannot get there
+        if (!IsStreaming())
+            ReadTrailingChunks(stream);
+
+        if (!looped && cueStart != UINT64_MAX)
+        {
+            looped = true;
+            loopstart = cueStart;
+            loopend = UINT64_MAX;
+        }
+    }
+
+    /*
+     * Loop points: the first loop of a smpl chunk, whose end frame is inclusive, or failing
+     * that the earliest cue point, which loops from there to the end of the samples.
+     */
+    void ReadLoopChunk(std::istream& stream, const std::string& chunkID, uint64_t chunkSize)
+    {
+        if (chunkSize > (1u << 20))
+        {
+            SkipChunk(stream, chunkSize);
+            return;
+        }
+
+        std::vector<uint8_t> body(chunkSize);
+        if (!ReadBytes(stream, body.data(), body.size()))
+            throw std::runtime_error("WAV " + chunkID + " chunk is truncated");
+        SkipBytes(stream, ChunkPadding(chunkSize));
+
+        if (chunkID == "smpl" && body.size() >= 60 && ReadLittleEndian<uint32_t>(&body[28]) > 0)
+        {
+            uint32_t start = ReadLittleEndian<uint32_t>(&body[36 + 8]);
+            uint32_t end = ReadLittleEndian<uint32_t>(&body[36 + 12]);
+            if (end >= start)
+            {
+                looped = true;
+                loopstart = start;
+                loopend = static_cast<uint64_t>(end) + 1;
+            }
+        }
+        else if (chunkID == "cue " && body.size() >= 4)
+        {
+            uint64_t count = std::min<uint64_t>(ReadLittleEndian<uint32_t>(&body[0]), (body.size() - 4) / 24);
+            for (uint64_t i = 0; i < count; i++)
+                cueStart = std::min<uint64_t>(cueStart, ReadLittleEndian<uint32_t>(&body[4 + i * 24 + 20]));
+        }
+    }
+
+    /* Chunks after the samples only carry optional metadata, a damaged tail leaves the file as it was. */
+    void ReadTrailingChunks(std::istream& stream)
+    {
+        try
+        {
+            std::string chunkID;
+            uint64_t chunkSize;
+            if (!SkipBytes(stream, dataPadding))
+                return;
+
+            while (ReadChunkHeader(stream, chunkID, chunkSize))
+            {
+                if (chunkID == "smpl" || chunkID == "cue ")
+                    ReadLoopChunk(stream, chunkID, chunkSize);
+                else if (!SkipBytes(stream, chunkSize + ChunkPadding(chunkSize)))
+                    return;
+            }
+        }
+        catch (const std::runtime_error&)
+        {
+        }
     }
-};
\ No newline at end of file
+
+    void ReadContainerHeader(std::istream& stream)
+    {
+        uint8_t tag[16];
+
+        if (!ReadBytes(stream, tag, 12))
+            throw std::runtime_error("WAV file is too short");
+
+        std::string riff(tag, tag + 4);
+
+        if (riff == "RIFF" || riff == "RF64" || riff == "BW64")
+        {
+            container = (riff == "RIFF") ? RIFF : RF64;
+            std::copy(tag, tag + 4, &header.riff_tag[0]);
+            header.riff_length = ReadLittleEndian<uint32_t>(tag + 4);
+            std::copy(tag + 8, tag + 12, &header.wav_tag[0]);
+        }
+        else if (std::equal(wave64RiffGuid.begin(), wave64RiffGuid.begin() + 12, tag))
+        {
+            uint8_t rest[28];
+            if (!ReadBytes(stream, rest, 28) || !std::equal(wave64RiffGuid.begin() + 12, wave64RiffGuid.end(), rest))
+                throw std::runtime_error("Invalid Wave64 header");
+
+            container = WAVE64;
+            std::copy(tag, tag + 4, &header.riff_tag[0]);
+            header.riff_length = static_cast<uint32_t>(std::min<uint64_t>(ReadLittleEndian<uint64_t>(rest + 4), 0xFFFFFFFF));
+            std::copy(rest + 12, rest + 16, &header.wav_tag[0]);
+            if (!std::equal(wave64GuidTail.begin(), wave64GuidTail.end(), rest + 16))
+                throw std::runtime_error("Wave64 file is not of WAVE type");
+        }
+        else
+        {
+            throw std::runtime_error("File is not a RIFF, RF64, BW64 or Wave64 file");
+        }
+
+        if (std::string(reinterpret_cast<char*>(header.wav_tag), 4) != "WAVE" && std::string(reinterpret_cast<char*>(header.wav_tag), 4) != "wave")
+            throw std::runtime_error("File is not a WAVE file");
+    }
+
+    /* Returns the chunk ID as a FourCC and the size of the chunk body. */
+    bool ReadChunkHeader(std::istream& stream, std::string& chunkID, uint64_t& chunkSize)
+    {
+        uint8_t tag[24];
+
+        if (container != WAVE64)
+        {
+            if (!ReadBytes(stream, tag, 8))
+                return false;
+            chunkID.assign(tag, tag + 4);
+            chunkSize = ReadLittleEndian<uint32_t>(tag + 4);
+            return true;
+        }
+
+        if (!ReadBytes(stream, tag, 24))
+            return false;
+
+        chunkID.assign(tag, tag + 4);
+        if (!std::equal(wave64GuidTail.begin(), wave64GuidTail.end(), tag + 4))
+            chunkID = "????";
+
+        chunkSize = ReadLittleEndian<uint64_t>(tag + 16);
+        if (chunkSize < 24)
+            throw std::runtime_error("Invalid Wave64 chunk size");
+        chunkSize -= 24;
+        return true;
+    }
+
+    /* RIFF chunks are padded to even sizes, Wave64 chunks to multiples of eight. */
+    uint64_t ChunkPadding(uint64_t chunkSize) const
+    {
+        if (container == WAVE64)
+            return (8 - (chunkSize % 8)) % 8;
+        return chunkSize % 2;
+    }
+
+    void SkipChunk(std::istream& stream, uint64_t chunkSize)
+    {
+        if (!SkipBytes(stream, chunkSize + ChunkPadding(chunkSize)))
+            throw std::runtime_error("WAV file chunk is truncated");
+    }
+
+    /*
+     * Reads the FMT chunk. The parser looks at no more than the MS ADPCM fields with a full
+     * table of coefficient pairs, anything past that is skipped rather than read, so a
+     * damaged size cannot make it allocate gigabytes.
+     */
+    void ReadFormatChunk(std::istream& stream, uint64_t chunkSize)
+    {
+        static constexpr uint64_t MAX_FORMAT = 22 + 0xFFFFull * 4;
+
+        if (chunkSize < 16)
+            throw std::runtime_error("WAV FMT chunk is too short");
+
+        std::vector<uint8_t> format(std::min(chunkSize, MAX_FORMAT));
+        if (!ReadBytes(stream, format.data(), format.size()))
+            throw std::runtime_error("WAV FMT chunk is truncated");
+        if (!SkipBytes(stream, chunkSize - format.size() + ChunkPadding(chunkSize)))
+            throw std::runtime_error("WAV FMT chunk is truncated");
+
+        std::copy_n("fmt ", 4, &header.fmt_tag[0]);
+        header.fmt_length = static_cast<uint32_t>(chunkSize);
+        header.audio_format = ReadLittleEndian<int16_t>(&format[0]);
+        header.num_channels = ReadLittleEndian<int16_t>(&format[2]);
+        header.sample_rate = ReadLittleEndian<uint32_t>(&format[4]);
+        header.byte_rate = ReadLittleEndian<uint32_t>(&format[8]);
+        header.block_align = ReadLittleEndian<int16_t>(&format[12]);
+        header.bits_per_sample = ReadLittleEndian<int16_t>(&format[14]);
+
+        formatCode = static_cast<uint16_t>(header.audio_format);
+
+        // WAVE_FORMAT_EXTENSIBLE keeps the real format code at the start of the SubFormat GUID
+        if (formatCode == Extensible && chunkSize >= 40)
+            formatCode = ReadLittleEndian<uint16_t>(&format[24]);
+
+        if (formatCode == MSADPCM || formatCode == IMAADPCM)
+            ReadADPCMFormat(format);
+    }
+
+    /*
+     * ADPCM formats extend the FMT chunk with the samples per block and, for MS ADPCM,
+     * the predictor coefficient pairs. Missing fields fall back to the values implied
+     * by the block size and the seven standard coefficient pairs.
+     */
+    void ReadADPCMFormat(const std::vector<uint8_t>& format)
+    {
+        static const std::vector<std::pair<int16_t, int16_t>> standardCoefs = {
+            { 256, 0 }, { 512, -256 }, { 0, 0 }, { 192, 64 }, { 240, 0 }, { 460, -208 }, { 392, -232 } };
+
+        uint32_t channelCount = static_cast<uint16_t>(header.num_channels);
+        uint32_t blockAlign = static_cast<uint16_t>(header.block_align);
+        if (!channelCount || header.bits_per_sample != 4)
+            throw std::runtime_error("Unsupported ADPCM WAV format");
+
+        uint16_t extraSize = format.size() >= 18 ? ReadLittleEndian<uint16_t>(&format[16]) : 0;
+        if (extraSize >= 2 && format.size() >= 20)
+            samplesPerBlock = ReadLittleEndian<uint16_t>(&format[18]);
+
+        if (formatCode == IMAADPCM)
+        {
+            if (!samplesPerBlock && blockAlign > 4 * channelCount)
+                samplesPerBlock = static_cast<uint16_t>((blockAlign - 4 * channelCount) * 2 / channelCount + 1);
+            return;
+        }
+
+        if (!samplesPerBlock && blockAlign > 7 * channelCount)
+            samplesPerBlock = static_cast<uint16_t>((blockAlign - 7 * channelCount) * 2 / channelCount + 2);
+
+        adpcmCoefs = standardCoefs;
+        if (extraSize >= 4 && format.size() >= 22)
+        {
+            uint16_t coefCount = ReadLittleEndian<uint16_t>(&format[20]);
+            if (coefCount && format.size() >= 22u + coefCount * 4u)
+            {
+                adpcmCoefs.clear();
+                for (uint16_t i = 0; i < coefCount; i++)
+                    adpcmCoefs.emplace_back(ReadLittleEndian<int16_t>(&format[22 + i * 4]), ReadLittleEndian<int16_t>(&format[24 + i * 4]));
+            }
+        }
+    }
+
+    void ReadDs64Chunk(std::istream& stream, uint64_t chunkSize)
+    {
+        if (chunkSize < 24)
+            throw std::runtime_error("RF64 DS64 chunk is too short");
+
+        uint8_t sizes[24];
+        if (!ReadBytes(stream, sizes, 24))
+            throw std::runtime_error("RF64 DS64 chunk is truncated");
+
+        ds64DataSize = ReadLittleEndian<uint64_t>(sizes + 8);
+        SkipChunk(stream, chunkSize - 24);
+    }
+};